@@ -0,0 +1,8 @@
+/*
+Forced into pmmngr.c for the host build. Its CR0 and CR3 helpers are 32-bit
+privileged code that won't assemble for the host and are never called by the
+harness, so their inline assembly is compiled out.
+*/
+
+#define __asm__
+#define __volatile__(...) ((void)0)
@@ -0,0 +1,18 @@
+#ifndef TYPES_H
+#define TYPES_H
+
+/*
+Host replacement for the kernel's and the C library's types.h, found first on
+the include path when the allocators are built for the harness. long is 64 bits
+on the host, so the fixed size types come from the host's headers instead.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t bool;
+
+#define FALSE (bool)0
+#define TRUE (bool)1
+
+#endif
@@ -0,0 +1,787 @@
+/*
+Lithium OS allocator test and benchmark harness.
+
+Builds the kernel heap (kernel/memory/kmalloc.c), the physical memory manager
+(kernel/memory/pmmngr.c) and the C library heap (api/stdlib/malloc.c) as they
+are for the host, over the stand-ins in stubs.c, and replays allocation traces
+against them. For each allocator and trace it reports operations per second,
+median and 99th percentile latency, the peak heap size, the peak amount
+allocated and how much of the heap was lost to fragmentation at the peak.
+
+Every block is filled with a pattern when it is allocated and checked when it
+is freed, and addresses are checked for alignment and range. Once a trace has
+been replayed and everything freed, each allocator must be back to a single free
+region. Each run is done in a child process so that a crash fails the run
+instead of ending the harness. The exit status is non-zero if any run failed,
+so it can be used as a regression gate (make check).
+
+Traces are either generated (see traceTypes below) or read from a file with
+one operation per line:
+
+	a <id> <size>	Allocate size bytes as block id
+	f <id>			Free block id
+	# ...			Comment
+
+A generated trace can be written out in this format with -w.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "stubs.h"
+
+#define PAGE_SIZE			4096
+#define DEFAULT_OPS			100000
+#define DEFAULT_FRAMES		65536
+#define MAX_TRACE_IDS		0x1000000
+
+#define LIBC_HEAP_END		0xA0000000u
+#define KERNEL_HEAP_END		0xD0000000u
+
+// From pmmngr.h, which can't be included alongside the host's headers
+#define PMMNGR_MAX_ORDER		10
+#define PMMNGR_ZONE_DMA			0
+#define PMMNGR_ZONE_NORMAL		1
+
+// The allocators, built with their own names where they clash with the host's
+bool kmalloc_init(void);
+void *kmalloc(size_t bytes);
+void kfree(void *address);
+bool lilibc_malloc_init(void);
+void *lilibc_malloc(size_t bytes);
+void lilibc_free(void *mem);
+void *pmmngr_alloc_block(void);
+void pmmngr_free_block(uint32_t p);
+void *pmmngr_alloc_blocks(uint32_t amount);
+void pmmngr_free_blocks(void *p, uint32_t amount);
+void pmmngr_get_frame_cache_stats(uint32_t *hits, uint32_t *misses, uint32_t *cached);
+uint32_t pmmngr_get_free_block_count(void);
+uint32_t pmmngr_buddy_free_count(uint32_t zone, uint32_t order);
+void pmmngr_frame_cache_drain(uint32_t count);
+
+// Set by the linker, see the Makefile
+extern uint32_t _KERNEL_END_;
+extern uint32_t __end;
+
+#define KERNEL_HEAP_START	((uint32_t)(uintptr_t)&_KERNEL_END_)
+#define LIBC_HEAP_START		((uint32_t)(uintptr_t)&__end)
+
+typedef struct
+{
+	uint32_t id;
+	uint32_t size;	// 0 to free the block
+} trace_op_t;
+
+typedef struct
+{
+	trace_op_t *ops;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t ids;	// One more than the highest id
+} trace_t;
+
+typedef struct
+{
+	const char *name;
+	uint32_t sizeMin;
+	uint32_t sizeMax;
+	uint32_t maxLive;		// Blocks allocated at once, 0 to grow towards 8192 over the trace
+	uint32_t allocPercent;	// Chance of allocating while below maxLive
+	char order;				// Block freed: r(andom), o(ldest) or n(ewest)
+} trace_type_t;
+
+typedef struct
+{
+	const char *name;
+	uint32_t align;
+	bool pages;		// Sizes are in pages, and blocks are tracked instead of filled
+	bool (*init)(void);
+	void *(*alloc)(uint32_t size);
+	void (*free)(void *address, uint32_t size);
+	uint32_t (*heap_pages)(void);
+	bool (*check)(void);	// Everything has been freed
+	const void *start;	// Lowest address handed out
+	uint32_t end;		// End of the addresses handed out, 0 for the end of physical memory
+} allocator_t;
+
+typedef struct
+{
+	uint32_t ops;
+	uint32_t failures;	// Allocations that returned NULL
+	uint32_t errors;
+	uint64_t totalNs;
+	uint32_t p50Ns;
+	uint32_t p99Ns;
+	uint32_t peakHeapPages;
+	uint64_t peakLiveBytes;
+} result_t;
+
+static const trace_type_t traceTypes[] =
+{
+	{ "small", 8, 256, 2048, 50, 'r' },		// Small objects
+	{ "mixed", 0, 0, 1024, 50, 'r' },		// Mostly small, some large (see trace_size())
+	{ "fifo", 16, 1024, 1024, 50, 'o' },	// Queues and buffers
+	{ "lifo", 16, 1024, 512, 50, 'n' },		// Stack like, freed in reverse
+	{ "grow", 16, 2048, 0, 60, 'r' }		// Steadily growing live set
+};
+
+#define TRACE_TYPES (sizeof(traceTypes) / sizeof(traceTypes[0]))
+
+static uint32_t frameCount = DEFAULT_FRAMES;
+static uint32_t rngState;
+static uint32_t *frameOwners;	// Block id + 1 owning each frame, for the physical memory manager
+static uint32_t initialFreeBlocks;
+static uint32_t initialMaxOrderBlocks[PMMNGR_ZONE_NORMAL + 1];
+static uint32_t singleBlockAllocs;	// Successful ones, made through the frame cache
+
+static void *bench_kmalloc(uint32_t size);
+static void bench_kfree(void *address, uint32_t size);
+static uint32_t bench_kmalloc_pages(void);
+static bool bench_kmalloc_check(void);
+static bool bench_libc_init(void);
+static void *bench_libc_malloc(uint32_t size);
+static void bench_libc_free(void *address, uint32_t size);
+static bool bench_libc_check(void);
+static bool bench_pmmngr_init(void);
+static void *bench_pmmngr_alloc(uint32_t size);
+static void bench_pmmngr_free(void *address, uint32_t size);
+static uint32_t bench_pmmngr_pages(void);
+static bool bench_pmmngr_check(void);
+
+static const allocator_t allocators[] =
+{
+	{ "kmalloc", 8, FALSE, kmalloc_init, bench_kmalloc, bench_kfree, bench_kmalloc_pages, bench_kmalloc_check,
+		&_KERNEL_END_, KERNEL_HEAP_END },
+	{ "libc", 4, FALSE, bench_libc_init, bench_libc_malloc, bench_libc_free, stub_libc_heap_pages, bench_libc_check,
+		&__end, LIBC_HEAP_END },
+	{ "pmmngr", PAGE_SIZE, TRUE, bench_pmmngr_init, bench_pmmngr_alloc, bench_pmmngr_free, bench_pmmngr_pages,
+		bench_pmmngr_check, (const void *)0x100000, 0 }
+};
+
+#define ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+static bool run(const allocator_t *allocator, const char *traceName, const trace_t *trace);
+static bool replay(const allocator_t *allocator, const trace_t *trace, result_t *result);
+static void fill(uint8_t *block, uint32_t size, uint32_t id);
+static bool verify(const uint8_t *block, uint32_t size, uint32_t id);
+static bool trace_generate(trace_t *trace, const char *name, uint32_t count, uint32_t seed);
+static uint32_t trace_size(const trace_type_t *type);
+static bool trace_load(trace_t *trace, const char *path);
+static bool trace_save(const trace_t *trace, const char *path);
+static void trace_add(trace_t *trace, uint32_t id, uint32_t size);
+static uint32_t rng_next(void);
+static int compare_ns(const void *a, const void *b);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+	const char *allocatorName = NULL;
+	const char *traceName = NULL;
+	const char *outPath = NULL;
+	uint32_t count = DEFAULT_OPS;
+	uint32_t seed = 1;
+	int opt;
+
+	while((opt = getopt(argc, argv, "a:t:n:s:m:w:h")) != -1)
+	{
+		switch(opt)
+		{
+		case 'a': allocatorName = optarg; break;
+		case 't': traceName = optarg; break;
+		case 'n': count = (uint32_t)strtoul(optarg, NULL, 0); break;
+		case 's': seed = (uint32_t)strtoul(optarg, NULL, 0); break;
+		case 'm': frameCount = (uint32_t)strtoul(optarg, NULL, 0); break;
+		case 'w': outPath = optarg; break;
+		default: usage(); return 2;
+		}
+	}
+
+	if(count == 0 || seed == 0 || frameCount <= 0x100)
+	{
+		usage();
+		return 2;
+	}
+
+	bool ok = TRUE;
+	bool matched = (allocatorName == NULL);
+
+	for(uint32_t a = 0; a < ALLOCATORS; ++a)
+		matched |= (allocatorName != NULL && strcmp(allocatorName, allocators[a].name) == 0);
+
+	if(!matched)
+	{
+		fprintf(stderr, "no allocator called %s\n", allocatorName);
+		return 2;
+	}
+
+	if(outPath != NULL)
+	{
+		trace_t trace = { NULL, 0, 0, 0 };
+
+		if(traceName == NULL || !trace_generate(&trace, traceName, count, seed) || !trace_save(&trace, outPath))
+		{
+			fprintf(stderr, "can't write a %s trace to %s\n", traceName ? traceName : "(no -t)", outPath);
+			return 2;
+		}
+
+		return 0;
+	}
+
+	for(uint32_t t = 0; t < TRACE_TYPES; ++t)
+	{
+		trace_t trace = { NULL, 0, 0, 0 };
+		const char *name = (traceName != NULL) ? traceName : traceTypes[t].name;
+
+		if(!trace_generate(&trace, name, count, seed) && !trace_load(&trace, name))
+		{
+			fprintf(stderr, "%s isn't a trace type or a readable trace file\n", name);
+			return 2;
+		}
+
+		if(t == 0)
+			printf("%-8s %-10s %9s %11s %7s %7s %9s %9s %6s %7s\n", "alloc", "trace", "ops", "ops/sec",
+				"p50 ns", "p99 ns", "peak KiB", "live KiB", "frag", "failed");
+
+		for(uint32_t a = 0; a < ALLOCATORS; ++a)
+		{
+			if(allocatorName != NULL && strcmp(allocatorName, allocators[a].name) != 0)
+				continue;
+
+			ok &= run(&allocators[a], name, &trace);
+		}
+
+		free(trace.ops);
+
+		// Only the one given with -t
+		if(traceName != NULL)
+			break;
+	}
+
+	return ok ? 0 : 1;
+}
+
+/*
+Replays trace against allocator in a child process and prints the results.
+Returns FALSE if the allocator failed a check or crashed.
+*/
+static bool run(const allocator_t *allocator, const char *traceName, const trace_t *trace)
+{
+	const char *shortName = strrchr(traceName, '/') ? strrchr(traceName, '/') + 1 : traceName;
+
+	fflush(stdout);
+
+	pid_t pid = fork();
+
+	if(pid < 0)
+	{
+		perror("fork");
+		return FALSE;
+	}
+
+	if(pid == 0)
+	{
+		result_t result;
+
+		memset(&result, 0, sizeof(result));
+		stub_init(frameCount);
+
+		if(!allocator->init())
+		{
+			printf("%-8s %-10s initialisation failed\n", allocator->name, shortName);
+			exit(1);
+		}
+
+		bool ok = replay(allocator, trace, &result);
+		double seconds = (double)result.totalNs / 1e9;
+		uint64_t peakHeap = (uint64_t)result.peakHeapPages * PAGE_SIZE;
+
+		printf("%-8s %-10s %9u %11.0f %7u %7u %9llu %9llu %5.1f%% %7u%s\n", allocator->name, shortName,
+			result.ops, seconds > 0 ? result.ops / seconds : 0, result.p50Ns, result.p99Ns,
+			(unsigned long long)(peakHeap / 1024), (unsigned long long)(result.peakLiveBytes / 1024),
+			peakHeap ? 100.0 * (double)(peakHeap - result.peakLiveBytes) / (double)peakHeap : 0.0,
+			result.failures, ok ? "" : "  FAILED");
+		exit(ok ? 0 : 1);
+	}
+
+	int status;
+
+	if(waitpid(pid, &status, 0) < 0)
+	{
+		perror("waitpid");
+		return FALSE;
+	}
+
+	if(WIFSIGNALED(status))
+	{
+		printf("%-8s %-10s crashed (signal %d)  FAILED\n", allocator->name, shortName, WTERMSIG(status));
+		return FALSE;
+	}
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool replay(const allocator_t *allocator, const trace_t *trace, result_t *result)
+{
+	uint8_t **blocks = calloc(trace->ids, sizeof(uint8_t *));
+	uint32_t *sizes = calloc(trace->ids, sizeof(uint32_t));
+	uint32_t *latencies = malloc(((size_t)trace->count + 1) * sizeof(uint32_t));
+	uint32_t start = (uint32_t)(uintptr_t)allocator->start;
+	uint32_t end = allocator->end ? allocator->end : frameCount * PAGE_SIZE;
+	uint64_t liveBytes = 0;
+
+	if(blocks == NULL || sizes == NULL || latencies == NULL)
+	{
+		fprintf(stderr, "out of host memory\n");
+		exit(2);
+	}
+
+	for(uint32_t i = 0; i < trace->count; ++i)
+	{
+		const trace_op_t *op = &trace->ops[i];
+		struct timespec before, after;
+		uint8_t *block = blocks[op->id];
+		uint32_t size = allocator->pages ? (op->size + PAGE_SIZE - 1) / PAGE_SIZE : op->size;
+
+		if(op->size == 0)
+		{
+			// Freeing a block whose allocation failed
+			if(block == NULL)
+				continue;
+
+			if(!allocator->pages && !verify(block, sizes[op->id], op->id))
+			{
+				printf("%s: block %u (%u bytes at 0x%08X) was overwritten\n", allocator->name, op->id,
+					sizes[op->id], (uint32_t)(uintptr_t)block);
+				result->errors++;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &before);
+			allocator->free(block, sizes[op->id]);
+			clock_gettime(CLOCK_MONOTONIC, &after);
+
+			liveBytes -= allocator->pages ? (uint64_t)sizes[op->id] * PAGE_SIZE : sizes[op->id];
+			blocks[op->id] = NULL;
+		}
+		else
+		{
+			clock_gettime(CLOCK_MONOTONIC, &before);
+			block = allocator->alloc(size);
+			clock_gettime(CLOCK_MONOTONIC, &after);
+
+			if(block == NULL)
+				result->failures++;
+			else
+			{
+				uint32_t address = (uint32_t)(uintptr_t)block;
+				uint32_t bytes = allocator->pages ? size * PAGE_SIZE : size;
+
+				if((address & (allocator->align - 1)) || address < start || address - start > end - start - bytes)
+				{
+					printf("%s: block %u (%u bytes) at bad address 0x%08X\n", allocator->name, op->id, bytes,
+						address);
+					result->errors++;
+				}
+				else if(allocator->pages)
+				{
+					for(uint32_t frame = address / PAGE_SIZE; frame < address / PAGE_SIZE + size; ++frame)
+					{
+						if(frameOwners[frame] != 0)
+						{
+							printf("%s: frame 0x%X given to block %u is still block %u's\n", allocator->name,
+								frame, op->id, frameOwners[frame] - 1);
+							result->errors++;
+						}
+
+						frameOwners[frame] = op->id + 1;
+					}
+				}
+				else
+					fill(block, size, op->id);
+
+				blocks[op->id] = block;
+				sizes[op->id] = size;
+				liveBytes += bytes;
+
+				if(liveBytes > result->peakLiveBytes)
+					result->peakLiveBytes = liveBytes;
+			}
+		}
+
+		latencies[result->ops++] = (uint32_t)((after.tv_sec - before.tv_sec) * 1000000000L
+			+ (after.tv_nsec - before.tv_nsec));
+		result->totalNs += latencies[result->ops - 1];
+
+		uint32_t heapPages = allocator->heap_pages();
+
+		if(heapPages > result->peakHeapPages)
+			result->peakHeapPages = heapPages;
+	}
+
+	if(result->ops > 0)
+	{
+		qsort(latencies, result->ops, sizeof(uint32_t), compare_ns);
+		result->p50Ns = latencies[result->ops / 2];
+		result->p99Ns = latencies[(uint32_t)((uint64_t)result->ops * 99 / 100)];
+	}
+
+	// Blocks a trace file left allocated
+	for(uint32_t id = 0; id < trace->ids; ++id)
+	{
+		if(blocks[id] != NULL)
+			allocator->free(blocks[id], sizes[id]);
+	}
+
+	if(!allocator->check())
+	{
+		printf("%s: not back to one free region after freeing everything\n", allocator->name);
+		result->errors++;
+	}
+
+	free(blocks);
+	free(sizes);
+	free(latencies);
+
+	return result->errors == 0;
+}
+
+static void fill(uint8_t *block, uint32_t size, uint32_t id)
+{
+	memset(block, (int)(id * 31 + 7) & 0xFF, size);
+}
+
+static bool verify(const uint8_t *block, uint32_t size, uint32_t id)
+{
+	uint8_t pattern = (uint8_t)(id * 31 + 7);
+
+	for(uint32_t i = 0; i < size; ++i)
+	{
+		if(block[i] != pattern)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void *bench_kmalloc(uint32_t size)
+{
+	return kmalloc(size);
+}
+
+static void bench_kfree(void *address, uint32_t size)
+{
+	(void)size;
+
+	kfree(address);
+}
+
+static uint32_t bench_kmalloc_pages(void)
+{
+	return stub_kernel_heap_pages(KERNEL_HEAP_START);
+}
+
+/*
+With everything freed the heap is one free block, so the smallest allocation
+comes from its start.
+*/
+static bool bench_kmalloc_check(void)
+{
+	void *block = kmalloc(1);
+	bool ok = ((uint32_t)(uintptr_t)block == KERNEL_HEAP_START + 8);
+
+	kfree(block);
+
+	return ok;
+}
+
+static bool bench_libc_init(void)
+{
+	return lilibc_malloc_init();
+}
+
+static void *bench_libc_malloc(uint32_t size)
+{
+	return lilibc_malloc(size);
+}
+
+static void bench_libc_free(void *address, uint32_t size)
+{
+	(void)size;
+
+	lilibc_free(address);
+}
+
+// As for kmalloc, the first block's header is followed by the smallest allocation
+static bool bench_libc_check(void)
+{
+	void *block = lilibc_malloc(1);
+	uint32_t address = (uint32_t)(uintptr_t)block;
+	bool ok = (address > LIBC_HEAP_START && address <= LIBC_HEAP_START + 32);
+
+	lilibc_free(block);
+
+	return ok && lilibc_malloc(1) == block;
+}
+
+static bool bench_pmmngr_init(void)
+{
+	frameOwners = calloc(frameCount, sizeof(uint32_t));
+	initialFreeBlocks = pmmngr_get_free_block_count();
+
+	for(uint32_t zone = 0; zone <= PMMNGR_ZONE_NORMAL; ++zone)
+		initialMaxOrderBlocks[zone] = pmmngr_buddy_free_count(zone, PMMNGR_MAX_ORDER);
+
+	return frameOwners != NULL;
+}
+
+/*
+Single blocks go through pmmngr_alloc_block() and its frame cache, as page
+tables and slabs do, and larger runs come from the buddy allocator.
+*/
+static void *bench_pmmngr_alloc(uint32_t size)
+{
+	if(size == 1)
+	{
+		void *block = pmmngr_alloc_block();
+
+		// Allocations with no memory left fail before reaching the cache
+		if(block != NULL)
+			singleBlockAllocs++;
+
+		return block;
+	}
+
+	return pmmngr_alloc_blocks(size);
+}
+
+static void bench_pmmngr_free(void *address, uint32_t size)
+{
+	uint32_t frame = (uint32_t)(uintptr_t)address / PAGE_SIZE;
+
+	for(uint32_t i = 0; i < size; ++i)
+		frameOwners[frame + i] = 0;
+
+	if(size == 1)
+		pmmngr_free_block((uint32_t)(uintptr_t)address);
+	else
+		pmmngr_free_blocks(address, size);
+}
+
+static uint32_t bench_pmmngr_pages(void)
+{
+	return initialFreeBlocks - pmmngr_get_free_block_count();
+}
+
+/*
+Every block is free and, once the frame cache is drained, merged back into the
+largest buddy blocks. Every single block allocation must also have gone through
+the frame cache.
+*/
+static bool bench_pmmngr_check(void)
+{
+	uint32_t hits, misses, cached;
+
+	pmmngr_frame_cache_drain(0xFFFFFFFF);
+	pmmngr_get_frame_cache_stats(&hits, &misses, &cached);
+
+	bool ok = (pmmngr_get_free_block_count() == initialFreeBlocks) && (cached == 0)
+		&& (hits + misses >= singleBlockAllocs);
+
+	for(uint32_t zone = 0; zone <= PMMNGR_ZONE_NORMAL; ++zone)
+		ok &= (pmmngr_buddy_free_count(zone, PMMNGR_MAX_ORDER) == initialMaxOrderBlocks[zone]);
+
+	return ok;
+}
+
+/*
+Generates count operations of the named trace type, followed by frees of
+whatever is still allocated. Returns FALSE if there is no such type.
+*/
+static bool trace_generate(trace_t *trace, const char *name, uint32_t count, uint32_t seed)
+{
+	const trace_type_t *type = NULL;
+
+	for(uint32_t i = 0; i < TRACE_TYPES; ++i)
+	{
+		if(strcmp(traceTypes[i].name, name) == 0)
+			type = &traceTypes[i];
+	}
+
+	if(type == NULL)
+		return FALSE;
+
+	uint32_t *live = malloc(((size_t)count + 1) * sizeof(uint32_t));
+	uint32_t liveCount = 0;
+
+	rngState = seed;
+
+	for(uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t maxLive = type->maxLive ? type->maxLive : 1 + (uint32_t)((uint64_t)i * 8192 / count);
+
+		if(liveCount == 0 || (liveCount < maxLive && rng_next() % 100 < type->allocPercent))
+		{
+			live[liveCount++] = trace->ids;
+			trace_add(trace, trace->ids, trace_size(type));
+			continue;
+		}
+
+		uint32_t index = (type->order == 'o') ? 0 : (type->order == 'n') ? liveCount - 1 : rng_next() % liveCount;
+
+		trace_add(trace, live[index], 0);
+
+		if(type->order == 'o')
+			memmove(live, live + 1, --liveCount * sizeof(uint32_t));
+		else
+			live[index] = live[--liveCount];
+	}
+
+	while(liveCount > 0)
+		trace_add(trace, live[--liveCount], 0);
+
+	free(live);
+
+	return TRUE;
+}
+
+/*
+Picks a block size for type. The mixed type is mostly small blocks, with a few
+up to 16KiB and fewer up to 256KiB.
+*/
+static uint32_t trace_size(const trace_type_t *type)
+{
+	if(type->sizeMax != 0)
+		return type->sizeMin + rng_next() % (type->sizeMax - type->sizeMin + 1);
+
+	uint32_t r = rng_next() % 100;
+
+	if(r < 90)
+		return 8 + rng_next() % 505;
+	else if(r < 99)
+		return 512 + rng_next() % (16384 - 511);
+	else
+		return 16384 + rng_next() % (262144 - 16383);
+}
+
+/*
+Reads a trace file, checking that blocks are only freed while allocated.
+Returns FALSE if it can't be read or isn't valid.
+*/
+static bool trace_load(trace_t *trace, const char *path)
+{
+	FILE *file = fopen(path, "r");
+
+	if(file == NULL)
+		return FALSE;
+
+	uint8_t *allocated = calloc(MAX_TRACE_IDS, 1);
+	char line[128];
+	uint32_t lineNumber = 0;
+	bool ok = (allocated != NULL);
+
+	while(ok && fgets(line, sizeof(line), file) != NULL)
+	{
+		unsigned long id, size;
+		char op;
+
+		lineNumber++;
+
+		if(line[0] == '#' || line[0] == '\n')
+			continue;
+
+		int fields = sscanf(line, " %c %lu %lu", &op, &id, &size);
+
+		if(fields < 2 || id >= MAX_TRACE_IDS || (op != 'a' && op != 'f') || (op == 'a' && (fields != 3
+			|| size == 0 || size > 0x10000000 || allocated[id])) || (op == 'f' && !allocated[id]))
+		{
+			fprintf(stderr, "%s:%u: invalid operation\n", path, lineNumber);
+			ok = FALSE;
+			break;
+		}
+
+		// Ids can be reused once freed
+		allocated[id] = (op == 'a');
+
+		trace_add(trace, (uint32_t)id, (op == 'a') ? (uint32_t)size : 0);
+	}
+
+	fclose(file);
+	free(allocated);
+
+	return ok;
+}
+
+static bool trace_save(const trace_t *trace, const char *path)
+{
+	FILE *file = fopen(path, "w");
+
+	if(file == NULL)
+		return FALSE;
+
+	fprintf(file, "# %u operations\n", trace->count);
+
+	for(uint32_t i = 0; i < trace->count; ++i)
+	{
+		if(trace->ops[i].size != 0)
+			fprintf(file, "a %u %u\n", trace->ops[i].id, trace->ops[i].size);
+		else
+			fprintf(file, "f %u\n", trace->ops[i].id);
+	}
+
+	return fclose(file) == 0;
+}
+
+static void trace_add(trace_t *trace, uint32_t id, uint32_t size)
+{
+	if(trace->count == trace->capacity)
+	{
+		trace->capacity = trace->capacity ? trace->capacity * 2 : 4096;
+		trace->ops = realloc(trace->ops, trace->capacity * sizeof(trace_op_t));
+
+		if(trace->ops == NULL)
+		{
+			fprintf(stderr, "out of host memory\n");
+			exit(2);
+		}
+	}
+
+	trace->ops[trace->count].id = id;
+	trace->ops[trace->count].size = size;
+	trace->count++;
+
+	if(size != 0 && id >= trace->ids)
+		trace->ids = id + 1;
+}
+
+// xorshift32, so traces are the same everywhere for a given seed
+static uint32_t rng_next(void)
+{
+	rngState ^= rngState << 13;
+	rngState ^= rngState >> 17;
+	rngState ^= rngState << 5;
+
+	return rngState;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: allocbench [-a allocator] [-t trace] [-n ops] [-s seed] [-m frames] [-w file]\n"
+		"  -a  kmalloc, libc or pmmngr (default all)\n"
+		"  -t  small, mixed, fifo, lifo, grow or a trace file (default all generated traces)\n"
+		"  -n  operations in generated traces (default %u)\n"
+		"  -s  seed for generated traces (default 1)\n"
+		"  -m  4KiB frames of physical memory (default %u)\n"
+		"  -w  write the generated trace given with -t to file instead of running it\n",
+		DEFAULT_OPS, DEFAULT_FRAMES);
+}
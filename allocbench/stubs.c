@@ -0,0 +1,244 @@
+/*
+Host stand-ins for what the allocators use from the rest of the system.
+
+Every arena is mapped below 4GiB, since the allocators keep addresses in
+uint32_t. The arenas start out inaccessible and pages are made accessible as
+they are mapped, so touching a page an allocator hasn't mapped (or has given
+back) crashes the run instead of going unnoticed:
+
+	0x60000000	Physical memory manager metadata
+	0x80000000	C library heap, up to its HEAP_END (0xA0000000)
+	0xC0000000	Kernel half, up to the kernel heap's end (0xD0000000). The
+				first KERNEL_WINDOW bytes are mapped from the start like the
+				kernel's own large page, and the heap starts in them at
+				_KERNEL_END_ (set by the Makefile).
+
+Kernel heap pages are backed by blocks from the physical memory manager, as
+they are in the kernel, so low memory shows up in the kernel heap too.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "stubs.h"
+
+#define PAGE_SIZE			4096
+#define METADATA_BASE		0x60000000u
+#define METADATA_SIZE		0x01000000u
+#define LIBC_HEAP_BASE		0x80000000u
+#define LIBC_HEAP_END		0xA0000000u
+#define KERNEL_BASE			0xC0000000u
+#define KERNEL_HEAP_END		0xD0000000u
+#define KERNEL_WINDOW		0x00400000u
+#define KERNEL_PAGES		((KERNEL_HEAP_END - KERNEL_BASE) / PAGE_SIZE)
+#define KERNEL_WINDOW_FRAME	0xFFFFFFFFu // Frame recorded for pages of the kernel window
+
+// Physical memory manager, from pmmngr.c
+void pmmngr_init(uint32_t blockCount, void *bitmap);
+uint32_t pmmngr_bitmap_size(uint32_t blockCount);
+void pmmngr_init_region(uint32_t base, uint32_t size);
+uint32_t pmmngr_buddy_metadata_size(uint32_t blockCount);
+void pmmngr_buddy_init(void *metadata);
+void *pmmngr_alloc_block(void);
+void pmmngr_free_block(uint32_t p);
+
+static uint32_t kernelFrames[KERNEL_PAGES];
+static uint32_t kernelMapped = 0;
+static uint32_t libcMapped = 0;
+
+static void *stub_arena(uint32_t base, uint32_t size);
+static void stub_fail(const char *message, uint32_t addr);
+
+/*
+Maps the arenas and sets up the physical memory manager with blockCount blocks,
+the first 1MiB of which stay in use like they do in the kernel.
+*/
+void stub_init(uint32_t blockCount)
+{
+	stub_arena(METADATA_BASE, METADATA_SIZE);
+	stub_arena(LIBC_HEAP_BASE, LIBC_HEAP_END - LIBC_HEAP_BASE);
+	stub_arena(KERNEL_BASE, KERNEL_HEAP_END - KERNEL_BASE);
+
+	uint32_t bitmapSize = (pmmngr_bitmap_size(blockCount) + 15) & ~15u;
+
+	if(bitmapSize + pmmngr_buddy_metadata_size(blockCount) > METADATA_SIZE)
+		stub_fail("too many blocks for the metadata arena", blockCount);
+
+	mprotect((void *)(uintptr_t)METADATA_BASE, METADATA_SIZE, PROT_READ | PROT_WRITE);
+	mprotect((void *)(uintptr_t)KERNEL_BASE, KERNEL_WINDOW, PROT_READ | PROT_WRITE);
+
+	for(uint32_t i = 0; i < KERNEL_WINDOW / PAGE_SIZE; ++i)
+		kernelFrames[i] = KERNEL_WINDOW_FRAME;
+
+	pmmngr_init(blockCount, (void *)(uintptr_t)METADATA_BASE);
+	pmmngr_init_region(0x100000, (blockCount - 0x100) * PAGE_SIZE);
+	pmmngr_buddy_init((void *)(uintptr_t)(METADATA_BASE + bitmapSize));
+}
+
+// Pages mapped for the kernel heap, including those of the kernel window after _KERNEL_END_
+uint32_t stub_kernel_heap_pages(uint32_t kernelEnd)
+{
+	return kernelMapped + (KERNEL_BASE + KERNEL_WINDOW - kernelEnd) / PAGE_SIZE;
+}
+
+uint32_t stub_libc_heap_pages(void)
+{
+	return libcMapped;
+}
+
+bool vmmngr_alloc_range(uint32_t virt, uint32_t count, uint32_t flags, uint32_t owner, uint32_t *frames)
+{
+	(void)flags;
+	(void)owner;
+
+	for(uint32_t i = 0; i < count; ++i, virt += PAGE_SIZE)
+	{
+		if(virt < KERNEL_BASE || virt >= KERNEL_HEAP_END)
+			stub_fail("mapping outside the kernel heap", virt);
+
+		uint32_t *frame = &kernelFrames[(virt - KERNEL_BASE) / PAGE_SIZE];
+
+		if(*frame == KERNEL_WINDOW_FRAME)
+			stub_fail("mapping a page under the kernel's large page", virt);
+
+		if(*frame == 0)
+		{
+			*frame = (uint32_t)(uintptr_t)pmmngr_alloc_block() / PAGE_SIZE;
+
+			if(*frame == 0)
+				return FALSE;
+
+			// New kernel pages hold whatever the frame held before
+			mprotect((void *)(uintptr_t)virt, PAGE_SIZE, PROT_READ | PROT_WRITE);
+			memset((void *)(uintptr_t)virt, 0xAA, PAGE_SIZE);
+			kernelMapped++;
+		}
+
+		if(frames)
+			*frames++ = *frame;
+	}
+
+	return TRUE;
+}
+
+bool vmmngr_alloc_page(uint32_t virt)
+{
+	if(virt >= KERNEL_BASE && virt < KERNEL_HEAP_END
+		&& kernelFrames[(virt - KERNEL_BASE) / PAGE_SIZE] == KERNEL_WINDOW_FRAME)
+		return TRUE;
+
+	return vmmngr_alloc_range(virt & ~(uint32_t)(PAGE_SIZE - 1), 1, 0, 0, NULL);
+}
+
+uint32_t vmmngr_get_frame(uint32_t virt)
+{
+	if(virt < KERNEL_BASE || virt >= KERNEL_HEAP_END)
+		return 0;
+
+	return kernelFrames[(virt - KERNEL_BASE) / PAGE_SIZE];
+}
+
+void vmmngr_free_page(uint32_t virt)
+{
+	uint32_t *frame = &kernelFrames[(virt - KERNEL_BASE) / PAGE_SIZE];
+
+	if(virt < KERNEL_BASE || virt >= KERNEL_HEAP_END || *frame == 0)
+		stub_fail("freeing a page that isn't mapped", virt);
+
+	// The kernel refuses to free pages under a large page, so the heap must never try
+	if(*frame == KERNEL_WINDOW_FRAME)
+		stub_fail("freeing a page under the kernel's large page", virt);
+
+	pmmngr_free_block(*frame * PAGE_SIZE);
+	*frame = 0;
+	kernelMapped--;
+
+	madvise((void *)(uintptr_t)virt, PAGE_SIZE, MADV_DONTNEED);
+	mprotect((void *)(uintptr_t)virt, PAGE_SIZE, PROT_NONE);
+}
+
+// Unmapping takes effect straight away on the host, so there is nothing to gather
+void vmmngr_free_page_gather(uint32_t virt, void *tlb)
+{
+	(void)tlb;
+
+	vmmngr_free_page(virt);
+}
+
+void vmmngr_tlb_gather_init(void *tlb)
+{
+	(void)tlb;
+}
+
+void vmmngr_tlb_gather_flush(void *tlb)
+{
+	(void)tlb;
+}
+
+void vmmngr_zero_frame(uint32_t frame)
+{
+	// Frames have no contents on the host
+	(void)frame;
+}
+
+void disable_interrupts(void)
+{
+}
+
+void enable_interrupts(void)
+{
+}
+
+uint32_t memblock_alloc(uint32_t size, uint32_t align)
+{
+	// Only used before pmmngr_init()
+	(void)size;
+	(void)align;
+
+	return 0;
+}
+
+void *memsetd(uint32_t *dest, uint32_t val, size_t count)
+{
+	for(size_t i = 0; i < count; ++i)
+		dest[i] = val;
+
+	return dest;
+}
+
+/*
+The C library heap's system call. Reserved pages read as zeroes, as they do
+when the kernel commits them on first touch.
+*/
+bool sc_virtual_alloc(uint32_t startAddr, size_t numPages, uint32_t flags)
+{
+	(void)flags;
+
+	if(startAddr < LIBC_HEAP_BASE || startAddr >= LIBC_HEAP_END
+		|| numPages > (LIBC_HEAP_END - startAddr) / PAGE_SIZE)
+		return FALSE;
+
+	mprotect((void *)(uintptr_t)(startAddr & ~(uint32_t)(PAGE_SIZE - 1)), numPages * PAGE_SIZE,
+		PROT_READ | PROT_WRITE);
+	libcMapped += (uint32_t)numPages;
+
+	return TRUE;
+}
+
+static void *stub_arena(uint32_t base, uint32_t size)
+{
+	void *p = mmap((void *)(uintptr_t)base, size, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_NORESERVE, -1, 0);
+
+	if(p != (void *)(uintptr_t)base)
+		stub_fail("can't map arena", base);
+
+	return p;
+}
+
+static void stub_fail(const char *message, uint32_t addr)
+{
+	fprintf(stderr, "stub: %s (0x%08X)\n", message, addr);
+	exit(2);
+}
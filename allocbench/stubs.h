@@ -0,0 +1,10 @@
+#ifndef STUBS_H
+#define STUBS_H
+
+#include <types.h>
+
+void stub_init(uint32_t blockCount);
+uint32_t stub_kernel_heap_pages(uint32_t kernelEnd);
+uint32_t stub_libc_heap_pages(void);
+
+#endif
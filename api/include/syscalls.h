@@ -6,9 +6,34 @@
 #define SYSCALL_PRINT 			0
 #define SYSCALL_VIRTUAL_ALLOC 	1
 #define SYSCALL_EXIT			2
+#define SYSCALL_FORK			3
+#define SYSCALL_MEMINFO			4
+
+// sc_virtual_alloc() flags
+#define VIRTUAL_ALLOC_POPULATE	1	// Commit the pages now rather than on first touch
+
+// Filled in by sc_meminfo()
+typedef struct
+{
+	uint32_t totalFrames;
+	uint32_t freeFrames;
+	uint32_t zramPages;				// Pages held compressed in memory
+	uint32_t zramCompressedBytes;	// Their total compressed size
+	uint32_t zramPoolFrames;		// Frames used to hold them
+	uint32_t zramRejectedPages;		// Pages that didn't compress well enough
+	uint32_t zramFaultIns;			// Pages decompressed on a page fault
+	uint32_t zramFaultInCycles;		// Time spent on those (wraps around)
+	uint32_t zramMaxFaultInCycles;
+	uint32_t swapSlotsUsed;			// Pages in the swap area
+	uint32_t swapSlotCount;
+	uint32_t swapPagesOut;
+	uint32_t swapPagesIn;
+} meminfo_t;
 
 void sc_print_string(const char *str);
-bool sc_virtual_alloc(uint32_t startAddr, size_t numPages);
+bool sc_virtual_alloc(uint32_t startAddr, size_t numPages, uint32_t flags);
 void sc_exit(int status);
+int sc_fork(void);
+bool sc_meminfo(meminfo_t *info);
 
 #endif
\ No newline at end of file
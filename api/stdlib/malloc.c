@@ -34,7 +34,7 @@ bool malloc_init(void)
 	heapEnd = (void *)((uint32_t)heapStart + DEFAULT_HEAP_SIZE);
 
 	// Map starting heap
-	if(!sc_virtual_alloc((uint32_t)heapStart, DEFAULT_HEAP_SIZE / PAGE_SIZE))
+	if(!sc_virtual_alloc((uint32_t)heapStart, DEFAULT_HEAP_SIZE / PAGE_SIZE, 0))
 		return FALSE;
 
 	// Set up first header
@@ -200,7 +200,7 @@ void *malloc(size_t bytes)
 		// Round size up to nearest page
 		ROUND_UP_PAGE(expand);
 
-		if(sc_virtual_alloc((uint32_t)heapEnd, expand / PAGE_SIZE))
+		if(sc_virtual_alloc((uint32_t)heapEnd, expand / PAGE_SIZE, 0))
 		{
 			heapEnd = (void *)((uint32_t)heapEnd + expand);
 
@@ -10,18 +10,23 @@ void sc_print_string(const char *str)
 				  : "ebx", "eax");
 }
 
-bool sc_virtual_alloc(uint32_t startAddr, size_t numPages)
+/*
+Reserves numPages pages of address space from startAddr. The pages are backed by
+zeroed memory when first touched, or straight away with VIRTUAL_ALLOC_POPULATE.
+*/
+bool sc_virtual_alloc(uint32_t startAddr, size_t numPages, uint32_t flags)
 {
 	uint32_t res = FALSE;
 
 	__asm__ volatile ("movl %1, %%ebx\n"
 					  "movl %2, %%ecx\n"
-					  "movl %3, %%eax\n"
+					  "movl %3, %%edx\n"
+					  "movl %4, %%eax\n"
 					  "int $0x22\n"
 					  "movl %%eax, %0"
 					  : "=m" (res)
-					  : "m" (startAddr), "m" (numPages), "i" (SYSCALL_VIRTUAL_ALLOC)
-					  : "eax", "ebx", "ecx");
+					  : "m" (startAddr), "m" (numPages), "m" (flags), "i" (SYSCALL_VIRTUAL_ALLOC)
+					  : "eax", "ebx", "ecx", "edx");
 
 	return (bool)res;
 }
@@ -35,3 +40,40 @@ void sc_exit(int status)
 					 : "i" (SYSCALL_EXIT), "m" (status)
 					 : "eax", "ebx");
 }
+
+/*
+Creates a copy of the calling process. Returns the child's ID in the parent,
+0 in the child and -1 on failure.
+*/
+int sc_fork(void)
+{
+	int res = -1;
+
+	__asm__ volatile ("movl %1, %%eax\n"
+					  "int $0x22\n"
+					  "movl %%eax, %0"
+					  : "=m" (res)
+					  : "i" (SYSCALL_FORK)
+					  : "eax");
+
+	return res;
+}
+
+/*
+Gets the kernel's memory usage figures. Returns FALSE if info isn't in
+writable memory.
+*/
+bool sc_meminfo(meminfo_t *info)
+{
+	uint32_t res = FALSE;
+
+	__asm__ volatile ("movl %1, %%ebx\n"
+					  "movl %2, %%eax\n"
+					  "int $0x22\n"
+					  "movl %%eax, %0"
+					  : "=m" (res)
+					  : "m" (info), "i" (SYSCALL_MEMINFO)
+					  : "eax", "ebx");
+
+	return (bool)res;
+}
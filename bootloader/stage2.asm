@@ -3,6 +3,13 @@
 ;
 ; Gets a BIOS memory map, enters protected mode,
 ; sets paging up then jumps to the kernel entry point.
+;
+; PAE paging is used instead of 32-bit paging if the
+; CPU supports it and the BIOS memory map has usable
+; memory above 4 GiB. The kernel is mapped with large
+; pages (4 MiB, or 2 MiB with PAE) when the CPU
+; supports them. The kernel is told which paging
+; features are in use with its third argument.
 
 bits 16
 org 0x0700
@@ -12,16 +19,28 @@ jmp 0x0000:stage2_start
 %define KernelAddress 0x8200
 %define KernelVirtualAddress 0xC0000000
 %define NewKernelAddress 0x01000000
-%define MemMapAddress 0x00000B00
+%define MemMapAddress 0x00000C00 ; Leaves stage 2 room to grow up to 0x0BFF
 %define PageDirAddress 0x80000
 %define PageTableFirst4MiB 0x81000
 %define PageTableKernel 0x82000
 %define PageTableKernelStack 0x83000
 %define KernelStackPhysical 0x00080000
 %define KernelStackVirtual 0xF0002000
+%define PaePdptAddress 0x84000
+%define PaePageDirs 0x85000 ; 4 page directories
+%define PaePageTablesFirst4MiB 0x89000 ; 2 page tables
+%define PaePageTablesKernel 0x8B000 ; 2 page tables (unused, the kernel is mapped with large pages)
+%define PaePageTableKernelStack 0x8D000
+%define PaePageTablesEnd 0x8E000
+%define PagingMode32Bit 0
+%define PagingModePae 1 ; Flags passed to the kernel
+%define PagingModePse 2 ; Large pages
+%define PagingModePge 4 ; Global pages, enabled by the kernel
+%define LargePage 0x80 ; Page size bit in a page directory entry
 
 mmapEntries dw 0x0000
 memSize dd 0x00000000
+pagingMode dd PagingMode32Bit
 e820Error db 'BIOS memory map failed', 0x00
 
 ;GDT--------------------------------------
@@ -190,6 +209,8 @@ protected_mode_start:
 	
 	; Execute the Lithium OS Kernel Initialisation
 	; Push args onto stack in reverse order then jump
+	mov edx, dword [pagingMode]
+	push edx
 	movzx edx, word [mmapEntries]
 	push edx
 	mov edx, MemMapAddress
@@ -202,9 +223,13 @@ protected_mode_start:
 ; Sets paging up
 ; No inputs or outputs
 ;
-; TRASHES: EAX, EBX, ECX, EDI
+; TRASHES: EAX, EBX, ECX, EDX, ESI, EDI
 
 setup_paging:
+	call detect_paging_features
+	test dword [pagingMode], PagingModePae
+	jnz setup_paging_pae
+
 	; Clear out paging structures for use
 	mov edi, PageDirAddress
 	call clear_page_table ; It's not a page table but same size so who cares
@@ -219,27 +244,32 @@ setup_paging:
 	call clear_page_table
 	
 	; Install the page tables into the page directory
-	; Note: all the "+ 1"s are for setting the present bit
+	; Note: all the "+ 3"s are for setting the present and writable bits.
+	; The kernel turns on write protection for itself so they must be writable.
 
 	; Page table for first 4 MiB
 	mov ebx, PageDirAddress
-	mov dword [ebx], PageTableFirst4MiB + 1
+	mov dword [ebx], PageTableFirst4MiB + 3
 
-	; Page table for kernel
+	; Page table for kernel, or a single 4 MiB page if the CPU supports it
 	mov eax, KernelVirtualAddress
 	call page_directory_offset
 	lea ebx, [PageDirAddress + eax]
-	mov dword [ebx], PageTableKernel + 1
+	mov dword [ebx], PageTableKernel + 3
+	test dword [pagingMode], PagingModePse
+	jz .kernel_mapped
+	mov dword [ebx], NewKernelAddress + LargePage + 3
+.kernel_mapped:
 
 	; Page table for kernel stack
 	mov eax, KernelStackVirtual
 	call page_directory_offset
 	lea ebx, [PageDirAddress + eax]
-	mov dword [ebx], PageTableKernelStack + 1
+	mov dword [ebx], PageTableKernelStack + 3
 	
 	; Identity map first 4 MiB
 	mov ebx, PageTableFirst4MiB
-	mov eax, 1 ; Start at 0, +1 for present bit
+	mov eax, 3 ; Start at 0, +3 for present and writable bits
 .loop_first_4mib:
 	mov dword [ebx], eax
 	add ebx, 4
@@ -249,7 +279,7 @@ setup_paging:
 	
 	; Map kernel to 0xC0000000 (kernel at 3 GiB virtual)
 	mov ebx, PageTableKernel
-	mov eax, NewKernelAddress + 1 ; Start at NewKernelAddress, +1 for present bit
+	mov eax, NewKernelAddress + 3 ; Start at NewKernelAddress, +3 for present and writable bits
 .loop_kernel:
 	mov dword [ebx], eax
 	add ebx, 4
@@ -261,18 +291,24 @@ setup_paging:
 	mov eax, KernelStackVirtual - 0x2000 ; Map pages before stack address as stack grows down
 	call page_directory_offset
 	lea ebx, [PageDirAddress + eax]
-	mov dword [ebx], PageTableKernelStack + 1
+	mov dword [ebx], PageTableKernelStack + 3
 	mov eax, KernelStackVirtual - 0x2000
 	call page_table_offset
 	lea ebx, [PageTableKernelStack + eax]
-	mov dword [ebx], KernelStackPhysical - 0x2000 + 1
+	mov dword [ebx], KernelStackPhysical - 0x2000 + 3
 	; Repeat for next page
 	mov eax, KernelStackVirtual - 0x1000
 	call page_table_offset
 	lea ebx, [PageTableKernelStack + eax]
-	mov dword [ebx], KernelStackPhysical - 0x1000 + 1
+	mov dword [ebx], KernelStackPhysical - 0x1000 + 3
 	
-	; Enable paging
+	; Enable large pages if they are being used, then paging
+	test dword [pagingMode], PagingModePse
+	jz .enable_paging
+	mov eax, cr4
+	or eax, 0x10 ; Set PSE bit in CR4
+	mov cr4, eax
+.enable_paging:
 	mov eax, PageDirAddress
 	mov cr3, eax
 	mov eax, cr0
@@ -280,6 +316,150 @@ setup_paging:
 	mov cr0, eax ; Paging is officially enabled! :D
 	ret
 
+;*******************************
+; Works out which paging features to use and
+; stores them in pagingMode. PAE is only used if
+; there is memory above 4 GiB for it to reach.
+; No inputs or outputs
+;
+; TRASHES: EAX, EBX, ECX, EDX, ESI
+
+detect_paging_features:
+	mov eax, 1
+	cpuid
+	test edx, 1 << 3 ; PSE feature bit
+	jz .no_pse
+	or dword [pagingMode], PagingModePse
+.no_pse:
+	test edx, 1 << 13 ; PGE feature bit
+	jz .no_pge
+	or dword [pagingMode], PagingModePge
+.no_pge:
+	test edx, 1 << 6 ; PAE feature bit
+	jz .done
+	call check_memory_above_4gib
+	jnc .done
+	; PAE always supports large (2 MiB) pages
+	or dword [pagingMode], PagingModePae | PagingModePse
+.done:
+	ret
+
+;*******************************
+; Checks the BIOS memory map for usable memory
+; above 4 GiB
+; No inputs
+;
+; OUTPUTS:
+; Carry set if there is any
+;
+; TRASHES: EAX, ECX, EDX, ESI
+
+check_memory_above_4gib:
+	mov esi, MemMapAddress
+	movzx ecx, word [mmapEntries]
+
+.loop_entries:
+	test ecx, ecx
+	jz .not_found
+	cmp word [esi + 16], 1 ; Usable memory only
+	jne .next_entry
+	; Work out the address of the last byte of the entry
+	mov eax, [esi]
+	mov edx, [esi + 4]
+	add eax, [esi + 8]
+	adc edx, [esi + 12]
+	sub eax, 1
+	sbb edx, 0
+	test edx, edx ; High dword set means it ends above 4 GiB
+	jnz .found
+
+.next_entry:
+	add esi, 24
+	dec ecx
+	jmp .loop_entries
+
+.found:
+	stc
+	ret
+
+.not_found:
+	clc
+	ret
+
+;*******************************
+; Sets PAE paging up. The same regions are mapped as
+; with 32-bit paging. Entries are 8 bytes and the
+; high dwords are left clear since everything here
+; is below 4 GiB.
+; No inputs or outputs
+;
+; TRASHES: EAX, EBX, ECX, EDI
+
+setup_paging_pae:
+	; Clear out the page directory pointer table, page directories and page tables
+	mov edi, PaePdptAddress
+.loop_clear:
+	call clear_page_table
+	cmp edi, PaePageTablesEnd
+	jb .loop_clear
+
+	; Install the page directories into the page directory pointer table.
+	; Only the present bit can be set in these entries.
+	mov ebx, PaePdptAddress
+	mov eax, PaePageDirs + 1
+.loop_pdpt:
+	mov dword [ebx], eax
+	add ebx, 8
+	add eax, 4096
+	cmp ebx, PaePdptAddress + 32
+	jb .loop_pdpt
+
+	; The page directories are contiguous so the entry for an address
+	; is at PaePageDirs + (address >> 21) * 8
+
+	; Page tables for first 4 MiB
+	mov dword [PaePageDirs], PaePageTablesFirst4MiB + 3
+	mov dword [PaePageDirs + 8], PaePageTablesFirst4MiB + 4096 + 3
+
+	; Kernel, with two 2 MiB pages
+	mov eax, KernelVirtualAddress
+	shr eax, 21
+	mov dword [PaePageDirs + eax * 8], NewKernelAddress + LargePage + 3
+	mov dword [PaePageDirs + eax * 8 + 8], NewKernelAddress + 0x200000 + LargePage + 3
+
+	; Page table for kernel stack
+	mov eax, KernelStackVirtual - 0x2000
+	shr eax, 21
+	mov dword [PaePageDirs + eax * 8], PaePageTableKernelStack + 3
+
+	; Identity map first 4 MiB
+	mov ebx, PaePageTablesFirst4MiB
+	mov eax, 3 ; Start at 0, +3 for present and writable bits
+.loop_first_4mib:
+	mov dword [ebx], eax
+	add ebx, 8
+	add eax, 4096
+	cmp ebx, PaePageTablesFirst4MiB + 8192
+	jb .loop_first_4mib
+
+	; Map kernel stack
+	mov eax, KernelStackVirtual - 0x2000
+	shr eax, 12
+	and eax, 0x1FF ; Get lowest 9 bits
+	mov dword [PaePageTableKernelStack + eax * 8], KernelStackPhysical - 0x2000 + 3
+	mov dword [PaePageTableKernelStack + eax * 8 + 8], KernelStackPhysical - 0x1000 + 3
+
+	; Enable PAE then paging
+	mov eax, cr4
+	or eax, 0x20 ; Set PAE bit in CR4
+	mov cr4, eax
+	mov eax, PaePdptAddress
+	mov cr3, eax
+	mov eax, cr0
+	or eax, 0x80000000
+	mov cr0, eax
+	ret
+
 ;**************************
 ; Clears a page table
 ; INPUT:
@@ -0,0 +1,70 @@
+/*
+Fork benchmark. Forks CHILD_COUNT children that exit straight away and reports
+how long fork() took in the parent, and how long the first write to a page
+shared copy-on-write with a child took.
+
+Build it, run "make inst" and build the kernel with "make DEFINES=-DFORKBENCH"
+to have the kernel start it instead of lishell.
+*/
+
+#include <stdio.h>
+#include <syscalls.h>
+
+#define CHILD_COUNT 32
+
+// Low half of the time stamp counter, plenty for timing one call
+static uint32_t cycles(void)
+{
+	uint32_t low, high;
+
+	__asm__ volatile ("rdtsc" : "=a" (low), "=d" (high));
+
+	return low;
+}
+
+static volatile uint32_t shared = 0;
+
+int main(void)
+{
+	uint32_t forkTotal = 0, forkMin = 0xFFFFFFFF, forkMax = 0;
+	uint32_t writeTotal = 0;
+
+	for(uint32_t i = 0; i < CHILD_COUNT; ++i)
+	{
+		uint32_t start = cycles();
+		int id = sc_fork();
+		uint32_t time = cycles() - start;
+
+		if(id == 0)
+		{
+			// Child
+			sc_exit(0);
+		}
+
+		if(id < 0)
+		{
+			printf("fork() failed\n");
+
+			return 1;
+		}
+
+		forkTotal += time;
+
+		if(time < forkMin)
+			forkMin = time;
+
+		if(time > forkMax)
+			forkMax = time;
+
+		// The page holding shared was made copy-on-write by the fork
+		start = cycles();
+		shared = i;
+		writeTotal += cycles() - start;
+	}
+
+	printf("\nForked %d children\n", CHILD_COUNT);
+	printf("fork() cycles: average %d, min %d, max %d\n", (int)(forkTotal / CHILD_COUNT), (int)forkMin, (int)forkMax);
+	printf("First write after fork() cycles: average %d\n", (int)(writeTotal / CHILD_COUNT));
+
+	return 0;
+}
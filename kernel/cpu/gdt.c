@@ -3,8 +3,10 @@ Lithium OS GDT related functions.
 */
 
 #include <gdt.h>
+#include <vmmngr.h>
 
-#define GDT_ADDRESS 0xFFBB9000
+// The GDT lives at physical address 0, reached through the direct map
+#define GDT_ADDRESS DIRECT_MAP_BASE
 
 struct gdtEntry
 {
@@ -0,0 +1,38 @@
+/*
+Lithium OS PAE paging structure entry manipulation functions.
+
+Frames are passed around as frame numbers rather than physical addresses so
+that frames above 4GiB can be used.
+*/
+
+#include <pae.h>
+
+inline void pae_entry_add_attrib(pae_entry *e, uint32_t attrib)
+{
+	*e |= attrib;
+}
+
+inline void pae_entry_del_attrib(pae_entry *e, uint32_t attrib)
+{
+	*e &= ~(pae_entry)attrib;
+}
+
+inline void pae_entry_set_frame(pae_entry *e, uint32_t frame)
+{
+	*e = (*e & ~PAE_FRAME) | ((pae_entry)frame << 12);
+}
+
+inline bool pae_entry_is_present(pae_entry e)
+{
+	return (e & PAE_PRESENT);
+}
+
+inline bool pae_entry_is_writable(pae_entry e)
+{
+	return (e & PAE_WRITABLE) ? TRUE : FALSE;
+}
+
+inline uint32_t pae_entry_frame(pae_entry e)
+{
+	return (uint32_t)((e & PAE_FRAME) >> 12);
+}
@@ -5,12 +5,37 @@ Lithium OS page fault handler
 #include <pagefault.h>
 #include <scheduler.h>
 #include <panic.h>
+#include <vmregion.h>
+#include <vmmngr.h>
+
+// Page fault error code bits
+#define PF_PRESENT	1	// Protection violation rather than a missing page
+#define PF_WRITE	2
+
+static bool pagefault_demand_zero(virtual_addr addr, uint32_t errorCode);
 
 /*
 Handles page fault exceptions (called from fault handler).
 */
 void pagefault_handle(isr_t *stk)
 {
+	virtual_addr faultAddr;
+
+	__asm__ __volatile__("movl %%cr2, %0" : "=r" (faultAddr));
+
+	// Page that was reclaimed to make room
+	if(!(stk->err_code & PF_PRESENT) && (scheduler_get_current_process() != NULL)
+		&& vmmngr_swap_in(faultAddr, scheduler_get_current_process()->id))
+		return;
+
+	if(pagefault_demand_zero(faultAddr, stk->err_code))
+		return;
+
+	// Write to a page shared with a forked process
+	if((stk->err_code & PF_PRESENT) && (stk->err_code & PF_WRITE) && (scheduler_get_current_process() != NULL)
+		&& vmmngr_copy_on_write(faultAddr, scheduler_get_current_process()->id))
+		return;
+
 	if(stk->eip == 0xDEADBEEF)
 	{
 		// Init new thread's virtual address space
@@ -22,4 +47,38 @@ void pagefault_handle(isr_t *stk)
 	}
 	else
 		panic_display_message(stk);
+}
+
+/*
+Handles the first touch of a page in a region the current process reserved.
+Reads map the shared zero page and writes commit a zeroed page of its own.
+Returns FALSE if the fault is for something else.
+Faults from the kernel are handled too, for when a system call touches user
+memory.
+*/
+static bool pagefault_demand_zero(virtual_addr addr, uint32_t errorCode)
+{
+	process_t *proc = scheduler_get_current_process();
+
+	if((proc == NULL) || (errorCode & PF_PRESENT) || (addr >= KERNEL_VIRTUAL_BASE))
+		return FALSE;
+
+	vm_region_t *region = vmregion_find(proc, addr);
+
+	if((region == NULL) || !(region->flags & VM_REGION_DEMAND_ZERO))
+		return FALSE;
+
+	if((errorCode & PF_WRITE) && !(region->permissions & VM_REGION_WRITE))
+		return FALSE;
+
+	// Most pages that are only read never need a frame
+	if(!(errorCode & PF_WRITE))
+		return vmmngr_map_zero_page(addr, (region->permissions & VM_REGION_WRITE) != 0);
+
+	uint32_t flags = VMM_USER;
+
+	if(region->permissions & VM_REGION_WRITE)
+		flags |= VMM_WRITABLE;
+
+	return vmmngr_alloc_range(addr & ~(uint32_t)(PAGE_SIZE - 1), 1, flags, proc->id, NULL);
 }
\ No newline at end of file
@@ -10,6 +10,8 @@
 #define ATA_PORT_COMMAND_STATUS 		0x1F7
 #define ATA_PORT_CONTROL_REGISTER 		0x3F6
 
+static bool ata_wait_for_data(void);
+
 bool ata_wait_until_not_busy(uint32_t timeout_ms)
 {
 	uint8_t status = inportb(ATA_PORT_COMMAND_STATUS);
@@ -38,8 +40,8 @@ void ata_select_drive(uint8_t drive)
 
 	if(drive)
 		buf |= 0xB0; //slave
-	
-	buf &= 0xEF;
+	else
+		buf &= 0xEF; //master
 	
 	outportb(ATA_PORT_DRIVE_HEAD_LBA_24_28, buf);
 }
@@ -138,3 +140,102 @@ data_ready: ;
 	
 	return TRUE;
 }
+
+bool ata_write_lba28(uint32_t LBA, uint8_t sectorCount, const void* src, uint8_t drive)
+{
+	if(!ata_wait_until_not_busy(1000))
+		return FALSE;
+	
+	outportb(ATA_PORT_SECTOR_COUNT, sectorCount); //sector count
+	outportb(ATA_PORT_LBA_LOW, LBA & 0xFF); //LBA low byte
+	outportb(ATA_PORT_LBA_MID, (LBA >> 8) & 0xFF); //LBA mid byte
+	outportb(ATA_PORT_LBA_HIGH, (LBA >> 16) & 0xFF); //LBA high byte
+	outportb(ATA_PORT_DRIVE_HEAD_LBA_24_28, (LBA >> 24) & 0x0F); //bits 24-28 of LBA
+	ata_select_drive(drive);
+	ata_set_mode_lba();
+	ata_interrupt_enable(FALSE);
+	ata_send_command(0x30); //write sectors with retry
+
+	const uint16_t* memoryBuffer = (const uint16_t*)src;
+
+	for(uint32_t i = 0; i < sectorCount; i++)
+	{
+		if(!ata_wait_for_data())
+			return FALSE;
+
+		for(uint32_t j = 0; j < 256; j++)
+		{
+			outportw(ATA_PORT_DATA, *memoryBuffer);
+			memoryBuffer++;
+		}
+	}
+
+	// Make sure the data is on the disk before the caller reuses the memory
+	ata_send_command(0xE7); //cache flush
+
+	if(!ata_wait_until_not_busy(1000))
+		return FALSE;
+
+	return (inportb(ATA_PORT_COMMAND_STATUS) & 0x21) ? FALSE : TRUE; //ERR or DF set
+}
+
+/*
+Checks that an ATA drive is attached and gets the number of sectors that can
+be reached with 28-bit LBA. Returns FALSE if there is no such drive.
+*/
+bool ata_identify(uint8_t drive, uint32_t *sectorCount)
+{
+	// A floating bus means there are no drives at all
+	if(inportb(ATA_PORT_COMMAND_STATUS) == 0xFF)
+		return FALSE;
+
+	outportb(ATA_PORT_DRIVE_HEAD_LBA_24_28, drive ? 0xB0 : 0xA0);
+	outportb(ATA_PORT_SECTOR_COUNT, 0);
+	outportb(ATA_PORT_LBA_LOW, 0);
+	outportb(ATA_PORT_LBA_MID, 0);
+	outportb(ATA_PORT_LBA_HIGH, 0);
+	ata_interrupt_enable(FALSE);
+	ata_send_command(0xEC); //identify
+
+	if(inportb(ATA_PORT_COMMAND_STATUS) == 0)
+		return FALSE; //no drive
+
+	while(inportb(ATA_PORT_COMMAND_STATUS) & 0x80); //wait for BSY to clear
+
+	// ATAPI and SATA devices put a signature here and aren't supported
+	if(inportb(ATA_PORT_LBA_MID) || inportb(ATA_PORT_LBA_HIGH))
+		return FALSE;
+
+	if(!ata_wait_for_data())
+		return FALSE;
+
+	uint16_t identity[256];
+
+	for(uint32_t i = 0; i < 256; i++)
+		identity[i] = inportw(ATA_PORT_DATA);
+
+	*sectorCount = identity[60] | ((uint32_t)identity[61] << 16);
+
+	return TRUE;
+}
+
+/*
+Waits for the drive to be ready to transfer a sector. Returns FALSE if the
+command failed.
+*/
+static bool ata_wait_for_data(void)
+{
+	while(TRUE)
+	{
+		uint8_t status = inportb(ATA_PORT_COMMAND_STATUS);
+
+		if(status & 0x80) //BSY set
+			continue;
+
+		if(status & 0x21) //ERR or DF set
+			return FALSE;
+
+		if(status & 0x8) //DRQ set
+			return TRUE;
+	}
+}
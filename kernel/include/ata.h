@@ -9,5 +9,7 @@ void ata_select_drive(uint8_t drive);
 void ata_set_mode_lba(void);
 void ata_interrupt_enable(bool enable);
 bool ata_read_lba28(uint32_t LBA, uint8_t sectorCount, void* dest, uint8_t drive);
+bool ata_write_lba28(uint32_t LBA, uint8_t sectorCount, const void* src, uint8_t drive);
+bool ata_identify(uint8_t drive, uint32_t *sectorCount);
 
 #endif
\ No newline at end of file
@@ -5,6 +5,8 @@
 
 bool kmalloc_init(void);
 void *kmalloc(size_t bytes);
+void *kmalloc_aligned(size_t bytes, size_t align);
 void kfree(void *address);
+void kmalloc_get_stats(uint32_t *pagesMapped, uint32_t *pagesReleased);
 
 #endif
@@ -0,0 +1,19 @@
+#ifndef KPAGE_H
+#define KPAGE_H
+
+#include <stdinc.h>
+
+// Kernel virtual addresses kpage_alloc() hands out, between the kernel stack
+// and the temporary mappings
+#define KPAGE_AREA_BASE		0xF1000000
+#define KPAGE_AREA_PAGES	0x4000	// 64MiB
+
+// kpage_alloc() flags
+#define KPAGE_ZERO			1	// Clear the pages
+#define KPAGE_CONTIGUOUS	2	// Back the pages with physically contiguous frames
+#define KPAGE_DMA			4	// Contiguous frames below 16MiB, for ISA/IDE bus master DMA
+
+void *kpage_alloc(uint32_t count, uint32_t flags);
+void kpage_free(void *address, uint32_t count);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef MEMBLOCK_H
+#define MEMBLOCK_H
+
+#include <stdinc.h>
+#include <pmmngr.h>
+
+#define MEMBLOCK_MAX_REGIONS 32
+
+typedef struct
+{
+	uint32_t baseL; // Base address QWORD
+	uint32_t baseH;
+	uint32_t lengthL; // Length QWORD
+	uint32_t lengthH;
+	uint16_t type; // Region type
+	uint16_t acpi; // Extended
+	uint32_t padding; // Padding to make it 24 bytes
+ 
+} __attribute__((__packed__)) mmap_entry_t;
+
+// Regions are kept as frame numbers so memory above 4GiB can be described
+typedef struct
+{
+	uint32_t base;
+	uint32_t end;
+} memblock_region_t;
+
+void memblock_init(mmap_entry_t *entries, uint32_t entryCount, uint32_t frameLimit);
+bool memblock_reserve(physical_addr base, uint32_t size);
+physical_addr memblock_alloc(uint32_t size, uint32_t align);
+uint32_t memblock_end_of_usable(void);
+void memblock_release_to_pmmngr(void);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef PAE_H
+#define PAE_H
+
+#include <stdinc.h>
+
+/*
+PAE paging structure entries. The low 12 bits have the same meaning as in
+pte.h/pde.h; the frame address is 52 bits wide. Page directory pointer table
+entries only support the present bit and the cache control bits.
+*/
+
+typedef uint64_t pae_entry;
+
+enum PAGE_PAE_FLAGS
+{
+	PAE_PRESENT = 1,
+	PAE_WRITABLE = 2,
+	PAE_USER = 4,
+	PAE_PWT = 8,
+	PAE_PCD = 0x10,
+	PAE_ACCESSED = 0x20,
+	PAE_DIRTY = 0x40,
+	PAE_LARGE = 0x80,			// 2MiB page when set in a page directory entry
+	PAE_CPU_GLOBAL = 0x100,
+	PAE_COPY_ON_WRITE = 0x400,	// Software bit, same as PTE_COPY_ON_WRITE
+	PAE_SWAPPED = 0x800			// Software bit, same as PTE_SWAPPED
+};
+
+#define PAE_FRAME 0x000FFFFFFFFFF000ULL
+
+#define PAE_ENTRIES_PER_TABLE	512
+#define PAE_DIRECTORY_COUNT		4
+
+void pae_entry_add_attrib(pae_entry *e, uint32_t attrib);
+void pae_entry_del_attrib(pae_entry *e, uint32_t attrib);
+void pae_entry_set_frame(pae_entry *e, uint32_t frame);
+bool pae_entry_is_present(pae_entry e);
+bool pae_entry_is_writable(pae_entry e);
+uint32_t pae_entry_frame(pae_entry e);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef PFDB_H
+#define PFDB_H
+
+#include <stdinc.h>
+#include <pmmngr.h>
+
+enum PAGE_FRAME_FLAGS
+{
+	PFDB_KERNEL = 1,			// Used by the kernel
+	PFDB_USER = 2,				// Mapped into a user address space
+	PFDB_PAGE_TABLE = 4,		// Page table or page directory
+	PFDB_PINNED = 8,			// Must never be freed or moved
+	PFDB_ZEROED = 0x10			// Known to contain only zeroes
+};
+
+typedef struct
+{
+	uint16_t refCount;	// Number of mappings of the frame, 0 if it is free
+	uint16_t flags;
+	uint32_t owner;		// ID of the process that owns the frame, 0 for the kernel or if shared
+	uint16_t tableEntries;	// Page tables: number of entries in use
+} page_frame_t;
+
+uint32_t pfdb_size(uint32_t frameCount);
+void pfdb_init(void *base, uint32_t frameCount);
+page_frame_t *pfdb_get(uint32_t frame);
+void pfdb_frame_set(uint32_t frame, uint16_t flags, uint32_t owner);
+uint32_t pfdb_ref(uint32_t frame);
+bool pfdb_put(uint32_t frame);
+
+#endif
@@ -5,7 +5,22 @@
 
 typedef uint32_t physical_addr;
 
-void pmmngr_init (uint32_t memSize, physical_addr bitmap);
+// Largest buddy block is 2^PMMNGR_MAX_ORDER blocks (4MiB)
+#define PMMNGR_MAX_ORDER 10
+
+// Memory below 16MiB is kept for ISA/IDE bus master DMA where possible. Memory
+// above the kernel's 512MiB direct map (DIRECT_MAP_SIZE) is high memory: it is
+// handed out by frame number and only used for user pages, so that everything
+// the kernel allocates can be reached through the direct map.
+#define PMMNGR_ZONE_DMA_LIMIT	0x01000000
+#define PMMNGR_ZONE_HIGH_FRAME	0x00020000
+#define PMMNGR_ZONE_DMA			0
+#define PMMNGR_ZONE_NORMAL		1
+#define PMMNGR_ZONE_HIGH		2
+#define PMMNGR_ZONE_COUNT		3
+
+void pmmngr_init (uint32_t blockCount, void *bitmap);
+uint32_t pmmngr_bitmap_size(uint32_t blockCount);
 void pmmngr_set_bitmap_address(void *addr);
 void mmap_set (uint32_t bit);
 void mmap_unset (uint32_t bit);
@@ -15,12 +30,29 @@ uint32_t pmmngr_get_block_count(void);
 uint32_t pmmngr_get_free_block_count(void);
 void pmmngr_init_region(physical_addr base, uint32_t size);
 void pmmngr_deinit_region(physical_addr base, uint32_t size);
+void pmmngr_init_frames(uint32_t start, uint32_t blocks);
+void pmmngr_deinit_frames(uint32_t start, uint32_t blocks);
 void *pmmngr_alloc_block(void);
+void *pmmngr_alloc_block_zone(uint32_t zone);
 void pmmngr_free_block (physical_addr p);
+uint32_t pmmngr_alloc_frame(uint32_t zone);
+uint32_t pmmngr_alloc_user_frame(void);
+void pmmngr_free_frame(uint32_t frame);
 void pmmngr_set_cr3(physical_addr pdb);
 void pmmngr_paging_enable(bool enable);
 void *pmmngr_alloc_blocks(uint32_t amount);
+void *pmmngr_alloc_blocks_zone(uint32_t amount, uint32_t zone);
 void pmmngr_free_blocks (void *p, uint32_t amount);
 uint32_t mmap_first_free_s (uint32_t size);
+uint32_t pmmngr_buddy_metadata_size(uint32_t blockCount);
+void pmmngr_buddy_init(void *metadata);
+uint32_t pmmngr_buddy_free_count(uint32_t zone, uint32_t order);
+uint32_t pmmngr_get_zone_free_block_count(uint32_t zone);
+void pmmngr_frame_cache_drain(uint32_t count);
+void pmmngr_get_frame_cache_stats(uint32_t *hits, uint32_t *misses, uint32_t *cached);
+void *pmmngr_zero_pool_alloc(void);
+void *pmmngr_alloc_zeroed_block(void);
+bool pmmngr_zero_pool_fill(void);
+void pmmngr_get_zero_pool_stats(uint32_t *hits, uint32_t *misses, uint32_t *pooled);
 
 #endif
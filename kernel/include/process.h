@@ -10,19 +10,12 @@ typedef struct
     uint32_t eip, cs, eflags, useresp, ss;
 } registers_t;
 
-typedef struct pmem_region_struct
-{
-	uint32_t pageIndex;
-	struct pmem_region_struct *next;
-} pmem_region_t;
-
 typedef struct thread_struct
 {
 	registers_t regs;
 	uint32_t entryPoint;
 	uint32_t id;
 	struct thread_struct *next;
-	pmem_region_t *pmemRegions;
 } thread_t;
 
 typedef struct process_struct
@@ -30,21 +23,22 @@ typedef struct process_struct
 	thread_t *threads;
 	thread_t *blockedThreads;
 	uint32_t pdPhysical;
+	uint32_t kernelGeneration; // Kernel space generation the page directory is synced with
+	struct vm_region_struct *regions; // Reserved parts of the user address space, sorted by address
 	struct process_struct *next;
 	void *loadBinaryFrom;
 	size_t binarySize;
 	uint32_t id;
 	uint32_t threadIDCounter;
-	pmem_region_t *pmemRegions;
 } process_t;
 
+bool process_init(void);
 process_t *add_process(void *binary, size_t binarySize);
 thread_t *add_thread(process_t *proc, uint32_t entryPoint);
 uint32_t setup_process(process_t *proc, uint32_t *entryPoint);
-uint32_t init_thread_stack(thread_t *thread, uint32_t *pStackAddr);
-void process_add_pmem_region(process_t *proc, uint32_t pageIndex);
-void thread_add_pmem_region(thread_t *thread, uint32_t pageIndex);
+uint32_t init_thread_stack(process_t *proc, thread_t *thread, uint32_t *pStackAddr);
 void process_destroy(process_t *proc);
 process_t *add_kernel_process(void *entry);
+process_t *fork_process(process_t *parent, thread_t *thread, registers_t *regs);
 
 #endif
\ No newline at end of file
@@ -18,6 +18,8 @@ enum PAGE_PTE_FLAGS
 	PTE_PAT = 0x80,				//0000000000000000000000010000000
 	PTE_CPU_GLOBAL = 0x100,		//0000000000000000000000100000000
 	PTE_LV4_GLOBAL = 0x200,		//0000000000000000000001000000000
+	PTE_COPY_ON_WRITE = 0x400,	//0000000000000000000010000000000 (software bit)
+	PTE_SWAPPED = 0x800,		//0000000000000000000100000000000 (software bit, not present: swap slot in the frame bits)
    	PTE_FRAME = 0x7FFFF000 		//1111111111111111111000000000000
 };
 
@@ -13,5 +13,8 @@ uint32_t scheduler_setup_current_thread(isr_t *stk);
 uint32_t scheduler_add_thread(uint32_t procID, uint32_t entryPoint);
 void scheduler_remove_current_process(isr_t *stk);
 uint32_t scheduler_add_kernel_process(void *entry);
+process_t *scheduler_get_current_process(void);
+process_t *scheduler_get_process_queue(void);
+uint32_t scheduler_fork_current_process(isr_t *stk);
 
 #endif
@@ -0,0 +1,40 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdinc.h>
+
+// Empty slabs a cache keeps for later instead of freeing them straight away
+#define KMEM_CACHE_MAX_EMPTY	1
+
+typedef struct
+{
+	uint32_t objectSize;		// Rounded up to a multiple of the pointer size
+	uint32_t objectsPerSlab;
+	uint32_t activeObjects;		// Allocated and not yet freed
+	uint32_t totalObjects;		// Room in all of the cache's slabs
+	uint32_t slabs;
+	uint32_t allocs;
+	uint32_t frees;
+	uint32_t failures;			// Allocations that found no memory for a new slab
+} kmem_cache_stats_t;
+
+typedef struct kmem_cache_struct
+{
+	const char *name;
+	uint32_t objectSize;
+	uint32_t objectsPerSlab;
+	struct kmem_slab_struct *partial;	// Slabs with some objects free, allocated from first
+	struct kmem_slab_struct *full;
+	struct kmem_slab_struct *empty;
+	uint32_t emptyCount;
+	kmem_cache_stats_t stats;
+	struct kmem_cache_struct *next;		// Every cache, for reporting
+} kmem_cache_t;
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t objectSize);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *object);
+kmem_cache_t *kmem_cache_next(kmem_cache_t *cache);
+void kmem_cache_get_stats(const kmem_cache_t *cache, kmem_cache_stats_t *stats);
+
+#endif
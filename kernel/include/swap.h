@@ -0,0 +1,25 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stdinc.h>
+
+// A swapped out page table entry with this slot stands for a page of zeroes,
+// which needs nothing on disk. The slot is never handed out.
+#define SWAP_SLOT_ZERO		0
+
+// Slots with this bit set are handles of pages in the compressed store
+#define SWAP_SLOT_ZRAM		0x40000
+
+// Frames to free each time memory runs out, so the next few allocations don't
+// have to scan again
+#define SWAP_RECLAIM_BATCH	16
+
+bool swap_init(void);
+uint32_t swap_out(const void *page);
+bool swap_in(uint32_t slot, void *page);
+void swap_slot_ref(uint32_t slot);
+void swap_slot_put(uint32_t slot);
+uint32_t swap_reclaim(uint32_t target);
+void swap_get_stats(uint32_t *slotsUsed, uint32_t *slotCount, uint32_t *pagesOut, uint32_t *pagesIn);
+
+#endif
@@ -9,6 +9,7 @@ uint8_t inportb (uint16_t port);
 void outportb(uint16_t port, uint8_t data);
 char *itoa(int value, char *str, int base);
 uint16_t inportw(uint16_t port);
+void outportw(uint16_t port, uint16_t data);
 void disable_interrupts(void);
 void enable_interrupts(void);
 void halt_cpu(void);
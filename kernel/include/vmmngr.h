@@ -11,12 +11,56 @@
 #define PAGE_DIRECTORY_SIZE	4096
 #define PAGE_TABLES_ADDR 		0xFFC00000
 #define PAGE_DIRECTORY_ADDRESS 	0xFFFFF000
+#define KERNEL_VIRTUAL_BASE		0xC0000000
+
+// PAE recursive mapping: entries 508-511 of the last page directory point at
+// the four page directories
+#define PAE_PAGE_TABLES_ADDR		0xFF800000
+#define PAE_PAGE_DIRECTORIES_ADDR	0xFFFFC000
+#define PAE_RECURSIVE_INDEX			508
+
+// Windows used to copy and zero high memory frames, which aren't in the direct
+// map. These are kept below the PAE recursive mapping so they work in both modes.
+#define PAGECOPY_TEMP			0xFF7F8000
+#define PAGEZERO_TEMP			0xFF7F9000
+
+// Paging features stage 2 can leave enabled (flags)
+#define PAGING_MODE_32BIT	0
+#define PAGING_MODE_PAE		1
+#define PAGING_MODE_PSE		2	// Large pages (4MiB, or 2MiB with PAE)
+#define PAGING_MODE_PGE		4	// Global pages are supported, enabled by vmmngr_init()
+
+// Low physical memory is mapped linearly here, with large pages when possible.
+// Everything the kernel allocates by physical address (the normal and DMA
+// zones) is in it.
+#define DIRECT_MAP_BASE		0xD0000000
+#define DIRECT_MAP_SIZE		0x20000000
+
+// Flags for vmmngr_map_range() and vmmngr_alloc_range()
+#define VMM_WRITABLE	1
+#define VMM_USER		2
+#define VMM_GLOBAL		4	// Only honoured in the kernel half
+#define VMM_NOCACHE		8
+
+// Gathered pages above this are flushed with one full TLB flush instead of an
+// invlpg each
+#define TLB_FLUSH_THRESHOLD	32
 
 #define PAGE_DIRECTORY_INDEX(x) (((x) >> 22) & 0x3ff)
 #define PAGE_TABLE_INDEX(x) (((x) >> 12) & 0x3ff)
 
 typedef uint32_t virtual_addr;
 
+// Pages whose mappings changed, to be flushed from the TLB together
+typedef struct
+{
+	virtual_addr pages[TLB_FLUSH_THRESHOLD];
+	uint32_t count;
+	bool kernel; // A kernel (possibly global) page was gathered
+	uint32_t frames[TLB_FLUSH_THRESHOLD]; // Frames to release once flushed
+	uint32_t frameCount;
+} tlb_gather_t;
+
 typedef struct
 {
 	pt_entry entries[PAGES_PER_TABLE];
@@ -27,19 +71,48 @@ typedef struct
 	pd_entry entries[PAGES_PER_DIR];
 } pdirectory;
 
-bool vmmngr_init(physical_addr pd_physical);
-bool vmmngr_commit_page(pt_entry *e);
+bool vmmngr_init(physical_addr pd_physical, uint32_t pagingMode);
+bool vmmngr_pae_enabled(void);
+bool vmmngr_init_direct_map(uint32_t frameCount);
 void vmmngr_free_page(virtual_addr addr);
+void vmmngr_free_page_gather(virtual_addr addr, tlb_gather_t *tlb);
 pt_entry* vmmngr_ptable_lookup_entry(ptable *p, virtual_addr addr);
 pd_entry* vmmngr_pdirectory_lookup_entry(pdirectory *p, virtual_addr addr);
 bool vmmngr_switch_pdirectory(physical_addr pd_physical);
 physical_addr vmmngr_get_directory(void);
 void vmmngr_flush_tlb_entry(virtual_addr addr);
-void vmmngr_flush_tlb_1024(virtual_addr addr);
+void vmmngr_flush_tlb_global(void);
+void vmmngr_tlb_gather_init(tlb_gather_t *tlb);
+void vmmngr_tlb_gather_page(tlb_gather_t *tlb, virtual_addr addr);
+void vmmngr_tlb_gather_frame(tlb_gather_t *tlb, uint32_t frame);
+void vmmngr_tlb_gather_flush(tlb_gather_t *tlb);
+void vmmngr_get_tlb_flush_stats(uint32_t *pageFlushes, uint32_t *fullFlushes);
 bool vmmngr_map_page (physical_addr phys, virtual_addr virt);
+bool vmmngr_map_frame(uint32_t frame, virtual_addr virt);
+bool vmmngr_map_range(uint32_t frame, virtual_addr virt, uint32_t count, uint32_t flags);
+bool vmmngr_alloc_range(virtual_addr virt, uint32_t count, uint32_t flags, uint32_t owner, uint32_t *frames);
+physical_addr vmmngr_unmap_ptable(virtual_addr virt);
 void vmmngr_ptable_clear(ptable *pt);
+bool vmmngr_ptable_pool_fill(void);
 bool vmmngr_alloc_page(virtual_addr virt);
+bool vmmngr_init_zero_page(void);
+bool vmmngr_map_zero_page(virtual_addr virt, bool writable);
 ptable* vmmngr_get_ptable_address(virtual_addr addr);
 physical_addr vmmngr_get_physical_address(virtual_addr addr);
+uint32_t vmmngr_get_frame(virtual_addr addr);
+void vmmngr_make_page_user(virtual_addr addr);
+void vmmngr_zero_frame(uint32_t frame);
+void *phys_to_virt(physical_addr phys);
+physical_addr virt_to_phys(const void *virt);
+bool vmmngr_preallocate_kernel_tables(void);
+uint32_t vmmngr_kernel_space_generation(void);
+physical_addr vmmngr_create_address_space(uint16_t pfdbFlags, uint32_t owner);
+void vmmngr_sync_kernel_space(physical_addr pd_physical, uint32_t *generation);
+bool vmmngr_clone_user_space(physical_addr pd_physical, uint32_t owner);
+bool vmmngr_copy_on_write(virtual_addr addr, uint32_t owner);
+void vmmngr_release_user_space(physical_addr pd_physical);
+uint32_t vmmngr_reclaim_user_pages(physical_addr pd_physical, virtual_addr *hand, uint32_t target);
+bool vmmngr_swap_in(virtual_addr addr, uint32_t owner);
+void vmmngr_free_address_space(physical_addr pd_physical);
 
 #endif
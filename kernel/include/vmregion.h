@@ -0,0 +1,50 @@
+#ifndef VMREGION_H
+#define VMREGION_H
+
+#include <stdinc.h>
+#include <process.h>
+#include <vmmngr.h>
+
+enum VM_REGION_PERMISSIONS
+{
+	VM_REGION_READ = 1,
+	VM_REGION_WRITE = 2,
+	VM_REGION_EXECUTE = 4
+};
+
+// What backs the pages of a region
+enum VM_REGION_TYPE
+{
+	VM_REGION_ANONYMOUS = 0,	// Zeroed memory
+	VM_REGION_ELF = 1,			// Segments of the process's executable
+	VM_REGION_STACK = 2,		// Thread stacks
+	VM_REGION_SHARED = 3		// Memory shared with other processes
+};
+
+enum VM_REGION_FLAGS
+{
+	VM_REGION_DEMAND_ZERO = 1	// Untouched pages read as zeroes and are committed on the first write
+};
+
+typedef struct vm_region_struct
+{
+	virtual_addr start;	// Page aligned
+	virtual_addr end;	// Page aligned, exclusive
+	uint32_t permissions;
+	uint32_t type;
+	uint32_t flags;
+	int32_t height;		// Of the subtree rooted here, 1 for a leaf
+	struct vm_region_struct *left;
+	struct vm_region_struct *right;
+} vm_region_t;
+
+bool vmregion_init(void);
+bool vmregion_reserve(process_t *proc, virtual_addr start, uint32_t pageCount, uint32_t permissions,
+	uint32_t type, uint32_t flags);
+bool vmregion_reserve_unused(process_t *proc, virtual_addr start, uint32_t pageCount, uint32_t permissions,
+	uint32_t type, uint32_t flags);
+vm_region_t *vmregion_find(process_t *proc, virtual_addr addr);
+bool vmregion_clone(process_t *dst, process_t *src);
+void vmregion_destroy_all(process_t *proc);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef ZRAM_H
+#define ZRAM_H
+
+#include <stdinc.h>
+
+// Returned by zram_store() when a page can't be stored
+#define ZRAM_NO_HANDLE	0xFFFFFFFF
+
+typedef struct
+{
+	uint32_t storedPages;		// Pages held compressed
+	uint32_t compressedBytes;	// Their total compressed size
+	uint32_t poolFrames;		// Frames holding compressed pages
+	uint32_t rejectedPages;		// Pages that didn't compress well enough
+	uint32_t faultIns;			// Pages decompressed back into memory
+	uint32_t faultInCycles;		// Time spent decompressing them (wraps around)
+	uint32_t maxFaultInCycles;	// Longest time spent decompressing one
+} zram_stats_t;
+
+bool zram_init(void);
+uint32_t zram_store(const void *page);
+bool zram_load(uint32_t handle, void *page);
+void zram_ref(uint32_t handle);
+void zram_put(uint32_t handle);
+void zram_get_stats(zram_stats_t *stats);
+
+#endif
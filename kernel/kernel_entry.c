@@ -15,35 +15,36 @@ Lithium OS kernel initialisation
 #include <syscall.h>
 #include <scheduler.h>
 #include <kmalloc.h>
-
+#include <pfdb.h>
+#include <memblock.h>
+#include <swap.h>
+#include <vmregion.h>
+
+#ifdef FORKBENCH
+#include "forkbench.h"
+#elif defined(ZRAMTEST)
+#include "zramtest.h"
+#else
 #include "lishell.h"
+#endif
 
 #define PAGEDIR_PHYSICAL_ADDRESS	0x00080000
-#define PAGEDIR_VIRTUAL_ADDRESS		0xFFFFF000
+#define PAE_PDPT_PHYSICAL_ADDRESS	0x00084000
 #define VIDMEM_PHYSICAL_ADDRESS		0x000B8000
-#define VIDMEM_VIRTUAL_ADDRESS		0xFFBFA000
-#define MEMBITMAP_PHYSICAL_ADDRESS	0x00100000
-#define MEMBITMAP_VIRTUAL_ADDRESS	0xFFBBA000
-#define GDT_PHYSICAL_ADDRESS		0x00000000
-#define GDT_VIRTUAL_ADDRESS			0xFFBB9000
+#define VIDMEM_VIRTUAL_ADDRESS		0xFF7FA000
 
-typedef struct
-{
-	uint32_t baseL; // Base address QWORD
-	uint32_t baseH;
-	uint32_t lengthL; // Length QWORD
-	uint32_t lengthH;
-	uint16_t type; // Region type
-	uint16_t acpi; // Extended
-	uint32_t padding; // Padding to make it 24 bytes
- 
-} __attribute__((__packed__)) mmap_entry_t;
-
-void kmain(void *ptrMemoryMap, uint32_t memoryMapEntryCount);
+// Physical memory that can be used in each paging mode, in frames. PAE is capped
+// at 16GiB to keep the physical memory manager's metadata (about 21 bytes per
+// frame) within the kernel's address space.
+#define MEMORY_LIMIT_32BIT			0x000FFFFF
+#define MEMORY_LIMIT_PAE			0x00400000
+
+void kmain(void *ptrMemoryMap, uint32_t memoryMapEntryCount, uint32_t pagingMode);
 void kernel_idle_loop(void);
-void initialise_memory(void *ptrMemoryMap, uint32_t uiMemoryMapEntryCount);
+void initialise_memory(void *ptrMemoryMap, uint32_t uiMemoryMapEntryCount, uint32_t pagingMode);
+void *alloc_pmm_metadata(uint32_t size);
 
-void kmain(void *ptrMemoryMap, uint32_t memoryMapEntryCount)
+void kmain(void *ptrMemoryMap, uint32_t memoryMapEntryCount, uint32_t pagingMode)
 {
 	// Self-explanatory functions
 	set_colour(0x0F);
@@ -54,7 +55,19 @@ void kmain(void *ptrMemoryMap, uint32_t memoryMapEntryCount)
 	timer_install();
 	keyboard_install();
 
-	initialise_memory(ptrMemoryMap, memoryMapEntryCount);
+	initialise_memory(ptrMemoryMap, memoryMapEntryCount, pagingMode);
+
+	if(swap_init())
+		print_string("Swap area initialised\n");
+	else
+		print_string("No swap drive found\n");
+
+	if(!process_init() || !vmregion_init())
+	{
+		print_string("Creating process object caches failed! System halted.");
+		disable_interrupts();
+		halt_cpu();
+	}
 
 	scheduler_setup_tss();
 
@@ -70,7 +83,13 @@ void kmain(void *ptrMemoryMap, uint32_t memoryMapEntryCount)
 		halt_cpu();
 	}
 
+#ifdef FORKBENCH
+	uint32_t id = scheduler_add_process((void *)forkbench, sizeof(forkbench));
+#elif defined(ZRAMTEST)
+	uint32_t id = scheduler_add_process((void *)zramtest, sizeof(zramtest));
+#else
 	uint32_t id = scheduler_add_process((void *)lishell, sizeof(lishell));
+#endif
 
 	if(id == 0)
 	{
@@ -113,109 +132,121 @@ void kernel_idle_loop(void)
 {
 	for(;;)
 	{
-		halt_cpu();
+		// Use idle time to prepare page tables and zero pages ahead of time, halting
+		// once there is nothing left to do
+		if(!vmmngr_ptable_pool_fill() && !pmmngr_zero_pool_fill())
+			halt_cpu();
 	}
 }
 
-void initialise_memory(void *ptrMemoryMap, uint32_t memoryMapEntryCount)
+void initialise_memory(void *ptrMemoryMap, uint32_t memoryMapEntryCount, uint32_t pagingMode)
 {
-	uint32_t memSize = 0;
+	bool pae = (pagingMode & PAGING_MODE_PAE) ? TRUE : FALSE;
 
-	mmap_entry_t *entries = (mmap_entry_t *)ptrMemoryMap;
+	if(pae)
+		print_string("PAE paging enabled\n");
 
 	print_string("Parsing BIOS memory map... ");
 
-	// Calculate the usable memory size from the BIOS memory map
-	for(uint32_t i = 0; i < memoryMapEntryCount; i++)
-	{
-		// Any memory above 4GiB is being ignored since this is a 32-bit OS
-		if(entries[i].baseH == 0)
-			memSize += entries[i].lengthL;
-	}
+	memblock_init((mmap_entry_t *)ptrMemoryMap, memoryMapEntryCount, pae ? MEMORY_LIMIT_PAE : MEMORY_LIMIT_32BIT);
 
 	print_string("done\n");
+
+	// Calculate the location and size of the extended BIOS data area
+	uint32_t ebdaBase = (uint32_t)(*(uint16_t*)0x040E) << 4;
+
+	if(ebdaBase > 0xA0000)
+		ebdaBase >>= 4;
+
+	uint32_t ebdaLength = 0xA0000 - ebdaBase;
 	
-	// Initialise the physical memory manager
-	pmmngr_init(memSize, (physical_addr)MEMBITMAP_PHYSICAL_ADDRESS);
+	// Reserve regions that we have used
+	memblock_reserve(0x00, 0x1000); // GDT
+	memblock_reserve(0x7E000, 0x2000); // Kernel stack (8192 KiB)
+	memblock_reserve(ebdaBase, ebdaLength); // EBDA
+	memblock_reserve(0xA0000, 0x60000); // Video memory/ROM area
+	memblock_reserve(PAGEDIR_PHYSICAL_ADDRESS, 0x4000); // Page directory and 3 page tables
 
-	print_string("Physical memory manager initialised\n");
+	// PAE page directory pointer table, 4 page directories and 5 page tables
+	if(pae)
+		memblock_reserve(PAE_PDPT_PHYSICAL_ADDRESS, 0xA000);
 
-	// Process BIOS memory map
-	for(uint32_t i = 0; i < memoryMapEntryCount; i++)
+	// The kernel (400KiB max). Stage 2 maps a whole 4MiB page table from here and the
+	// start of the kernel heap lives in it, so none of it can be handed out.
+	memblock_reserve(0x01000000, 0x400000);
+
+	// Initialise virtual memory manager. If it fails print a message and halt system.
+	if(!vmmngr_init(pae ? PAE_PDPT_PHYSICAL_ADDRESS : PAGEDIR_PHYSICAL_ADDRESS, pagingMode))
 	{
-		// Check if free for use or ACPI reclaimable
-		if(entries[i].type == 1 || entries[i].type == 3)
-		{
-			// Initialise region - makes it free for use
-			pmmngr_init_region(entries[i].baseL, entries[i].lengthL);
-		}
+		print_string("vmmngr_init() failed! System halted.");
+		disable_interrupts();
+		halt_cpu();
 	}
 
+	print_string("Virtual memory manager initialised\n");
+
+	if(!vmmngr_init_direct_map(memblock_end_of_usable()))
+	{
+		print_string("Mapping physical memory failed! System halted.");
+		disable_interrupts();
+		halt_cpu();
+	}
+
+	// Size the physical memory manager's metadata to the highest usable address and
+	// put it in free memory found by the boot allocator. It is used through the
+	// direct map so it needs no mapping of its own.
+	uint32_t blockCount = memblock_end_of_usable();
+
+	void *bitmapAddress = alloc_pmm_metadata(pmmngr_bitmap_size(blockCount));
+	void *buddyAddress = alloc_pmm_metadata(pmmngr_buddy_metadata_size(blockCount));
+	void *pfdbAddress = alloc_pmm_metadata(pfdb_size(blockCount));
+	
+	// Initialise the physical memory manager and hand it everything the boot allocator knows about
+	pmmngr_init(blockCount, bitmapAddress);
+
+	memblock_release_to_pmmngr();
+
+	print_string("Physical memory manager initialised\n");
+
 	// Calculate usable memory in KiB
-	uint32_t usableMem = pmmngr_get_free_block_count() * PAGE_SIZE / 1024;
+	uint32_t usableMem = pmmngr_get_free_block_count() * (PAGE_SIZE / 1024);
 	char printBuf[12] = {0};
 	itoa((int)usableMem, printBuf, 10);
 	print_string("Initialised ");
 	print_string(printBuf);
 	print_string(" KiB of usable memory\n");
 
-	// Calculate the location and size of the extended BIOS data area
-	uint32_t ebdaBase = (uint32_t)(*(uint16_t*)0x040E) << 4;
+	// Switch the physical memory manager over from the bitmap to the buddy allocator
+	pmmngr_buddy_init(buddyAddress);
 
-	if(ebdaBase > 0xA0000)
-		ebdaBase >>= 4;
+	print_string("Buddy allocator initialised\n");
 
-	uint32_t ebdaLength = 0xA0000 - ebdaBase;
-	
-	// De-initialise regions that we have used
-	pmmngr_deinit_region(0x00, 0x1000); // GDT
-	pmmngr_deinit_region(0x7E000, 0x2000); // Kernel stack (8192 KiB)
-	pmmngr_deinit_region(ebdaBase, ebdaLength); // EBDA
-	pmmngr_deinit_region(0xA0000, 0x60000); // Video memory/ROM area
-	pmmngr_deinit_region(MEMBITMAP_PHYSICAL_ADDRESS, 0x40000); // Physical memory manager bitmap
-	pmmngr_deinit_region(PAGEDIR_PHYSICAL_ADDRESS, 0x4000); // Page directory and 3 page tables
-	pmmngr_deinit_region(0x01000000, 0x64000); // The kernel (400KiB max)
-
-	// Recursive paging - we can use physical address since first 4MiB is identity mapped
-	pd_entry *pde =  vmmngr_pdirectory_lookup_entry((pdirectory *)PAGEDIR_PHYSICAL_ADDRESS, 0xFFFFFFFF);
-	pd_entry_set_frame(pde, PAGEDIR_PHYSICAL_ADDRESS);
-	pd_entry_add_attrib(pde, PDE_PRESENT);
-	
-	// Initialise virtual memory manager. If it fails print a message and halt system.
-	if(!vmmngr_init((physical_addr)PAGEDIR_PHYSICAL_ADDRESS))
+	pfdb_init(pfdbAddress, blockCount);
+
+	print_string("Page frame database initialised\n");
+
+	// Give the kernel half all of its page tables now so every address space can share them
+	if(!vmmngr_preallocate_kernel_tables())
 	{
-		print_string("vmmngr_init() failed! System halted.");
+		print_string("Allocating kernel page tables failed! System halted.");
 		disable_interrupts();
 		halt_cpu();
 	}
 
-	print_string("Virtual memory manager initialised\n");
+	if(!vmmngr_init_zero_page())
+	{
+		print_string("Allocating the zero page failed! System halted.");
+		disable_interrupts();
+		halt_cpu();
+	}
 
 	// Map video memory
-	vmmngr_map_page(VIDMEM_PHYSICAL_ADDRESS, VIDMEM_VIRTUAL_ADDRESS);
-	vmmngr_map_page(VIDMEM_PHYSICAL_ADDRESS + 4096, VIDMEM_VIRTUAL_ADDRESS + 4096);
-	vmmngr_map_page(VIDMEM_PHYSICAL_ADDRESS + 8192, VIDMEM_VIRTUAL_ADDRESS + 8192);
-	vmmngr_map_page(VIDMEM_PHYSICAL_ADDRESS + 12288, VIDMEM_VIRTUAL_ADDRESS + 12288);
+	vmmngr_map_range(VIDMEM_PHYSICAL_ADDRESS / PAGE_SIZE, VIDMEM_VIRTUAL_ADDRESS, 4, VMM_WRITABLE | VMM_GLOBAL);
 	
 	// Update the video memory pointer
 	set_vid_mem((void *)VIDMEM_VIRTUAL_ADDRESS);
 	
-	// Map the memory management bitmap. The bitmap is 256KiB in size, so that's (256 / 4 = 64) pages.
-	for(uint32_t i = 0; i < 64; ++i)
-	{
-		vmmngr_map_page((physical_addr)(MEMBITMAP_PHYSICAL_ADDRESS + i * 4096),
-			(virtual_addr)(MEMBITMAP_VIRTUAL_ADDRESS + i * 4096));
-	}
-	
-	// Update the memory bitmap pointer
-	pmmngr_set_bitmap_address((void *)MEMBITMAP_VIRTUAL_ADDRESS);
-	
-	// Map GDT
-	vmmngr_map_page((physical_addr)GDT_PHYSICAL_ADDRESS, (virtual_addr)GDT_VIRTUAL_ADDRESS);
-
-	// Set GDT address
-	// TODO: set_gdt_address(GDT_VIRTUAL_ADDRESS);
-	// ATM it is assuming the correct address
+	// The GDT is at physical address 0 and is reached through the direct map
 	
 	// Setup GDT
 	gdt_set_entry(0, 0x0000000000000000); // NULL descriptor.
@@ -230,12 +261,15 @@ void initialise_memory(void *ptrMemoryMap, uint32_t memoryMapEntryCount)
 
 	print_string("GDT updated\n");
 	
-	// Un-identity-map first 4MiB
-	pde =  vmmngr_pdirectory_lookup_entry((pdirectory *)PAGEDIR_VIRTUAL_ADDRESS, 0x00000000);
-	pd_entry_del_attrib(pde, PDE_PRESENT);
+	// Un-identity-map first 4MiB and free the page tables stage 2 used for it.
+	// PAE page tables only cover 2MiB each.
+	for(virtual_addr addr = 0; addr < 0x400000; addr += 0x200000)
+	{
+		physical_addr pt = vmmngr_unmap_ptable(addr);
 
-	// The first page table (used for first 4MiB) was at 0x81000, so we can free that memory now
-	pmmngr_init_region((physical_addr)0x81000, 0x1000);
+		if(pt)
+			pmmngr_init_region(pt, 0x1000);
+	}
 	
 	// Initialise kernel memory allocator
 	if(!kmalloc_init())
@@ -247,3 +281,23 @@ void initialise_memory(void *ptrMemoryMap, uint32_t memoryMapEntryCount)
 
 	print_string("Kernel memory allocator initialised\n");
 }
+
+/*
+Allocates physical memory for part of the physical memory manager's metadata
+from the boot allocator. Returns its address in the direct map.
+*/
+void *alloc_pmm_metadata(uint32_t size)
+{
+	size = (size + PAGE_SIZE - 1) & ~(uint32_t)(PAGE_SIZE - 1);
+
+	physical_addr phys = memblock_alloc(size, PAGE_SIZE);
+
+	if(phys == 0)
+	{
+		print_string("Allocating physical memory manager metadata failed! System halted.");
+		disable_interrupts();
+		halt_cpu();
+	}
+
+	return phys_to_virt(phys);
+}
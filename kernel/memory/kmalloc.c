@@ -11,9 +11,9 @@ heap.
 
 3. The following definitions: FALSE = 0, TRUE = 1.
 
-4. A virtual memory manager with a function which does the same as
-the vmmngr_alloc_page() function used in this code. The vmmngr_alloc_page()
-function must guarantee that the specified page is mapped into physical
+4. A virtual memory manager with functions which do the same as
+the vmmngr_alloc_page() and vmmngr_alloc_range() functions used in this code.
+They must guarantee that the specified pages are mapped into physical
 memory.
 
 NOTES:
@@ -23,16 +23,45 @@ aligned on a PAGE_SIZE boundary.
 
 You must call kmalloc_init() before using the kernel memory allocator.
 
-The status field of the kmallocHeader struct is 32 bits for a reason -
-you could use it to store information about the memory request.
+The heap is a row of blocks, each starting with a header that holds its size
+(with the low bit set while it is in use) and the size of the block before it.
+These boundary tags let kfree() merge a block with free neighbours on both
+sides straight away, so there are never two free blocks next to each other.
+A zero sized block that is always in use marks the end of the heap.
+
+Free blocks are kept on segregated lists, one for each power of two size class,
+and a bit mask records which lists aren't empty. kmalloc() takes the first
+block of the smallest class that is sure to be big enough, so allocations don't
+depend on how many blocks the heap holds. Only when no such class has a block
+is the class below searched, since some of its blocks may still fit.
+
+Blocks are multiples of BLOCK_ALIGN bytes and start on a BLOCK_ALIGN boundary,
+as does the memory handed out after each header. kmalloc_aligned() asks for
+enough extra to reach a stricter alignment, then frees the space in front of
+the aligned address and past the end again.
+
+A bitmap records which pages of the heap are mapped, so handing out a block in
+pages that are already resident costs a bit test. The pages mapped along with
+the kernel are marked at the start and never released. The heap is mapped from the
+start up to mappedEnd, growing by KHEAP_GROW_PAGES at a time with a single
+range map, except where pages were released. When free memory runs low, kfree()
+releases the whole pages in the middle of the free block it leaves behind; the
+pages holding its header and the next block's header always stay mapped, and
+kmalloc() maps released pages again when it hands them out.
 */
 
 #include <kmalloc.h>
 #include <vmmngr.h>
 
-#define KHEAP_END 0xF0000000
+#define KHEAP_END 0xD0000000 // Start of the direct map of physical memory
+#define KHEAP_MAX_PAGES ((KHEAP_END - KERNEL_VIRTUAL_BASE) / PAGE_SIZE)
+#define KHEAP_GROW_PAGES 16 // Pages mapped at a time when the heap grows
+#define KHEAP_LOW_MEMORY 256 // Free frames below which kfree() releases pages
 #define PAGE_SIZE 4096
-#define MIN_BLOCK_SIZE 4
+#define BLOCK_ALIGN 8
+#define BLOCK_USED 1
+#define MIN_BLOCK_SIZE (uint32_t)sizeof(struct kmallocFreeBlock)
+#define SIZE_CLASSES 32
 
 extern uint32_t _KERNEL_END_;
 
@@ -40,45 +69,80 @@ static void *KHEAP_START;
 
 struct kmallocHeader
 {
-	uint32_t status;
-	struct kmallocHeader *previousHeader;
-	struct kmallocHeader *nextHeader;
-} __attribute__((__packed__));
+	uint32_t previousSize;	// Size of the block before this one, 0 for the first block
+	uint32_t size;			// Size of the whole block including this header, BLOCK_USED set if in use
+};
+
+// Free blocks keep their list links after the header
+struct kmallocFreeBlock
+{
+	struct kmallocHeader header;
+	struct kmallocFreeBlock *previous;
+	struct kmallocFreeBlock *next;
+};
+
+static struct kmallocFreeBlock *freeLists[SIZE_CLASSES];
+static uint32_t freeListMask = 0; // Bit n set if freeLists[n] isn't empty
+static uint32_t mappedPages[KHEAP_MAX_PAGES / 32]; // Bit n set if page n of the kernel half is mapped
+static uint32_t mappedEnd = 0; // Nothing from here up to the last page of the heap is mapped
+static uint32_t kernelMappedEnd = 0; // End of the part of the heap mapped along with the kernel
+static uint32_t mappedCount = 0;
+static uint32_t releasedCount = 0;
+
+static uint32_t kmalloc_size_class(uint32_t size);
+static void kmalloc_list_push(struct kmallocFreeBlock *block);
+static void kmalloc_list_remove(struct kmallocFreeBlock *block);
+static struct kmallocFreeBlock *kmalloc_find_free(uint32_t size);
+static struct kmallocHeader *kmalloc_next_header(struct kmallocHeader *header);
+static void kmalloc_trim(struct kmallocHeader *header, uint32_t size);
+static bool kmalloc_map(uint32_t start, uint32_t length);
+static bool kmalloc_map_pages(uint32_t first, uint32_t count);
+static void kmalloc_release(struct kmallocFreeBlock *block);
+static bool kmalloc_page_mapped(uint32_t page);
+static void kmalloc_set_mapped(uint32_t page, bool mapped);
 
 bool kmalloc_init(void)
 {
 	KHEAP_START = &_KERNEL_END_;
+	mappedEnd = (uint32_t)KHEAP_START;
+
+	// The start of the heap shares the kernel's mapping (a large page when
+	// supported), which is already resident and can't be unmapped page by page
+	while(mappedEnd < KHEAP_END - PAGE_SIZE && vmmngr_get_frame(mappedEnd))
+	{
+		kmalloc_set_mapped(mappedEnd, TRUE);
+		mappedCount++;
+		mappedEnd += PAGE_SIZE;
+	}
+
+	kernelMappedEnd = mappedEnd;
 
 	// Make sure pages for starting headers are mapped
-	if(!vmmngr_alloc_page((virtual_addr)KHEAP_START))
+	if(!kmalloc_map((uint32_t)KHEAP_START, MIN_BLOCK_SIZE))
 		return FALSE;
 
-	if(!vmmngr_alloc_page((virtual_addr)(KHEAP_END - PAGE_SIZE)))
+	if(!kmalloc_map_pages(KHEAP_END - PAGE_SIZE, 1))
 		return FALSE;
 
-	// Set up first header
-	struct kmallocHeader *header = (struct kmallocHeader *)KHEAP_START;
-
-	// Set to zero to mark it as free
-	header->status = 0;
+	for(uint32_t i = 0; i < SIZE_CLASSES; ++i)
+		freeLists[i] = NULL;
 
-	// Pointer to previous header - zero means no previous header
-	header->previousHeader = (struct kmallocHeader *)0; 
+	freeListMask = 0;
 
-	// Set to end of heap
-	header->nextHeader = (struct kmallocHeader *)(KHEAP_END - sizeof(struct kmallocHeader));
+	// The whole heap starts out as one free block
+	struct kmallocFreeBlock *block = (struct kmallocFreeBlock *)KHEAP_START;
+	uint32_t size = KHEAP_END - (uint32_t)KHEAP_START - (uint32_t)sizeof(struct kmallocHeader);
 
-	// Set up last header
-	header = (struct kmallocHeader *)(KHEAP_END - sizeof(struct kmallocHeader));
+	block->header.previousSize = 0;
+	block->header.size = size;
 
-	// Set last entry to used - it is 0 bytes in size anyway
-	header->status = 0x00000001;
+	kmalloc_list_push(block);
 
-	// Set previous header pointer
-	header->previousHeader = (struct kmallocHeader *)(KHEAP_START);
+	// Set up last header - it is 0 bytes in size and always used
+	struct kmallocHeader *header = (struct kmallocHeader *)(KHEAP_END - sizeof(struct kmallocHeader));
 
-	// Set next header pointer
-	header->nextHeader = (struct kmallocHeader *)(KHEAP_END - sizeof(struct kmallocHeader));
+	header->previousSize = size;
+	header->size = BLOCK_USED;
 
 	return TRUE;
 }
@@ -89,182 +153,368 @@ void *kmalloc(size_t bytes)
 	if(bytes == 0)
 		return NULL;
 
-	if(bytes < MIN_BLOCK_SIZE)
-		bytes = MIN_BLOCK_SIZE;
-
 	if(bytes > (uint32_t)(KHEAP_END - (uint32_t)KHEAP_START - (2 * sizeof(struct kmallocHeader))))
 		return NULL;
 
-	struct kmallocHeader *currentHeader = (struct kmallocHeader *)KHEAP_START;
-	struct kmallocHeader *nextHeader = NULL;
-	struct kmallocHeader *newHeader = NULL;
-	void *retVal = NULL;
+	uint32_t size = ((uint32_t)bytes + (uint32_t)sizeof(struct kmallocHeader) + BLOCK_ALIGN - 1) & ~(uint32_t)(BLOCK_ALIGN - 1);
+
+	if(size < MIN_BLOCK_SIZE)
+		size = MIN_BLOCK_SIZE;
+
+	struct kmallocFreeBlock *block = kmalloc_find_free(size);
 
-	while((uint32_t)currentHeader < (uint32_t)(KHEAP_END - sizeof(struct kmallocHeader)))
+	if(block == NULL)
+		return NULL;
+
+	kmalloc_list_remove(block);
+
+	uint32_t blockSize = block->header.size;
+	struct kmallocHeader *next = kmalloc_next_header(&block->header);
+
+	// Split off the rest if it is big enough to be a block of its own
+	if(blockSize - size >= MIN_BLOCK_SIZE)
 	{
-		if(currentHeader->status == 0)
-		{
-			// This block is free, check if it is big enough
-			if(((uint32_t)currentHeader->nextHeader - (uint32_t)currentHeader) >=
-				(uint32_t)(sizeof(struct kmallocHeader) + bytes))
-			{
-				// Block is big enough, allocate space
-				// Set header of current block to used status
-				currentHeader->status = 0x00000001; // Set used
-
-				// Check if we have to make a new header or one already exists
-				if((uint32_t)currentHeader->nextHeader ==
-					((uint32_t)currentHeader + sizeof(struct kmallocHeader) + bytes))
-				{
-					// Header already exists
-					nextHeader = currentHeader->nextHeader;
-
-					// Make sure the next header has the correct previous header pointer
-					nextHeader->previousHeader = currentHeader;
-
-					// Set pointer to allocated memory
-					retVal = (void *)((uint32_t)currentHeader + (uint32_t)sizeof(struct kmallocHeader));
-
-					break;
-				}
-				else
-				{
-					// We have to create a new header
-					nextHeader = currentHeader->nextHeader;
-					newHeader = (struct kmallocHeader*)((uint32_t)currentHeader +
-						sizeof(struct kmallocHeader) + bytes);
-
-					// Check if our new header will overlap any other headers or will be too close
-					if(((uint32_t)nextHeader - (uint32_t)newHeader) <
-						(sizeof(struct kmallocHeader) + MIN_BLOCK_SIZE))
-					{
-						// It will overlap or is too close, just use the next header and waste a few bytes
-						// Make sure the next header has the correct previous header pointer
-						nextHeader->previousHeader = currentHeader;
-
-						// Set pointer to allocated memory
-						retVal = (void *)((uint32_t)currentHeader + (uint32_t)sizeof(struct kmallocHeader));
-
-						break;
-					}
-					else
-					{
-						// It will not overlap any other headers, go ahead and create a new one
-						// Set next header of current header
-						currentHeader->nextHeader = newHeader;
-
-						// Set status of new header
-						newHeader->status = 0;
-
-						// Set previous header of new header
-						newHeader->previousHeader = currentHeader;
-
-						// Set next header of new header
-						newHeader->nextHeader = nextHeader;
-
-						// Set previous header of next header
-						nextHeader->previousHeader = newHeader;
-
-						// Set pointer to allocated memory
-						retVal = (void *)((uint32_t)currentHeader + (uint32_t)sizeof(struct kmallocHeader));
-
-						break;
-					}
-				}
-			}
-			else
-			{
-				// Block is not big enough, go to next block
-				currentHeader = currentHeader->nextHeader;
-			}
-		}
-		else
+		struct kmallocFreeBlock *rest = (struct kmallocFreeBlock *)((uint32_t)block + size);
+
+		if(!kmalloc_map((uint32_t)rest, MIN_BLOCK_SIZE))
 		{
-			// Block is not free, go to next block
-			currentHeader = currentHeader->nextHeader;
+			kmalloc_list_push(block);
+
+			return NULL;
 		}
+
+		rest->header.previousSize = size;
+		rest->header.size = blockSize - size;
+		next->previousSize = rest->header.size;
+
+		kmalloc_list_push(rest);
+
+		blockSize = size;
 	}
-	
+
+	block->header.size = blockSize | BLOCK_USED;
+
+	void *retVal = (void *)((uint32_t)block + (uint32_t)sizeof(struct kmallocHeader));
+
 	// Make sure area is mapped in virtual memory
-	uint32_t sizeToCheck = bytes;
-	
-	for(uint32_t addr = (uint32_t)retVal; (addr & 0xFFFFF000) <= ((uint32_t)retVal + sizeToCheck);
-		addr += PAGE_SIZE)
+	if(!kmalloc_map((uint32_t)retVal, (uint32_t)bytes))
 	{
-		// Make sure memory is mapped
-		if(!vmmngr_alloc_page(addr))
-			return 0;
+		kfree(retVal);
+
+		return NULL;
 	}
-	
+
 	return retVal;
 }
 
 void kfree(void *address)
 {
-	// Initialise header pointers
-	struct kmallocHeader* currentHeader = (struct kmallocHeader *)((uint32_t)address -
+	if(address == NULL)
+		return;
+
+	struct kmallocFreeBlock *block = (struct kmallocFreeBlock *)((uint32_t)address -
 		sizeof(struct kmallocHeader));
-	struct kmallocHeader* previousHeader = currentHeader->previousHeader;
-	struct kmallocHeader* nextHeader = currentHeader->nextHeader;
+	uint32_t size = block->header.size & ~(uint32_t)BLOCK_USED;
+	struct kmallocHeader *next = (struct kmallocHeader *)((uint32_t)block + size);
+
+	// Merge with the next block if it is free
+	if(!(next->size & BLOCK_USED))
+	{
+		kmalloc_list_remove((struct kmallocFreeBlock *)next);
+		size += next->size;
+		next = kmalloc_next_header(next);
+	}
+
+	// And with the previous one
+	if(block->header.previousSize != 0)
+	{
+		struct kmallocFreeBlock *previous = (struct kmallocFreeBlock *)((uint32_t)block -
+			block->header.previousSize);
+
+		if(!(previous->header.size & BLOCK_USED))
+		{
+			kmalloc_list_remove(previous);
+			size += previous->header.size;
+			block = previous;
+		}
+	}
+
+	block->header.size = size;
+	next->previousSize = size;
+
+	kmalloc_list_push(block);
+
+	if(pmmngr_get_free_block_count() < KHEAP_LOW_MEMORY)
+		kmalloc_release(block);
+}
+
+/*
+Reports how many pages of the heap are mapped and how many have been released
+while free memory was low.
+*/
+void kmalloc_get_stats(uint32_t *pagesMapped, uint32_t *pagesReleased)
+{
+	*pagesMapped = mappedCount;
+	*pagesReleased = releasedCount;
+}
+
+/*
+Allocates bytes at an address that is a multiple of align, which must be a
+power of two. The memory is freed with kfree() like any other block. Returns
+NULL if out of memory.
+*/
+void *kmalloc_aligned(size_t bytes, size_t align)
+{
+	if(align <= BLOCK_ALIGN)
+		return kmalloc(bytes);
+
+	if((align & (align - 1)) || (bytes == 0) || (bytes > KHEAP_END - (uint32_t)KHEAP_START - align - MIN_BLOCK_SIZE))
+		return NULL;
+
+	// Enough extra to move the start up to an aligned address and leave a free
+	// block in front of it
+	uint32_t address = (uint32_t)kmalloc(bytes + align + MIN_BLOCK_SIZE);
+
+	if(address == 0)
+		return NULL;
+
+	struct kmallocHeader *header = (struct kmallocHeader *)(address - sizeof(struct kmallocHeader));
+
+	if(address & (align - 1))
+	{
+		uint32_t aligned = (address + MIN_BLOCK_SIZE + align - 1) & ~(uint32_t)(align - 1);
+		uint32_t lead = aligned - address;
+		uint32_t size = header->size & ~(uint32_t)BLOCK_USED;
+		struct kmallocHeader *moved = (struct kmallocHeader *)(aligned - sizeof(struct kmallocHeader));
+
+		moved->previousSize = lead;
+		moved->size = (size - lead) | BLOCK_USED;
+		kmalloc_next_header(moved)->previousSize = size - lead;
+
+		// The part in front goes back on the free lists
+		header->size = lead | BLOCK_USED;
+		kfree((void *)address);
+
+		header = moved;
+		address = aligned;
+	}
+
+	uint32_t size = ((uint32_t)bytes + (uint32_t)sizeof(struct kmallocHeader) + BLOCK_ALIGN - 1) & ~(uint32_t)(BLOCK_ALIGN - 1);
+
+	kmalloc_trim(header, (size < MIN_BLOCK_SIZE) ? MIN_BLOCK_SIZE : size);
+
+	return (void *)address;
+}
+
+/*
+Returns the class of free blocks of size bytes: class n holds blocks of at
+least 2^n bytes and less than 2^(n + 1).
+*/
+static uint32_t kmalloc_size_class(uint32_t size)
+{
+	uint32_t bit;
+
+	__asm__ ("bsrl %1, %0" : "=r" (bit) : "rm" (size));
+
+	return bit;
+}
+
+static void kmalloc_list_push(struct kmallocFreeBlock *block)
+{
+	uint32_t sizeClass = kmalloc_size_class(block->header.size);
+
+	block->previous = NULL;
+	block->next = freeLists[sizeClass];
 
-	// Unallocate that block
-	currentHeader->status = 0;
+	if(block->next != NULL)
+		block->next->previous = block;
 
-	// Check if we can merge it with previous block
-	if((uint32_t)previousHeader != 0)
+	freeLists[sizeClass] = block;
+	freeListMask |= 1u << sizeClass;
+}
+
+static void kmalloc_list_remove(struct kmallocFreeBlock *block)
+{
+	uint32_t sizeClass = kmalloc_size_class(block->header.size);
+
+	if(block->previous != NULL)
+		block->previous->next = block->next;
+	else
+		freeLists[sizeClass] = block->next;
+
+	if(block->next != NULL)
+		block->next->previous = block->previous;
+
+	if(freeLists[sizeClass] == NULL)
+		freeListMask &= ~(1u << sizeClass);
+}
+
+/*
+Finds a free block of at least size bytes, or returns NULL if there isn't one.
+*/
+static struct kmallocFreeBlock *kmalloc_find_free(uint32_t size)
+{
+	uint32_t sizeClass = kmalloc_size_class(size);
+
+	// Every block in a higher class is big enough; this one only is if size is a
+	// power of two
+	uint32_t first = (size & (size - 1)) ? sizeClass + 1 : sizeClass;
+	uint32_t mask = (first < SIZE_CLASSES) ? freeListMask & ~((1u << first) - 1) : 0;
+
+	if(mask != 0)
+	{
+		uint32_t found;
+
+		__asm__ ("bsfl %1, %0" : "=r" (found) : "rm" (mask));
+
+		return freeLists[found];
+	}
+
+	// Some blocks in size's own class may still fit
+	for(struct kmallocFreeBlock *block = freeLists[sizeClass]; block != NULL; block = block->next)
+	{
+		if(block->header.size >= size)
+			return block;
+	}
+
+	return NULL;
+}
+
+static struct kmallocHeader *kmalloc_next_header(struct kmallocHeader *header)
+{
+	return (struct kmallocHeader *)((uint32_t)header + (header->size & ~(uint32_t)BLOCK_USED));
+}
+
+/*
+Frees the end of the used block at header beyond its first size bytes, if it is
+big enough to be a block of its own. The end must already be mapped.
+*/
+static void kmalloc_trim(struct kmallocHeader *header, uint32_t size)
+{
+	uint32_t blockSize = header->size & ~(uint32_t)BLOCK_USED;
+
+	if(blockSize - size < MIN_BLOCK_SIZE)
+		return;
+
+	struct kmallocHeader *rest = (struct kmallocHeader *)((uint32_t)header + size);
+
+	rest->previousSize = size;
+	rest->size = (blockSize - size) | BLOCK_USED;
+	kmalloc_next_header(rest)->previousSize = blockSize - size;
+	header->size = size | BLOCK_USED;
+
+	kfree((void *)((uint32_t)rest + sizeof(struct kmallocHeader)));
+}
+
+/*
+Makes sure the pages holding length bytes from start are mapped. Pages past
+mappedEnd are mapped KHEAP_GROW_PAGES at a time.
+*/
+static bool kmalloc_map(uint32_t start, uint32_t length)
+{
+	uint32_t page = start & ~(uint32_t)(PAGE_SIZE - 1);
+	uint32_t end = start + length;
+
+	for(; page < end; page += PAGE_SIZE)
 	{
-		if(previousHeader->status == 0)
+		if(kmalloc_page_mapped(page))
+			continue;
+
+		if(page >= mappedEnd)
 		{
-			// Previous block isn't allocated, we can merge
-			previousHeader->nextHeader = nextHeader;
-			nextHeader->previousHeader = previousHeader;
-
-			// Check if we can merge it with next block
-			if(nextHeader->status == 0)
-			{
-				// Next block isn't allocated, we can merge
-				// Update header pointers from previous merge
-				currentHeader = nextHeader;
-				nextHeader = currentHeader->nextHeader;
-
-				// Merge
-				previousHeader->nextHeader = nextHeader;
-				nextHeader->previousHeader = previousHeader;
-			}
-
-			return;
+			uint32_t growEnd = (end + PAGE_SIZE - 1) & ~(uint32_t)(PAGE_SIZE - 1);
+
+			if(growEnd < page + KHEAP_GROW_PAGES * PAGE_SIZE)
+				growEnd = page + KHEAP_GROW_PAGES * PAGE_SIZE;
+
+			// The last page of the heap is mapped by kmalloc_init()
+			if(growEnd > KHEAP_END - PAGE_SIZE)
+				growEnd = KHEAP_END - PAGE_SIZE;
+
+			if(growEnd > page && !kmalloc_map_pages(page, (growEnd - page) / PAGE_SIZE))
+				return FALSE;
+
+			mappedEnd = growEnd;
+
+			return TRUE;
 		}
-		else
+
+		// A page released earlier
+		if(!kmalloc_map_pages(page, 1))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static bool kmalloc_map_pages(uint32_t first, uint32_t count)
+{
+	if(!vmmngr_alloc_range(first, count, VMM_WRITABLE | VMM_GLOBAL, 0, NULL))
+		return FALSE;
+
+	for(uint32_t i = 0; i < count; ++i)
+	{
+		if(!kmalloc_page_mapped(first + i * PAGE_SIZE))
 		{
-			// Check if we can merge it with next block
-			if(nextHeader->status == 0)
-			{
-				// Next block isn't allocated, we can merge
-				previousHeader = currentHeader;
-				currentHeader = nextHeader;
-				nextHeader = currentHeader->nextHeader;
-
-				// Merge
-				previousHeader->nextHeader = nextHeader;
-				nextHeader->previousHeader = previousHeader;
-			}
-
-			return;
+			kmalloc_set_mapped(first + i * PAGE_SIZE, TRUE);
+			mappedCount++;
 		}
 	}
 
-	// If we get to here, we must be dealing with the first block
-	// Only check if we can merge with next block
-	if(nextHeader->status == 0)
+	return TRUE;
+}
+
+/*
+Unmaps the whole pages of the free block that hold neither its header and list
+links nor the next block's header.
+*/
+static void kmalloc_release(struct kmallocFreeBlock *block)
+{
+	uint32_t first = ((uint32_t)block + MIN_BLOCK_SIZE + PAGE_SIZE - 1) & ~(uint32_t)(PAGE_SIZE - 1);
+	uint32_t end = ((uint32_t)block + block->header.size) & ~(uint32_t)(PAGE_SIZE - 1);
+	bool last = (end == KHEAP_END - PAGE_SIZE);
+	tlb_gather_t tlb;
+
+	if(first < kernelMappedEnd)
+		first = kernelMappedEnd;
+
+	// Nothing past the extent is mapped
+	if(end > mappedEnd)
+		end = mappedEnd;
+
+	vmmngr_tlb_gather_init(&tlb);
+
+	for(uint32_t page = first; page < end; page += PAGE_SIZE)
 	{
-		// Next block isn't allocated, we can merge
-		previousHeader = currentHeader;
-		currentHeader = nextHeader;
-		nextHeader = currentHeader->nextHeader;
-
-		// Merge
-		previousHeader->nextHeader = nextHeader;
-		nextHeader->previousHeader = previousHeader;
+		if(!kmalloc_page_mapped(page))
+			continue;
+
+		vmmngr_free_page_gather(page, &tlb);
+		kmalloc_set_mapped(page, FALSE);
+		mappedCount--;
+		releasedCount++;
 	}
-	
+
+	vmmngr_tlb_gather_flush(&tlb);
+
+	// Pull the extent back if the block was the last one
+	if(last && first < mappedEnd)
+		mappedEnd = first;
+}
+
+static bool kmalloc_page_mapped(uint32_t page)
+{
+	uint32_t index = (page - KERNEL_VIRTUAL_BASE) / PAGE_SIZE;
+
+	return (mappedPages[index / 32] & (1u << (index & 31))) != 0;
+}
+
+static void kmalloc_set_mapped(uint32_t page, bool mapped)
+{
+	uint32_t index = (page - KERNEL_VIRTUAL_BASE) / PAGE_SIZE;
+
+	if(mapped)
+		mappedPages[index / 32] |= 1u << (index & 31);
+	else
+		mappedPages[index / 32] &= ~(1u << (index & 31));
 }
@@ -0,0 +1,154 @@
+/*
+Lithium OS page granular kernel allocator.
+
+Hands out whole, page aligned runs of kernel memory for buffers and stacks that
+are too big for the kernel heap or need to be page aligned. Addresses come from
+an area of the kernel half set aside for this (KPAGE_AREA_BASE), tracked with
+a bitmap of its pages, and frames from the physical memory manager, so large
+allocations never fragment the small object heap.
+
+Every run is followed by an unmapped guard page, so running off the end of a
+buffer or stack faults straight away instead of corrupting the next one.
+*/
+
+#include <kpage.h>
+#include <vmmngr.h>
+#include <pfdb.h>
+
+#define KPAGE_GUARD_PAGES	1
+
+static uint32_t areaMap[KPAGE_AREA_PAGES / 32];
+static uint32_t searchStart = 0; // No free run starts before this page
+
+static uint32_t kpage_area_alloc(uint32_t count);
+static void kpage_area_free(uint32_t first, uint32_t count);
+static bool kpage_area_test(uint32_t page);
+
+/*
+Allocates count pages of kernel memory, mapped writable. flags is a combination
+of the KPAGE_ flags. Returns NULL if there is no room in the area or not enough
+memory.
+*/
+void *kpage_alloc(uint32_t count, uint32_t flags)
+{
+	if(count == 0 || count > KPAGE_AREA_PAGES - KPAGE_GUARD_PAGES)
+		return NULL;
+
+	uint32_t first = kpage_area_alloc(count + KPAGE_GUARD_PAGES);
+
+	if(first == KPAGE_AREA_PAGES)
+		return NULL;
+
+	virtual_addr virt = KPAGE_AREA_BASE + first * PAGE_SIZE;
+	bool ok;
+
+	if(flags & (KPAGE_CONTIGUOUS | KPAGE_DMA))
+	{
+		physical_addr phys = (physical_addr)((flags & KPAGE_DMA) ? pmmngr_alloc_blocks_zone(count, PMMNGR_ZONE_DMA)
+			: pmmngr_alloc_blocks(count));
+
+		ok = (phys != 0);
+
+		if(ok)
+		{
+			for(uint32_t i = 0; i < count; ++i)
+				pfdb_frame_set(phys / PAGE_SIZE + i, PFDB_KERNEL, 0);
+
+			// Kernel page tables are all allocated at boot, so this can't fail
+			vmmngr_map_range(phys / PAGE_SIZE, virt, count, VMM_WRITABLE | VMM_GLOBAL);
+		}
+	}
+	else
+		ok = vmmngr_alloc_range(virt, count, VMM_WRITABLE | VMM_GLOBAL, 0, NULL);
+
+	if(!ok)
+	{
+		// Gives back whatever vmmngr_alloc_range() managed to map
+		kpage_free((void *)virt, count);
+
+		return NULL;
+	}
+
+	if(flags & KPAGE_ZERO)
+		memsetd((uint32_t *)virt, 0, count * PAGE_SIZE / 4);
+
+	return (void *)virt;
+}
+
+/*
+Frees count pages allocated by kpage_alloc() at address. count must be the
+number of pages that were allocated.
+*/
+void kpage_free(void *address, uint32_t count)
+{
+	virtual_addr virt = (virtual_addr)address;
+
+	if(virt < KPAGE_AREA_BASE || count == 0)
+		return;
+
+	uint32_t first = (virt - KPAGE_AREA_BASE) / PAGE_SIZE;
+
+	if(first + count + KPAGE_GUARD_PAGES > KPAGE_AREA_PAGES)
+		return;
+
+	// Pages that were never mapped are skipped
+	for(uint32_t i = 0; i < count; ++i, virt += PAGE_SIZE)
+		vmmngr_free_page(virt);
+
+	kpage_area_free(first, count + KPAGE_GUARD_PAGES);
+}
+
+/*
+Finds and marks the first run of count free pages in the area. Returns the
+index of its first page, or KPAGE_AREA_PAGES if there isn't one.
+*/
+static uint32_t kpage_area_alloc(uint32_t count)
+{
+	uint32_t run = 0;
+
+	for(uint32_t page = searchStart; page < KPAGE_AREA_PAGES; ++page)
+	{
+		// Skip whole words that are in use
+		if((page & 31) == 0 && areaMap[page / 32] == 0xFFFFFFFF)
+		{
+			run = 0;
+			page += 31;
+			continue;
+		}
+
+		if(kpage_area_test(page))
+		{
+			run = 0;
+			continue;
+		}
+
+		if(++run == count)
+		{
+			uint32_t first = page + 1 - count;
+
+			for(uint32_t i = first; i <= page; ++i)
+				areaMap[i / 32] |= 1u << (i & 31);
+
+			if(first == searchStart)
+				searchStart = page + 1;
+
+			return first;
+		}
+	}
+
+	return KPAGE_AREA_PAGES;
+}
+
+static void kpage_area_free(uint32_t first, uint32_t count)
+{
+	for(uint32_t i = first; i < first + count; ++i)
+		areaMap[i / 32] &= ~(1u << (i & 31));
+
+	if(first < searchStart)
+		searchStart = first;
+}
+
+static bool kpage_area_test(uint32_t page)
+{
+	return (areaMap[page / 32] & (1u << (page & 31))) != 0;
+}
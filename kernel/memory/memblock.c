@@ -0,0 +1,195 @@
+/*
+Lithium OS early boot memory allocator.
+
+Keeps a list of usable and reserved physical ranges taken from the BIOS memory
+map so that memory can be handed out (for the physical memory manager's own
+metadata and the page tables used to map it) before the physical memory
+manager exists. memblock_release_to_pmmngr() then passes everything over.
+
+Ranges are tracked as frame numbers so that memory above 4GiB can be passed on
+when PAE is in use, but allocations always come from below high memory.
+*/
+
+#include <memblock.h>
+
+#define MEMBLOCK_PAGE_SIZE 4096
+
+// Allocations are made above the kernel (and the rest of the 4MiB page table
+// stage 2 maps it with) when possible, keeping low memory free for DMA
+#define MEMBLOCK_ALLOC_FLOOR 0x01400000
+
+static memblock_region_t memoryRegions[MEMBLOCK_MAX_REGIONS];
+static uint32_t memoryRegionCount = 0;
+static memblock_region_t reservedRegions[MEMBLOCK_MAX_REGIONS];
+static uint32_t reservedRegionCount = 0;
+
+static uint32_t memblock_find(uint32_t floor, uint32_t frames, uint32_t align);
+
+/*
+Takes the usable entries from the BIOS memory map. Memory at or above
+frameLimit is ignored.
+*/
+void memblock_init(mmap_entry_t *entries, uint32_t entryCount, uint32_t frameLimit)
+{
+	memoryRegionCount = 0;
+	reservedRegionCount = 0;
+
+	for(uint32_t i = 0; i < entryCount && memoryRegionCount < MEMBLOCK_MAX_REGIONS; i++)
+	{
+		// Only free or ACPI reclaimable memory can be used
+		if(entries[i].type != 1 && entries[i].type != 3)
+			continue;
+
+		uint64_t base = ((uint64_t)entries[i].baseH << 32) | entries[i].baseL;
+		uint64_t end = base + (((uint64_t)entries[i].lengthH << 32) | entries[i].lengthL);
+
+		// Only whole pages are usable
+		uint64_t first = (base + MEMBLOCK_PAGE_SIZE - 1) / MEMBLOCK_PAGE_SIZE;
+		uint64_t last = end / MEMBLOCK_PAGE_SIZE;
+
+		if(last > frameLimit)
+			last = frameLimit;
+
+		if(last <= first)
+			continue;
+
+		memoryRegions[memoryRegionCount].base = (uint32_t)first;
+		memoryRegions[memoryRegionCount].end = (uint32_t)last;
+		memoryRegionCount++;
+	}
+}
+
+/*
+Marks a range as in use. Ranges that touch an existing reservation are merged
+into it, so a run of allocations only takes up one slot.
+*/
+bool memblock_reserve(physical_addr base, uint32_t size)
+{
+	uint32_t first = base / MEMBLOCK_PAGE_SIZE;
+	uint32_t end = (uint32_t)(((uint64_t)base + size + MEMBLOCK_PAGE_SIZE - 1) / MEMBLOCK_PAGE_SIZE);
+
+	for(uint32_t i = 0; i < reservedRegionCount; i++)
+	{
+		if(reservedRegions[i].end == first)
+		{
+			reservedRegions[i].end = end;
+
+			return TRUE;
+		}
+
+		if(reservedRegions[i].base == end)
+		{
+			reservedRegions[i].base = first;
+
+			return TRUE;
+		}
+	}
+
+	if(reservedRegionCount == MEMBLOCK_MAX_REGIONS)
+		return FALSE;
+
+	reservedRegions[reservedRegionCount].base = first;
+	reservedRegions[reservedRegionCount].end = end;
+	reservedRegionCount++;
+
+	return TRUE;
+}
+
+/*
+Allocates and reserves a physically contiguous range below high memory, so it
+is in the kernel's direct map. Returns 0 on failure.
+*/
+physical_addr memblock_alloc(uint32_t size, uint32_t align)
+{
+	uint32_t frames = (size + MEMBLOCK_PAGE_SIZE - 1) / MEMBLOCK_PAGE_SIZE;
+
+	align /= MEMBLOCK_PAGE_SIZE;
+
+	if(align == 0)
+		align = 1;
+
+	uint32_t frame = memblock_find(MEMBLOCK_ALLOC_FLOOR / MEMBLOCK_PAGE_SIZE, frames, align);
+
+	if(frame == 0)
+		frame = memblock_find(1, frames, align);
+
+	if(frame == 0 || !memblock_reserve(frame * MEMBLOCK_PAGE_SIZE, frames * MEMBLOCK_PAGE_SIZE))
+		return 0;
+
+	return frame * MEMBLOCK_PAGE_SIZE;
+}
+
+/*
+Returns the frame number just past the highest usable frame, which is what the
+physical memory manager's metadata needs to cover.
+*/
+uint32_t memblock_end_of_usable(void)
+{
+	uint32_t end = 0;
+
+	for(uint32_t i = 0; i < memoryRegionCount; i++)
+	{
+		if(memoryRegions[i].end > end)
+			end = memoryRegions[i].end;
+	}
+
+	return end;
+}
+
+/*
+Frees every usable range in the physical memory manager, then takes back every
+range that has been reserved or allocated.
+*/
+void memblock_release_to_pmmngr(void)
+{
+	for(uint32_t i = 0; i < memoryRegionCount; i++)
+		pmmngr_init_frames(memoryRegions[i].base, memoryRegions[i].end - memoryRegions[i].base);
+
+	for(uint32_t i = 0; i < reservedRegionCount; i++)
+		pmmngr_deinit_frames(reservedRegions[i].base, reservedRegions[i].end - reservedRegions[i].base);
+}
+
+static uint32_t memblock_find(uint32_t floor, uint32_t frames, uint32_t align)
+{
+	for(uint32_t i = 0; i < memoryRegionCount; i++)
+	{
+		uint32_t end = memoryRegions[i].end;
+
+		// Allocations must be reachable through the kernel's direct map
+		if(end > PMMNGR_ZONE_HIGH_FRAME)
+			end = PMMNGR_ZONE_HIGH_FRAME;
+
+		uint32_t candidate = memoryRegions[i].base;
+
+		if(candidate < floor)
+			candidate = floor;
+
+		candidate = (candidate + align - 1) / align * align;
+
+		bool moved = TRUE;
+
+		// Step past any reservation that overlaps until the candidate is clear
+		while(moved)
+		{
+			moved = FALSE;
+
+			if(candidate < memoryRegions[i].base || candidate + frames > end || candidate + frames < candidate)
+				break;
+
+			for(uint32_t j = 0; j < reservedRegionCount; j++)
+			{
+				if(candidate < reservedRegions[j].end && reservedRegions[j].base < candidate + frames)
+				{
+					candidate = (reservedRegions[j].end + align - 1) / align * align;
+					moved = TRUE;
+				}
+			}
+		}
+
+		if(!moved && candidate >= memoryRegions[i].base && candidate + frames <= end &&
+			candidate + frames > candidate)
+			return candidate;
+	}
+
+	return 0;
+}
@@ -0,0 +1,108 @@
+/*
+Lithium OS page frame database.
+
+Holds a descriptor for every physical frame with a reference count, flags and
+an owner. Frames mapped in more than one place are freed when the last
+reference to them is dropped with pfdb_put(). Frames are looked up by frame
+number so that frames above 4GiB can be tracked.
+*/
+
+#include <pfdb.h>
+
+static page_frame_t *frames = NULL;
+static uint32_t pfdbFrameCount = 0;
+
+uint32_t pfdb_size(uint32_t frameCount)
+{
+	return frameCount * (uint32_t)sizeof(page_frame_t);
+}
+
+/*
+Must be called after the physical memory manager has been initialised. Frames
+that are in use at this point are marked as pinned kernel memory.
+*/
+void pfdb_init(void *base, uint32_t frameCount)
+{
+	frames = (page_frame_t *)base;
+	pfdbFrameCount = frameCount;
+
+	memsetd((uint32_t *)frames, 0, pfdb_size(frameCount) / 4);
+
+	for(uint32_t i = 0; i < frameCount; ++i)
+	{
+		if(mmap_test(i))
+		{
+			frames[i].refCount = 1;
+			frames[i].flags = PFDB_KERNEL | PFDB_PINNED;
+		}
+	}
+}
+
+page_frame_t *pfdb_get(uint32_t frame)
+{
+	if(frames == NULL || frame >= pfdbFrameCount)
+		return NULL;
+
+	return &frames[frame];
+}
+
+/*
+Sets up the descriptor of a newly allocated frame with a single reference.
+*/
+void pfdb_frame_set(uint32_t frame, uint16_t flags, uint32_t owner)
+{
+	page_frame_t *pf = pfdb_get(frame);
+
+	if(pf == NULL)
+		return;
+
+	pf->refCount = 1;
+	pf->flags = flags;
+	pf->owner = owner;
+	pf->tableEntries = 0;
+}
+
+/*
+Adds a reference to a frame. Pinned frames are never freed, so mapping them
+(like the shared zero page) isn't counted.
+*/
+uint32_t pfdb_ref(uint32_t frame)
+{
+	page_frame_t *pf = pfdb_get(frame);
+
+	if(pf == NULL)
+		return 0;
+
+	if(pf->flags & PFDB_PINNED)
+		return pf->refCount;
+
+	return ++pf->refCount;
+}
+
+/*
+Drops a reference to a frame and gives it back to the physical memory manager
+when there are none left. Returns TRUE if the frame was freed.
+*/
+bool pfdb_put(uint32_t frame)
+{
+	page_frame_t *pf = pfdb_get(frame);
+
+	if(pf == NULL || (pf->flags & PFDB_PINNED))
+		return FALSE;
+
+	if(pf->refCount > 1)
+	{
+		pf->refCount--;
+
+		return FALSE;
+	}
+
+	pf->refCount = 0;
+	pf->flags = 0;
+	pf->owner = 0;
+	pf->tableEntries = 0;
+
+	pmmngr_free_frame(frame);
+
+	return TRUE;
+}
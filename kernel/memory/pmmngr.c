@@ -1,25 +1,94 @@
 /*
 Lithium OS physical memory manager.
+
+Blocks are tracked by a bitmap during early boot. Once pmmngr_buddy_init() has
+been called, allocation and freeing go through a binary buddy allocator with a
+free list per order and the bitmap is only kept up to date as a view of which
+blocks are in use (mmap_test() etc.).
+
+Until pmmngr_init() has been called, blocks are taken from the early boot
+allocator (memblock).
+
+Single block allocations are served from a small LIFO cache of recently freed
+blocks, which is refilled from and drained to the buddy allocator in batches.
+Blocks in the cache are counted as free.
+
+Frames above the kernel's direct map (including any above 4GiB with PAE) are in
+their own high zone. They are only handed out by frame number through
+pmmngr_alloc_frame()/pmmngr_alloc_user_frame().
+
+The idle loop keeps a small pool of blocks that have already been zeroed
+(pmmngr_zero_pool_fill()) so that paging structures and new user pages don't
+have to be cleared while a process waits. Pooled blocks are allocated as far as
+the rest of the manager is concerned, but are given out as ordinary blocks once
+everything else has run out.
 */
 
 #include <pmmngr.h>
+#include <memblock.h>
+#include <vmmngr.h>
 
 #define PMMNGR_BLOCK_SIZE 4096
+#define BUDDY_NONE 0xFFFFFFFF
+#define BUDDY_FREE 0x80
+#define FRAME_CACHE_SIZE 64
+#define FRAME_CACHE_BATCH 16
+#define ZERO_POOL_SIZE 32
+#define ZERO_POOL_MIN_FREE 256	// Don't fill the pool when the normal zone is this low
+
+typedef struct
+{
+	uint32_t next;
+	uint32_t prev;
+} buddy_link_t;
 
-static uint32_t mmngrMemorySize = 0;
 static uint32_t mmngrUsedBlocks = 0;
 static uint32_t mmngrMaxBlocks = 0;
 static uint32_t* mmngrMemoryMap = 0;
 
-void pmmngr_init(uint32_t memSize, physical_addr bitmapBase)
+static bool buddyActive = FALSE;
+static buddy_link_t *buddyLinks = NULL;	// Free list links, one per block
+static uint8_t *buddyOrders = NULL;		// BUDDY_FREE | order for the first block of each free run
+static uint32_t buddyFreeLists[PMMNGR_ZONE_COUNT][PMMNGR_MAX_ORDER + 1];
+static uint32_t buddyFreeCounts[PMMNGR_ZONE_COUNT][PMMNGR_MAX_ORDER + 1];
+static uint32_t zoneFreeBlocks[PMMNGR_ZONE_COUNT];	// Blocks on the buddy free lists of each zone
+
+static uint32_t frameCache[FRAME_CACHE_SIZE];	// Most recently freed block is at the top
+static uint32_t frameCacheCount = 0;
+static uint32_t frameCacheHits = 0;
+static uint32_t frameCacheMisses = 0;
+
+static uint32_t zeroPool[ZERO_POOL_SIZE];
+static uint32_t zeroPoolCount = 0;
+static uint32_t zeroPoolHits = 0;
+static uint32_t zeroPoolMisses = 0;
+
+static void buddy_list_push(uint32_t block, uint32_t order);
+static void buddy_list_remove(uint32_t block, uint32_t order);
+static uint32_t buddy_alloc(uint32_t order, uint32_t zone);
+static void buddy_free(uint32_t block, uint32_t order);
+static void buddy_free_range(uint32_t block, uint32_t count);
+static void buddy_reserve(uint32_t block);
+static uint32_t buddy_order_for(uint32_t count);
+static void frame_cache_refill(void);
+static uint32_t block_zone(uint32_t block);
+static uint32_t zone_first_block(uint32_t zone);
+static uint32_t zone_end_block(uint32_t zone);
+static uint32_t bitmap_first_free_run(uint32_t first, uint32_t end, uint32_t amount);
+
+void pmmngr_init(uint32_t blockCount, void *bitmap)
 {
-	mmngrMemorySize = memSize;
-	mmngrMemoryMap = (uint32_t*)bitmapBase;
-	mmngrMaxBlocks = memSize / PMMNGR_BLOCK_SIZE;
+	mmngrMemoryMap = (uint32_t*)bitmap;
+	mmngrMaxBlocks = blockCount;
 	mmngrUsedBlocks = mmngrMaxBlocks;
 
 	//For safety we assume all memory is used.
-	memsetd((uint32_t*)mmngrMemoryMap, 0xFFFFFFFF, mmngrMaxBlocks / 32);
+	memsetd((uint32_t*)mmngrMemoryMap, 0xFFFFFFFF, (mmngrMaxBlocks + 31) / 32);
+}
+
+uint32_t pmmngr_bitmap_size(uint32_t blockCount)
+{
+	return (blockCount + 31) / 32 * 4;
 }
 
 void pmmngr_set_bitmap_address(void* addr)
@@ -93,16 +162,7 @@ void pmmngr_init_region(physical_addr base, uint32_t size)
 		size &= ~0xFFF;
 	}
 	
-	uint32_t blocks = size / PMMNGR_BLOCK_SIZE;
-
-	for (; blocks > 0; blocks--)
-	{
-		mmap_unset (start++);
-		mmngrUsedBlocks--;
-	}
-
-	mmap_set(0);	//first block is always set. This insures allocs cant be 0, 
-	//which is returned if the system is out of memory
+	pmmngr_init_frames(start, size / PMMNGR_BLOCK_SIZE);
 }
 
 void pmmngr_deinit_region(physical_addr base, uint32_t size)
@@ -114,43 +174,255 @@ void pmmngr_deinit_region(physical_addr base, uint32_t size)
 	{
 		//not 4k aligned, align it
 		size += 4096;
-		size &= ~0xFFF;
+		size &= ~(uint32_t)0xFFF;
 	}
-	
-	uint32_t blocks = size / PMMNGR_BLOCK_SIZE;
+
+	pmmngr_deinit_frames(start, size / PMMNGR_BLOCK_SIZE);
+}
+
+void pmmngr_init_frames(uint32_t start, uint32_t blocks)
+{
+	if(start >= mmngrMaxBlocks)
+		return;
+
+	if(blocks > mmngrMaxBlocks - start)
+		blocks = mmngrMaxBlocks - start;
+
+	for (; blocks > 0; blocks--, start++)
+	{
+		// Block 0 is never freed. This insures allocs cant be 0,
+		// which is returned if the system is out of memory
+		if(start == 0 || !mmap_test(start))
+			continue;
+
+		mmap_unset(start);
+		mmngrUsedBlocks--;
+
+		if(buddyActive)
+			buddy_free(start, 0);
+	}
+}
+
+void pmmngr_deinit_frames(uint32_t start, uint32_t blocks)
+{
+	if(start >= mmngrMaxBlocks)
+		return;
+
+	if(blocks > mmngrMaxBlocks - start)
+		blocks = mmngrMaxBlocks - start;
+
+	// Cached blocks look free in the bitmap but aren't on the buddy free lists
+	pmmngr_frame_cache_drain(frameCacheCount);
  
-	for (;blocks > 0; blocks--)
+	for (;blocks > 0; blocks--, start++)
 	{
-		mmap_set(start++);
+		if(mmap_test(start))
+			continue;
+
+		if(buddyActive)
+			buddy_reserve(start);
+
+		mmap_set(start);
 		mmngrUsedBlocks++;
 	}
 }
 
 void *pmmngr_alloc_block(void)
 {
-	if (pmmngr_get_free_block_count() <= 0)
-		return (void*)0;	//out of memory
- 
-	uint32_t block = mmap_first_free();
- 
-	if (block == 0)
-		return (void*)0;	//out of memory
+	// Prefer memory above the DMA zone so it stays free for devices that need it
+	void *p = pmmngr_alloc_block_zone(PMMNGR_ZONE_NORMAL);
+
+	if(!p)
+		p = pmmngr_alloc_block_zone(PMMNGR_ZONE_DMA);
+
+	if(!p && zeroPoolCount > 0)
+		p = (void*)(zeroPool[--zeroPoolCount] * PMMNGR_BLOCK_SIZE);
+
+	return p;
+}
+
+void *pmmngr_alloc_block_zone(uint32_t zone)
+{
+	// High zone frames have no physical_addr
+	if(zone == PMMNGR_ZONE_HIGH)
+		return (void*)0;
+
+	return (void*)(pmmngr_alloc_frame(zone) * PMMNGR_BLOCK_SIZE);
+}
+
+/*
+Allocates a single frame from a zone and returns its frame number, or 0 if the
+zone is out of memory.
+*/
+uint32_t pmmngr_alloc_frame(uint32_t zone)
+{
+	if(mmngrMemoryMap == 0)
+		return memblock_alloc(PMMNGR_BLOCK_SIZE, PMMNGR_BLOCK_SIZE) / PMMNGR_BLOCK_SIZE;
+
+	if (zone >= PMMNGR_ZONE_COUNT || pmmngr_get_free_block_count() <= 0)
+		return 0;	//out of memory
+
+	uint32_t block = 0;
+
+	if(buddyActive)
+	{
+		if(zone == PMMNGR_ZONE_NORMAL)
+		{
+			if(frameCacheCount > 0)
+			{
+				frameCacheHits++;
+			}
+			else
+			{
+				frameCacheMisses++;
+				frame_cache_refill();
+
+				if(frameCacheCount == 0)
+					return 0;	//out of memory
+			}
+
+			block = frameCache[--frameCacheCount];
+		}
+		else
+		{
+			block = buddy_alloc(0, zone);
+
+			if(block == BUDDY_NONE)
+				return 0;	//out of memory
+		}
+	}
+	else
+	{
+		block = bitmap_first_free_run(zone_first_block(zone), zone_end_block(zone), 1);
+
+		if (block == 0)
+			return 0;	//out of memory
+	}
  
 	mmap_set(block);
- 
-	void* addr = (void*)(block * PMMNGR_BLOCK_SIZE);
 	mmngrUsedBlocks++;
  
-	return addr;
+	return block;
+}
+
+/*
+Allocates a frame for a user page. These never need to be reached by physical
+address from the kernel, so high memory is used first to leave the direct
+mapped memory for the kernel.
+*/
+uint32_t pmmngr_alloc_user_frame(void)
+{
+	uint32_t frame = pmmngr_alloc_frame(PMMNGR_ZONE_HIGH);
+
+	if(!frame)
+		frame = pmmngr_alloc_frame(PMMNGR_ZONE_NORMAL);
+
+	if(!frame)
+		frame = pmmngr_alloc_frame(PMMNGR_ZONE_DMA);
+
+	if(!frame && zeroPoolCount > 0)
+		frame = zeroPool[--zeroPoolCount];
+
+	return frame;
+}
+
+/*
+Returns a block from the pre-zeroed pool, or 0 if the pool is empty. Callers
+that can clear a block more cheaply themselves (page tables, through the
+recursive mapping) use this instead of pmmngr_alloc_zeroed_block().
+*/
+void *pmmngr_zero_pool_alloc(void)
+{
+	if(zeroPoolCount == 0)
+	{
+		zeroPoolMisses++;
+
+		return (void*)0;
+	}
+
+	zeroPoolHits++;
+
+	return (void*)(zeroPool[--zeroPoolCount] * PMMNGR_BLOCK_SIZE);
+}
+
+/*
+Allocates a block that is filled with zeroes, clearing one synchronously if
+the pool is empty.
+*/
+void *pmmngr_alloc_zeroed_block(void)
+{
+	void *p = pmmngr_zero_pool_alloc();
+
+	if(p)
+		return p;
+
+	p = pmmngr_alloc_block();
+
+	if(p)
+		vmmngr_zero_frame((uint32_t)p / PMMNGR_BLOCK_SIZE);
+
+	return p;
+}
+
+/*
+Zeroes one more block for the pool. Called from the idle loop with interrupts
+enabled; returns FALSE when there is nothing left to do so the caller can halt.
+*/
+bool pmmngr_zero_pool_fill(void)
+{
+	if(!buddyActive || zeroPoolCount == ZERO_POOL_SIZE ||
+		pmmngr_get_zone_free_block_count(PMMNGR_ZONE_NORMAL) < ZERO_POOL_MIN_FREE)
+		return FALSE;
+
+	// The zeroing window is shared, so a page is done in one go without being preempted
+	disable_interrupts();
+
+	uint32_t frame = pmmngr_alloc_frame(PMMNGR_ZONE_NORMAL);
+
+	if(frame)
+	{
+		vmmngr_zero_frame(frame);
+		zeroPool[zeroPoolCount++] = frame;
+	}
+
+	enable_interrupts();
+
+	return frame ? TRUE : FALSE;
+}
+
+void pmmngr_get_zero_pool_stats(uint32_t *hits, uint32_t *misses, uint32_t *pooled)
+{
+	*hits = zeroPoolHits;
+	*misses = zeroPoolMisses;
+	*pooled = zeroPoolCount;
 }
 
 void pmmngr_free_block(physical_addr p)
 {
-	uint32_t block = (uint32_t)p / PMMNGR_BLOCK_SIZE;
- 
+	pmmngr_free_frame((uint32_t)p / PMMNGR_BLOCK_SIZE);
+}
+
+void pmmngr_free_frame(uint32_t block)
+{
 	mmap_unset(block);
  
 	mmngrUsedBlocks--;
+
+	if(buddyActive)
+	{
+		// Only normal zone blocks are cached, DMA and high blocks go straight back
+		if(block_zone(block) != PMMNGR_ZONE_NORMAL)
+		{
+			buddy_free(block, 0);
+
+			return;
+		}
+
+		if(frameCacheCount == FRAME_CACHE_SIZE)
+			pmmngr_frame_cache_drain(FRAME_CACHE_BATCH);
+
+		frameCache[frameCacheCount++] = block;
+	}
 }
 
 void pmmngr_set_cr3(physical_addr pdb)
@@ -176,13 +448,70 @@ void pmmngr_paging_enable(bool enable)
 
 void* pmmngr_alloc_blocks(uint32_t amount)
 {
-	if((pmmngr_get_free_block_count() <= 0) || (amount > pmmngr_get_free_block_count()))
-		return (void*)0; //out of memory
-	
-	uint32_t block = mmap_first_free_s(amount);
-	
-	if(block == 0)
+	void *p = pmmngr_alloc_blocks_zone(amount, PMMNGR_ZONE_NORMAL);
+
+	if(!p)
+		p = pmmngr_alloc_blocks_zone(amount, PMMNGR_ZONE_DMA);
+
+	return p;
+}
+
+void* pmmngr_alloc_blocks_zone(uint32_t amount, uint32_t zone)
+{
+	if(mmngrMemoryMap == 0)
+		return (void*)memblock_alloc(amount * PMMNGR_BLOCK_SIZE, PMMNGR_BLOCK_SIZE);
+
+	if((zone >= PMMNGR_ZONE_HIGH) || (amount == 0) || (pmmngr_get_free_block_count() <= 0) ||
+		(amount > pmmngr_get_free_block_count()))
 		return (void*)0; //out of memory
+
+	uint32_t block = 0;
+
+	if(buddyActive)
+	{
+		uint32_t order = buddy_order_for(amount);
+
+		if(order > PMMNGR_MAX_ORDER)
+		{
+			// Larger than the biggest buddy block, so the run is found in the
+			// bitmap and its blocks are taken off the free lists one by one.
+			// Cached blocks look free in the bitmap but aren't on the lists.
+			pmmngr_frame_cache_drain(frameCacheCount);
+
+			block = bitmap_first_free_run(zone_first_block(zone), zone_end_block(zone), amount);
+
+			if(block == 0)
+				return (void*)0; //out of memory
+
+			for(uint32_t i = 0; i < amount; i++)
+				buddy_reserve(block + i);
+		}
+		else
+		{
+			block = buddy_alloc(order, zone);
+
+			if(block == BUDDY_NONE && zone == PMMNGR_ZONE_NORMAL && frameCacheCount > 0)
+			{
+				// The cache may be holding the blocks needed to make a big enough buddy
+				pmmngr_frame_cache_drain(frameCacheCount);
+
+				block = buddy_alloc(order, zone);
+			}
+
+			if(block == BUDDY_NONE)
+				return (void*)0; //out of memory
+
+			// Give back the part of the power-of-two block that wasn't asked for
+			buddy_free_range(block + amount, (1u << order) - amount);
+		}
+	}
+	else
+	{
+		block = bitmap_first_free_run(zone_first_block(zone), zone_end_block(zone), amount);
+
+		if(block == 0)
+			return (void*)0; //out of memory
+	}
 	
 	for (uint32_t i=0; i<amount; i++)
 		mmap_set(block+i);
@@ -203,6 +532,9 @@ void pmmngr_free_blocks(void* p, uint32_t amount)
 		mmap_unset (block+i);
 
 	mmngrUsedBlocks -= amount;
+
+	if(buddyActive)
+		buddy_free_range(block, amount);
 }
 
 uint32_t mmap_first_free_s(uint32_t amount)
@@ -251,3 +583,330 @@ uint32_t mmap_first_free_s(uint32_t amount)
 	
 	return 0;
 }
+
+
+uint32_t pmmngr_buddy_metadata_size(uint32_t blockCount)
+{
+	uint32_t size = blockCount * (uint32_t)sizeof(buddy_link_t) + blockCount;
+
+	// Keep the size a multiple of 4 bytes
+	return (size + 3) & ~3u;
+}
+
+void pmmngr_buddy_init(void *metadata)
+{
+	buddyLinks = (buddy_link_t *)metadata;
+	buddyOrders = (uint8_t *)((uint32_t)metadata + mmngrMaxBlocks * sizeof(buddy_link_t));
+
+	memset(buddyOrders, 0, mmngrMaxBlocks);
+
+	for(uint32_t z = 0; z < PMMNGR_ZONE_COUNT; ++z)
+	{
+		for(uint32_t i = 0; i <= PMMNGR_MAX_ORDER; ++i)
+		{
+			buddyFreeLists[z][i] = BUDDY_NONE;
+			buddyFreeCounts[z][i] = 0;
+		}
+
+		zoneFreeBlocks[z] = 0;
+	}
+
+	// Build the free lists from the bitmap. Freeing one block at a time lets the
+	// coalescing in buddy_free() find the largest blocks for us.
+	for(uint32_t i = 0; i < mmngrMaxBlocks / 32; ++i)
+	{
+		if(mmngrMemoryMap[i] == 0xFFFFFFFF)
+			continue;
+
+		for(uint32_t j = 0; j < 32; ++j)
+		{
+			if(!mmap_test(i * 32 + j))
+				buddy_free(i * 32 + j, 0);
+		}
+	}
+
+	for(uint32_t i = mmngrMaxBlocks & ~31u; i < mmngrMaxBlocks; ++i)
+	{
+		if(!mmap_test(i))
+			buddy_free(i, 0);
+	}
+
+	buddyActive = TRUE;
+}
+
+uint32_t pmmngr_buddy_free_count(uint32_t zone, uint32_t order)
+{
+	if(zone >= PMMNGR_ZONE_COUNT || order > PMMNGR_MAX_ORDER)
+		return 0;
+
+	return buddyFreeCounts[zone][order];
+}
+
+uint32_t pmmngr_get_zone_free_block_count(uint32_t zone)
+{
+	if(zone >= PMMNGR_ZONE_COUNT)
+		return 0;
+
+	// Cached blocks all come from the normal zone
+	if(zone == PMMNGR_ZONE_NORMAL)
+		return zoneFreeBlocks[zone] + frameCacheCount;
+
+	return zoneFreeBlocks[zone];
+}
+
+/*
+Gives the coldest (least recently freed) cached blocks back to the buddy allocator.
+*/
+void pmmngr_frame_cache_drain(uint32_t count)
+{
+	if(count > frameCacheCount)
+		count = frameCacheCount;
+
+	for(uint32_t i = 0; i < count; ++i)
+		buddy_free(frameCache[i], 0);
+
+	for(uint32_t i = count; i < frameCacheCount; ++i)
+		frameCache[i - count] = frameCache[i];
+
+	frameCacheCount -= count;
+}
+
+void pmmngr_get_frame_cache_stats(uint32_t *hits, uint32_t *misses, uint32_t *cached)
+{
+	*hits = frameCacheHits;
+	*misses = frameCacheMisses;
+	*cached = frameCacheCount;
+}
+
+static void frame_cache_refill(void)
+{
+	while(frameCacheCount < FRAME_CACHE_BATCH)
+	{
+		uint32_t b = buddy_alloc(0, PMMNGR_ZONE_NORMAL);
+
+		if(b == BUDDY_NONE)
+			break;
+
+		frameCache[frameCacheCount++] = b;
+	}
+}
+
+static void buddy_list_push(uint32_t block, uint32_t order)
+{
+	uint32_t zone = block_zone(block);
+	uint32_t head = buddyFreeLists[zone][order];
+
+	buddyLinks[block].prev = BUDDY_NONE;
+	buddyLinks[block].next = head;
+
+	if(head != BUDDY_NONE)
+		buddyLinks[head].prev = block;
+
+	buddyFreeLists[zone][order] = block;
+	buddyOrders[block] = (uint8_t)(BUDDY_FREE | order);
+	buddyFreeCounts[zone][order]++;
+	zoneFreeBlocks[zone] += 1u << order;
+}
+
+static void buddy_list_remove(uint32_t block, uint32_t order)
+{
+	uint32_t zone = block_zone(block);
+	uint32_t next = buddyLinks[block].next;
+	uint32_t prev = buddyLinks[block].prev;
+
+	if(prev != BUDDY_NONE)
+		buddyLinks[prev].next = next;
+	else
+		buddyFreeLists[zone][order] = next;
+
+	if(next != BUDDY_NONE)
+		buddyLinks[next].prev = prev;
+
+	buddyOrders[block] = 0;
+	buddyFreeCounts[zone][order]--;
+	zoneFreeBlocks[zone] -= 1u << order;
+}
+
+/*
+Takes a block of 2^order blocks off the free lists of a zone, splitting a larger
+block if needed. Returns BUDDY_NONE if there is nothing big enough.
+*/
+static uint32_t buddy_alloc(uint32_t order, uint32_t zone)
+{
+	uint32_t o = order;
+
+	while(o <= PMMNGR_MAX_ORDER && buddyFreeLists[zone][o] == BUDDY_NONE)
+		++o;
+
+	if(o > PMMNGR_MAX_ORDER)
+		return BUDDY_NONE;
+
+	uint32_t block = buddyFreeLists[zone][o];
+
+	buddy_list_remove(block, o);
+
+	// Split, putting the upper halves back on the smaller lists
+	while(o > order)
+	{
+		--o;
+		buddy_list_push(block + (1u << o), o);
+	}
+
+	return block;
+}
+
+/*
+Puts a block of 2^order blocks back on the free lists, merging it with its
+buddy for as long as the buddy is also free. Zone boundaries are aligned to the
+largest block size so a merge never crosses into another zone.
+*/
+static void buddy_free(uint32_t block, uint32_t order)
+{
+	while(order < PMMNGR_MAX_ORDER)
+	{
+		uint32_t buddy = block ^ (1u << order);
+
+		if(buddy + (1u << order) > mmngrMaxBlocks)
+			break;
+
+		if(buddyOrders[buddy] != (BUDDY_FREE | order))
+			break;
+
+		buddy_list_remove(buddy, order);
+
+		block &= ~(1u << order);
+		++order;
+	}
+
+	buddy_list_push(block, order);
+}
+
+/*
+Frees an arbitrary run of blocks by splitting it into the largest naturally
+aligned power-of-two pieces.
+*/
+static void buddy_free_range(uint32_t block, uint32_t count)
+{
+	while(count > 0)
+	{
+		uint32_t order = 0;
+
+		while(order < PMMNGR_MAX_ORDER && !(block & (1u << order)) && (2u << order) <= count)
+			++order;
+
+		buddy_free(block, order);
+
+		block += 1u << order;
+		count -= 1u << order;
+	}
+}
+
+/*
+Takes a single free block off the free lists, splitting the free run that
+contains it.
+*/
+static void buddy_reserve(uint32_t block)
+{
+	for(uint32_t order = 0; order <= PMMNGR_MAX_ORDER; ++order)
+	{
+		uint32_t head = block & ~((1u << order) - 1);
+
+		if(buddyOrders[head] != (BUDDY_FREE | order))
+			continue;
+
+		buddy_list_remove(head, order);
+
+		// Give back every half that doesn't contain the block
+		while(order > 0)
+		{
+			--order;
+
+			if(block < head + (1u << order))
+			{
+				buddy_list_push(head + (1u << order), order);
+			}
+			else
+			{
+				buddy_list_push(head, order);
+				head += 1u << order;
+			}
+		}
+
+		return;
+	}
+}
+
+static uint32_t buddy_order_for(uint32_t count)
+{
+	uint32_t order = 0;
+
+	while((1u << order) < count && order <= PMMNGR_MAX_ORDER)
+		++order;
+
+	return order;
+}
+
+static uint32_t block_zone(uint32_t block)
+{
+	if(block < PMMNGR_ZONE_DMA_LIMIT / PMMNGR_BLOCK_SIZE)
+		return PMMNGR_ZONE_DMA;
+
+	if(block < PMMNGR_ZONE_HIGH_FRAME)
+		return PMMNGR_ZONE_NORMAL;
+
+	return PMMNGR_ZONE_HIGH;
+}
+
+static uint32_t zone_first_block(uint32_t zone)
+{
+	if(zone == PMMNGR_ZONE_DMA)
+		return 0;
+
+	if(zone == PMMNGR_ZONE_NORMAL)
+		return PMMNGR_ZONE_DMA_LIMIT / PMMNGR_BLOCK_SIZE;
+
+	return PMMNGR_ZONE_HIGH_FRAME;
+}
+
+static uint32_t zone_end_block(uint32_t zone)
+{
+	uint32_t end = mmngrMaxBlocks;
+
+	if(zone == PMMNGR_ZONE_DMA && end > PMMNGR_ZONE_DMA_LIMIT / PMMNGR_BLOCK_SIZE)
+		end = PMMNGR_ZONE_DMA_LIMIT / PMMNGR_BLOCK_SIZE;
+	else if(zone == PMMNGR_ZONE_NORMAL && end > PMMNGR_ZONE_HIGH_FRAME)
+		end = PMMNGR_ZONE_HIGH_FRAME;
+
+	return end;
+}
+
+/*
+Finds the first run of free blocks in [first, end) using the bitmap. Returns 0
+if there is no such run (block 0 is never free).
+*/
+static uint32_t bitmap_first_free_run(uint32_t first, uint32_t end, uint32_t amount)
+{
+	uint32_t run = 0;
+
+	for(uint32_t i = first; i < end; ++i)
+	{
+		if((i & 31) == 0 && mmngrMemoryMap[i / 32] == 0xFFFFFFFF && i + 32 <= end)
+		{
+			// Skip full words
+			run = 0;
+			i += 31;
+			continue;
+		}
+
+		if(mmap_test(i))
+		{
+			run = 0;
+			continue;
+		}
+
+		if(++run == amount)
+			return i + 1 - amount;
+	}
+
+	return 0;
+}
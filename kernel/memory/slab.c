@@ -0,0 +1,248 @@
+/*
+Lithium OS slab allocator.
+
+Fixed size kernel objects (processes, threads, memory regions) are allocated
+from named caches instead of kmalloc(), which would walk its list of blocks and
+add a header to each one. A cache carves page sized slabs into objects of its
+size. Each slab starts with a kmem_slab_t and keeps its free objects on a list
+threaded through the objects themselves, so allocating and freeing an object is
+a few pointer updates.
+
+A cache's slabs are on one of three lists: partial (some objects free), full
+and empty. Objects come from the first partial slab, then from an empty one,
+and only then is a new slab allocated. A slab whose last object is freed is
+kept on the empty list, but at most KMEM_CACHE_MAX_EMPTY of them are kept per
+cache and the rest go back to the physical memory manager.
+
+Slabs are frames from the normal or DMA zones reached through the direct map,
+so they need no mappings of their own, and the slab holding an object is found
+by rounding its address down to the page.
+*/
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <pfdb.h>
+#include <swap.h>
+#include <vmmngr.h>
+
+typedef struct kmem_slab_struct
+{
+	struct kmem_slab_struct *prev;
+	struct kmem_slab_struct *next;
+	kmem_cache_t *cache;
+	void *freeList;		// First free object, each holding the address of the next
+	uint32_t inUse;
+} kmem_slab_t;
+
+// Objects start after the slab header, aligned to the pointer size
+#define KMEM_SLAB_HEADER_SIZE	((sizeof(kmem_slab_t) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+static kmem_cache_t *caches = NULL;
+
+static kmem_slab_t *kmem_slab_create(kmem_cache_t *cache);
+static void kmem_slab_destroy(kmem_slab_t *slab);
+static void kmem_slab_unlink(kmem_slab_t **list, kmem_slab_t *slab);
+static void kmem_slab_push(kmem_slab_t **list, kmem_slab_t *slab);
+
+/*
+Creates a cache of objects of objectSize bytes. name must stay valid for as
+long as the cache does. Returns NULL if objects that size don't fit in a slab
+or if out of memory. Must be called after kmalloc_init().
+*/
+kmem_cache_t *kmem_cache_create(const char *name, size_t objectSize)
+{
+	objectSize = (objectSize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if(objectSize == 0 || objectSize > PAGE_SIZE - KMEM_SLAB_HEADER_SIZE)
+		return NULL;
+
+	kmem_cache_t *cache = (kmem_cache_t *)kmalloc(sizeof(kmem_cache_t));
+
+	if(cache == NULL)
+		return NULL;
+
+	memset(cache, 0, sizeof(kmem_cache_t));
+
+	cache->name = name;
+	cache->objectSize = objectSize;
+	cache->objectsPerSlab = (PAGE_SIZE - KMEM_SLAB_HEADER_SIZE) / objectSize;
+	cache->stats.objectSize = cache->objectSize;
+	cache->stats.objectsPerSlab = cache->objectsPerSlab;
+	cache->next = caches;
+	caches = cache;
+
+	return cache;
+}
+
+/*
+Allocates an object from cache. Its contents are undefined. Returns NULL if
+out of memory.
+*/
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+	kmem_slab_t *slab = cache->partial;
+
+	if(slab == NULL)
+	{
+		slab = cache->empty;
+
+		if(slab != NULL)
+		{
+			kmem_slab_unlink(&cache->empty, slab);
+			cache->emptyCount--;
+		}
+		else
+		{
+			slab = kmem_slab_create(cache);
+
+			if(slab == NULL)
+			{
+				cache->stats.failures++;
+
+				return NULL;
+			}
+		}
+
+		kmem_slab_push(&cache->partial, slab);
+	}
+
+	void *object = slab->freeList;
+
+	slab->freeList = *(void **)object;
+
+	if(++slab->inUse == cache->objectsPerSlab)
+	{
+		kmem_slab_unlink(&cache->partial, slab);
+		kmem_slab_push(&cache->full, slab);
+	}
+
+	cache->stats.activeObjects++;
+	cache->stats.allocs++;
+
+	return object;
+}
+
+/*
+Gives an object back to the cache it was allocated from. Freeing NULL does
+nothing.
+*/
+void kmem_cache_free(kmem_cache_t *cache, void *object)
+{
+	if(object == NULL)
+		return;
+
+	kmem_slab_t *slab = (kmem_slab_t *)((uint32_t)object & ~(uint32_t)(PAGE_SIZE - 1));
+
+	// Not one of ours
+	if(slab->cache != cache)
+		return;
+
+	if(slab->inUse == cache->objectsPerSlab)
+	{
+		kmem_slab_unlink(&cache->full, slab);
+		kmem_slab_push(&cache->partial, slab);
+	}
+
+	*(void **)object = slab->freeList;
+	slab->freeList = object;
+
+	cache->stats.activeObjects--;
+	cache->stats.frees++;
+
+	if(--slab->inUse == 0)
+	{
+		kmem_slab_unlink(&cache->partial, slab);
+
+		if(cache->emptyCount < KMEM_CACHE_MAX_EMPTY)
+		{
+			kmem_slab_push(&cache->empty, slab);
+			cache->emptyCount++;
+		}
+		else
+			kmem_slab_destroy(slab);
+	}
+}
+
+/*
+Walks the list of caches: returns the first cache if cache is NULL, otherwise
+the one after it, or NULL at the end.
+*/
+kmem_cache_t *kmem_cache_next(kmem_cache_t *cache)
+{
+	return (cache == NULL) ? caches : cache->next;
+}
+
+void kmem_cache_get_stats(const kmem_cache_t *cache, kmem_cache_stats_t *stats)
+{
+	memcpy(stats, &cache->stats, sizeof(kmem_cache_stats_t));
+}
+
+/*
+Allocates a new slab for cache with all of its objects on the free list. User
+pages are reclaimed if there is no free frame.
+*/
+static kmem_slab_t *kmem_slab_create(kmem_cache_t *cache)
+{
+	physical_addr phys = (physical_addr)pmmngr_alloc_block();
+
+	if(phys == 0 && swap_reclaim(SWAP_RECLAIM_BATCH) > 0)
+		phys = (physical_addr)pmmngr_alloc_block();
+
+	if(phys == 0)
+		return NULL;
+
+	pfdb_frame_set(phys / PAGE_SIZE, PFDB_KERNEL, 0);
+
+	kmem_slab_t *slab = (kmem_slab_t *)phys_to_virt(phys);
+	uint8_t *object = (uint8_t *)slab + KMEM_SLAB_HEADER_SIZE;
+
+	slab->prev = NULL;
+	slab->next = NULL;
+	slab->cache = cache;
+	slab->freeList = object;
+	slab->inUse = 0;
+
+	for(uint32_t i = 1; i < cache->objectsPerSlab; ++i, object += cache->objectSize)
+		*(void **)object = object + cache->objectSize;
+
+	*(void **)object = NULL;
+
+	cache->stats.slabs++;
+	cache->stats.totalObjects += cache->objectsPerSlab;
+
+	return slab;
+}
+
+static void kmem_slab_destroy(kmem_slab_t *slab)
+{
+	slab->cache->stats.slabs--;
+	slab->cache->stats.totalObjects -= slab->cache->objectsPerSlab;
+	slab->cache = NULL;
+
+	pfdb_put(virt_to_phys(slab) / PAGE_SIZE);
+}
+
+static void kmem_slab_unlink(kmem_slab_t **list, kmem_slab_t *slab)
+{
+	if(slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else
+		*list = slab->next;
+
+	if(slab->next != NULL)
+		slab->next->prev = slab->prev;
+
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
+static void kmem_slab_push(kmem_slab_t **list, kmem_slab_t *slab)
+{
+	slab->prev = NULL;
+	slab->next = *list;
+
+	if(*list != NULL)
+		(*list)->prev = slab;
+
+	*list = slab;
+}
@@ -0,0 +1,270 @@
+/*
+Lithium OS swap area and page reclaim.
+
+Reclaimed pages go to the compressed store in memory (see zram.c) if they
+compress well enough, otherwise to the swap area. Slot numbers cover both:
+those with SWAP_SLOT_ZRAM set are compressed store handles.
+
+The swap area is the whole of the second drive on the primary ATA channel,
+split into page sized slots. Each slot has a reference count since a forked
+process shares its parent's swapped out pages just like its resident ones.
+
+When a user or kernel page can't be backed by a free frame the virtual memory
+manager calls swap_reclaim(). It moves a clock hand through the user address
+space of every process in turn. Pages accessed since the hand last passed have
+their accessed bit cleared and are left alone for another lap; the others are
+saved with swap_out() (or just dropped, if they were never written to) and
+their page table entries record where they went. The page fault handler reads
+them back in with vmmngr_swap_in().
+
+Without a swap drive only pages that compress or were never written to are
+reclaimed.
+*/
+
+#include <swap.h>
+#include <ata.h>
+#include <kmalloc.h>
+#include <scheduler.h>
+#include <vmmngr.h>
+#include <zram.h>
+
+#define SWAP_DRIVE				1	// Slave drive on the primary channel
+#define SWAP_SECTORS_PER_SLOT	(PAGE_SIZE / 512)
+#define SWAP_MAX_SLOTS			0x10000	// 256MiB
+
+static uint16_t *slotRefs = NULL;
+static uint32_t totalSlots = 0;
+static uint32_t usedSlots = 0;
+static uint32_t nextSlot = 1;
+static uint32_t swapOuts = 0;
+static uint32_t swapIns = 0;
+
+// Position of the reclaim clock hand
+static uint32_t clockProcess = 0;
+static virtual_addr clockAddr = 0;
+
+static uint32_t swap_slot_alloc(void);
+static bool swap_write(uint32_t slot, const void *page);
+static bool swap_read(uint32_t slot, void *page);
+static process_t *swap_clock_process(void);
+
+/*
+Sets up the compressed store, then looks for the swap drive and sets up its
+slots. Must be called after kmalloc_init(). Returns FALSE if there is no swap
+drive, in which case reclaim only uses the compressed store and drops pages
+that were never written to.
+*/
+bool swap_init(void)
+{
+	uint32_t sectors;
+
+	zram_init();
+
+	if(!ata_identify(SWAP_DRIVE, &sectors))
+		return FALSE;
+
+	uint32_t count = sectors / SWAP_SECTORS_PER_SLOT;
+
+	if(count > SWAP_MAX_SLOTS)
+		count = SWAP_MAX_SLOTS;
+
+	// Slot 0 is SWAP_SLOT_ZERO, so at least one more is needed
+	if(count < 2)
+		return FALSE;
+
+	slotRefs = (uint16_t *)kmalloc(count * sizeof(uint16_t));
+
+	if(slotRefs == NULL)
+		return FALSE;
+
+	memset(slotRefs, 0, count * sizeof(uint16_t));
+	totalSlots = count;
+
+	return TRUE;
+}
+
+/*
+Saves a page, compressed in memory if possible or else in the swap area.
+Returns its slot, with a single reference, or 0 if there was nowhere to put
+it.
+*/
+uint32_t swap_out(const void *page)
+{
+	uint32_t handle = zram_store(page);
+
+	if(handle != ZRAM_NO_HANDLE)
+		return SWAP_SLOT_ZRAM | handle;
+
+	uint32_t slot = swap_slot_alloc();
+
+	if(slot != 0 && !swap_write(slot, page))
+	{
+		swap_slot_put(slot);
+
+		return 0;
+	}
+
+	return slot;
+}
+
+/*
+Reads the page saved in slot back into page. The slot keeps its contents
+until its last reference is dropped.
+*/
+bool swap_in(uint32_t slot, void *page)
+{
+	if(slot & SWAP_SLOT_ZRAM)
+		return zram_load(slot & ~(uint32_t)SWAP_SLOT_ZRAM, page);
+
+	return swap_read(slot, page);
+}
+
+void swap_slot_ref(uint32_t slot)
+{
+	if(slot & SWAP_SLOT_ZRAM)
+		zram_ref(slot & ~(uint32_t)SWAP_SLOT_ZRAM);
+	else if(slot != SWAP_SLOT_ZERO && slot < totalSlots)
+		slotRefs[slot]++;
+}
+
+/*
+Drops a reference to a slot, freeing it when there are none left.
+*/
+void swap_slot_put(uint32_t slot)
+{
+	if(slot & SWAP_SLOT_ZRAM)
+	{
+		zram_put(slot & ~(uint32_t)SWAP_SLOT_ZRAM);
+
+		return;
+	}
+
+	if(slot == SWAP_SLOT_ZERO || slot >= totalSlots || slotRefs[slot] == 0)
+		return;
+
+	if(--slotRefs[slot] == 0)
+		usedSlots--;
+}
+
+/*
+Frees up to target frames by reclaiming user pages. The clock hand carries on
+from where the last call left it and goes round every process at most twice,
+so each page gets its second chance. Returns the number of frames freed.
+*/
+uint32_t swap_reclaim(uint32_t target)
+{
+	uint32_t processCount = 0;
+	uint32_t freed = 0;
+
+	for(process_t *proc = scheduler_get_process_queue(); proc != NULL; proc = proc->next)
+		processCount++;
+
+	for(uint32_t visits = 0; (visits <= 2 * processCount) && (freed < target); ++visits)
+	{
+		process_t *proc = swap_clock_process();
+
+		if(proc == NULL)
+			break;
+
+		freed += vmmngr_reclaim_user_pages(proc->pdPhysical, &clockAddr, target - freed);
+
+		// On to the next process once the hand reaches the end of this one
+		if(clockAddr >= KERNEL_VIRTUAL_BASE)
+		{
+			clockProcess = proc->id + 1;
+			clockAddr = 0;
+		}
+	}
+
+	return freed;
+}
+
+void swap_get_stats(uint32_t *slotsUsed, uint32_t *slotCount, uint32_t *pagesOut, uint32_t *pagesIn)
+{
+	*slotsUsed = usedSlots;
+	*slotCount = totalSlots;
+	*pagesOut = swapOuts;
+	*pagesIn = swapIns;
+}
+
+/*
+Returns a free slot in the swap area with a single reference, or 0 if it is
+full or there isn't one.
+*/
+static uint32_t swap_slot_alloc(void)
+{
+	for(uint32_t i = 1; i < totalSlots; ++i)
+	{
+		uint32_t slot = nextSlot;
+
+		if(++nextSlot == totalSlots)
+			nextSlot = 1;
+
+		if(slotRefs[slot] == 0)
+		{
+			slotRefs[slot] = 1;
+			usedSlots++;
+
+			return slot;
+		}
+	}
+
+	return 0;
+}
+
+static bool swap_write(uint32_t slot, const void *page)
+{
+	if(slot == SWAP_SLOT_ZERO || slot >= totalSlots)
+		return FALSE;
+
+	if(!ata_write_lba28(slot * SWAP_SECTORS_PER_SLOT, SWAP_SECTORS_PER_SLOT, page, SWAP_DRIVE))
+		return FALSE;
+
+	swapOuts++;
+
+	return TRUE;
+}
+
+static bool swap_read(uint32_t slot, void *page)
+{
+	if(slot == SWAP_SLOT_ZERO || slot >= totalSlots)
+		return FALSE;
+
+	if(!ata_read_lba28(slot * SWAP_SECTORS_PER_SLOT, SWAP_SECTORS_PER_SLOT, page, SWAP_DRIVE))
+		return FALSE;
+
+	swapIns++;
+
+	return TRUE;
+}
+
+/*
+Returns the process the clock hand is in: the one with the lowest ID not below
+clockProcess. The hand starts again at address 0 if its process has gone.
+*/
+static process_t *swap_clock_process(void)
+{
+	process_t *found = NULL;
+
+	for(process_t *proc = scheduler_get_process_queue(); proc != NULL; proc = proc->next)
+	{
+		if(proc->id >= clockProcess && (found == NULL || proc->id < found->id))
+			found = proc;
+	}
+
+	// Past the last process, so go round again from the first
+	if(found == NULL && clockProcess != 0)
+	{
+		clockProcess = 0;
+
+		return swap_clock_process();
+	}
+
+	if(found != NULL && found->id != clockProcess)
+	{
+		clockProcess = found->id;
+		clockAddr = 0;
+	}
+
+	return found;
+}
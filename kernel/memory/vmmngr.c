@@ -1,44 +1,253 @@
 /*
 Lithium OS virtual memory manager.
+
+Works with either the 2-level 32-bit paging structures or, when stage 2 found
+memory above 4GiB and a CPU that supports it, 3-level PAE paging structures
+with 64-bit entries. In both modes the paging structures of the current
+address space are reached through a recursive mapping:
+
+	32-bit:	page tables at PAGE_TABLES_ADDR, page directory at PAGE_DIRECTORY_ADDRESS
+	PAE:	page tables at PAE_PAGE_TABLES_ADDR, the four page directories one after
+			the other at PAE_PAGE_DIRECTORIES_ADDR
+
+In PAE mode the value loaded into CR3 (pd_physical) is the address of the page
+directory pointer table, which is kept in its own frame.
+
+Paging structures always come from the normal or DMA zones, so the ones of
+other address spaces are reached through the direct map (phys_to_virt()) and
+never need a temporary mapping or a TLB flush.
+
+Large pages (4MiB, or 2MiB with PAE) are used for the kernel image, which stage
+2 maps, and the direct map of low physical memory at DIRECT_MAP_BASE. Nothing
+below a large page directory entry can be mapped or freed page by page.
+
+When the CPU supports global pages, every mapping in the kernel half is marked
+global so it survives the CR3 reload on each task switch. Page directory entries
+that point at page tables (including the recursive ones) are never marked
+global. Changing a kernel mapping therefore needs invlpg, or
+vmmngr_flush_tlb_global() for larger changes, since reloading CR3 won't do.
+
+CR0.WP is set so the kernel honours read-only pages too. This keeps it from
+writing through to a frame shared copy-on-write (see vmmngr_clone_user_space()).
+
+Every page table in the kernel half is allocated at boot by
+vmmngr_preallocate_kernel_tables(), so the kernel's page directory entries are
+the same in every address space and are copied just once, when the address
+space is created. Should a kernel page table still have to be added later,
+kernelGeneration is bumped and vmmngr_sync_kernel_space() copies the entries
+again the next time each address space is switched to.
+
+New page tables are taken from a small pool of cleared tables that the idle loop
+keeps topped up. The page frame database counts the entries in use in each page
+table, and an unmapped entry is always cleared completely, so a user page table
+whose count drops to zero is all zeroes: it is unhooked from the page directory
+and goes back to the pool, or to the physical memory manager if that is full.
+
+When no frame is free for a new page, user pages are reclaimed (see swap.c).
+A reclaimed page's entry is left not present with PTE_SWAPPED set, its swap
+slot in the frame bits and its writable, user and copy-on-write bits kept.
+Such entries still count as in use. A user page whose dirty bit is clear holds
+nothing but zeroes, since new user pages are cleared without going through
+their mapping and pages given other contents are marked dirty when they are
+mapped, so reclaim drops those without writing them out.
+
+Demand-zero pages that are read before they are written map the shared zero
+page: one pinned, cleared frame mapped read-only (and copy-on-write if the page
+may be written) wherever it is needed. Pinned frames aren't reference counted
+so nothing ever frees it, reclaim passes it over, and the first write replaces
+it with a private zeroed frame (see vmmngr_copy_on_write()).
 */
 
 #include <vmmngr.h>
+#include <pfdb.h>
+#include <pae.h>
+#include <swap.h>
+
+#define LARGE_PAGE_SIZE_32BIT	0x400000
+#define LARGE_PAGE_SIZE_PAE		0x200000
+#define CR4_PGE					0x80
+#define CR0_WP					0x10000
+#define PTABLE_POOL_SIZE		8
+#define PTABLE_POOL_MIN_FREE	256	// Don't fill the pool when the normal zone is this low
 
 physical_addr currentDirectory = 0;
+static bool paeEnabled = FALSE;
+static bool largePagesEnabled = FALSE;
+static bool globalPagesEnabled = FALSE;
+static uint32_t directMapSize = 0;
+static uint32_t kernelGeneration = 0;
+static uint32_t tlbPageFlushes = 0;
+static uint32_t tlbFullFlushes = 0;
+static physical_addr ptablePool[PTABLE_POOL_SIZE];
+static uint32_t ptablePoolCount = 0;
+static uint32_t zeroFrame = 0;
+
+static bool vmmngr_ptable_alloc(virtual_addr virt);
+static page_frame_t *vmmngr_ptable_frame(virtual_addr virt);
+static void vmmngr_ptable_release(virtual_addr virt);
+static uint32_t vmmngr_alloc_frame(virtual_addr virt, bool *zeroed);
+static pae_entry vmmngr_reclaim_entry(pae_entry e, uint32_t *reclaimed);
+static bool vmmngr_pde_is_large(virtual_addr virt);
+static uint32_t vmmngr_global_attrib(virtual_addr virt);
+static void vmmngr_enable_global_pages(void);
+static void vmmngr_copy_kernel_space(physical_addr pd_physical);
+static uint32_t vmmngr_range_span(virtual_addr virt, uint32_t count, uint32_t flags);
+static uint32_t vmmngr_range_attrib(virtual_addr virt, uint32_t flags);
+static void *vmmngr_frame_window(uint32_t frame, virtual_addr window);
+
+// Entries of the current address space in PAE mode
+static inline pae_entry *pae_pde(virtual_addr addr)
+{
+	return (pae_entry *)(PAE_PAGE_DIRECTORIES_ADDR + (addr >> 21) * sizeof(pae_entry));
+}
 
-bool vmmngr_init(physical_addr pd_physical)
+static inline pae_entry *pae_pte(virtual_addr addr)
+{
+	return (pae_entry *)(PAE_PAGE_TABLES_ADDR + (addr >> 12) * sizeof(pae_entry));
+}
+
+/*
+Must be called while the first 4MiB is still identity mapped since the paging
+structures set up by stage 2 are reached by their physical addresses to add
+the recursive mapping.
+*/
+bool vmmngr_init(physical_addr pd_physical, uint32_t pagingMode)
 {
 	if(!pd_physical)
 		return FALSE;
 	
 	currentDirectory = pd_physical;
+	paeEnabled = (pagingMode & PAGING_MODE_PAE) ? TRUE : FALSE;
+	largePagesEnabled = (pagingMode & PAGING_MODE_PSE) ? TRUE : FALSE;
+
+	if(paeEnabled)
+	{
+		pae_entry *pdpt = (pae_entry *)pd_physical;
+		pae_entry *pd = (pae_entry *)(pae_entry_frame(pdpt[PAE_DIRECTORY_COUNT - 1]) * PAGE_SIZE);
+
+		for(uint32_t i = 0; i < PAE_DIRECTORY_COUNT; ++i)
+		{
+			pae_entry *e = &pd[PAE_RECURSIVE_INDEX + i];
+
+			*e = 0;
+			pae_entry_set_frame(e, pae_entry_frame(pdpt[i]));
+			pae_entry_add_attrib(e, PAE_PRESENT | PAE_WRITABLE);
+		}
+	}
+	else
+	{
+		pd_entry *pde = vmmngr_pdirectory_lookup_entry((pdirectory *)pd_physical, PAGE_DIRECTORY_ADDRESS);
+		pd_entry_set_frame(pde, pd_physical);
+		pd_entry_add_attrib(pde, PDE_PRESENT | PDE_WRITABLE);
+	}
+
+	if(pagingMode & PAGING_MODE_PGE)
+		vmmngr_enable_global_pages();
+
+	// Make the kernel fault on read-only pages as well, for copy-on-write
+	uint32_t cr0;
+
+	__asm__ __volatile__("movl %%cr0, %0" : "=r" (cr0));
+	__asm__ __volatile__("movl %0, %%cr0" : : "r" (cr0 | CR0_WP) : "memory");
 	
 	return TRUE;
 }
 
-bool vmmngr_commit_page(pt_entry *e)
+bool vmmngr_pae_enabled(void)
 {
-	void *p = pmmngr_alloc_block();
-	
-	if(!p)
-		return FALSE;
-	
-	pt_entry_set_frame(e, (physical_addr)p);
-	pt_entry_add_attrib(e, PTE_PRESENT);
-	pt_entry_add_attrib(e, PTE_WRITABLE);
-	
+	return paeEnabled;
+}
+
+/*
+Maps physical memory from address 0 at DIRECT_MAP_BASE, covering frameCount
+frames (rounded up to 4MiB) or DIRECT_MAP_SIZE, whichever is smaller. Large
+pages are used if the CPU supports them, otherwise page tables are allocated
+for it.
+*/
+bool vmmngr_init_direct_map(uint32_t frameCount)
+{
+	uint32_t size = DIRECT_MAP_SIZE;
+
+	if(frameCount < DIRECT_MAP_SIZE / PAGE_SIZE)
+		size = (frameCount * PAGE_SIZE + LARGE_PAGE_SIZE_32BIT - 1) & ~(uint32_t)(LARGE_PAGE_SIZE_32BIT - 1);
+
+	for(physical_addr phys = 0; phys < size;)
+	{
+		virtual_addr virt = DIRECT_MAP_BASE + phys;
+
+		if(!largePagesEnabled)
+		{
+			if(!vmmngr_map_page(phys, virt))
+				return FALSE;
+
+			phys += PAGE_SIZE;
+		}
+		else if(paeEnabled)
+		{
+			pae_entry *pde = pae_pde(virt);
+
+			*pde = 0;
+			pae_entry_set_frame(pde, phys / PAGE_SIZE);
+			pae_entry_add_attrib(pde, PAE_PRESENT | PAE_WRITABLE | PAE_LARGE | vmmngr_global_attrib(virt));
+
+			phys += LARGE_PAGE_SIZE_PAE;
+		}
+		else
+		{
+			pd_entry *pde = vmmngr_pdirectory_lookup_entry((pdirectory *)PAGE_DIRECTORY_ADDRESS, virt);
+
+			*pde = (pd_entry)0;
+			pd_entry_set_frame(pde, phys);
+			pd_entry_add_attrib(pde, PDE_PRESENT | PDE_WRITABLE | PDE_4MB | vmmngr_global_attrib(virt));
+
+			phys += LARGE_PAGE_SIZE_32BIT;
+		}
+	}
+
+	directMapSize = size;
+
 	return TRUE;
 }
 
 void vmmngr_free_page(virtual_addr addr)
 {
-	pt_entry *pte;
+	vmmngr_free_page_gather(addr, NULL);
+}
+
+/*
+Like vmmngr_free_page(), but if tlb isn't NULL the page is added to it instead
+of being flushed from the TLB straight away.
+*/
+void vmmngr_free_page_gather(virtual_addr addr, tlb_gather_t *tlb)
+{
+	uint32_t frame = vmmngr_get_frame(addr);
 
-	pte = (pt_entry *)((uint32_t)vmmngr_get_ptable_address(addr) + PAGE_TABLE_INDEX(addr));
+	if(!frame || vmmngr_pde_is_large(addr))
+		return;
 
-	pmmngr_free_block((physical_addr)pt_entry_frame(*pte));
-	
-	pt_entry_del_attrib(pte, PTE_PRESENT);
+	if(paeEnabled)
+		*pae_pte(addr) = 0;
+	else
+		vmmngr_get_ptable_address(addr)->entries[PAGE_TABLE_INDEX(addr)] = 0;
+
+	// Kernel pages may be global, so a CR3 reload wouldn't drop them. The frame
+	// is only freed once nothing else maps it, and not before the TLB has
+	// stopped mapping it here.
+	if(tlb != NULL)
+	{
+		vmmngr_tlb_gather_page(tlb, addr);
+		vmmngr_tlb_gather_frame(tlb, frame);
+	}
+	else
+	{
+		vmmngr_flush_tlb_entry(addr);
+		pfdb_put(frame);
+	}
+
+	page_frame_t *pt = vmmngr_ptable_frame(addr);
+
+	if(pt != NULL && pt->tableEntries > 0 && --pt->tableEntries == 0)
+		vmmngr_ptable_release(addr);
 }
 
 inline pt_entry *vmmngr_ptable_lookup_entry(ptable *p, virtual_addr addr)
@@ -80,113 +289,1546 @@ void vmmngr_flush_tlb_entry(virtual_addr addr)
 	__asm__ __volatile__("invlpg %0" : : "m" (*a) : "memory");
 }
 
-// void vmmngr_flush_tlb_1024(virtual_addr addr)
-// {
-// 	disable_interrupts();
-// 	for(int i = 0; i < 1024; i++)
-// 	{
-// 		__asm__ __volatile__("invlpg (%0)" : : "r" (addr) : "memory");
-// 		addr += 4096;
-// 	}
-// 	enable_interrupts();
-// }
+/*
+Flushes the whole TLB, global entries included, by toggling CR4.PGE. Falls back
+to reloading CR3 if global pages aren't enabled.
+*/
+void vmmngr_flush_tlb_global(void)
+{
+	if(!globalPagesEnabled)
+	{
+		pmmngr_set_cr3(currentDirectory);
+
+		return;
+	}
+
+	uint32_t cr4;
+
+	__asm__ __volatile__("movl %%cr4, %0" : "=r" (cr4));
+	__asm__ __volatile__("movl %0, %%cr4" : : "r" (cr4 & ~(uint32_t)CR4_PGE) : "memory");
+	__asm__ __volatile__("movl %0, %%cr4" : : "r" (cr4) : "memory");
+}
+
+void vmmngr_tlb_gather_init(tlb_gather_t *tlb)
+{
+	tlb->count = 0;
+	tlb->kernel = FALSE;
+	tlb->frameCount = 0;
+}
+
+/*
+Records a page whose mapping changed. Nothing is flushed until
+vmmngr_tlb_gather_flush().
+*/
+void vmmngr_tlb_gather_page(tlb_gather_t *tlb, virtual_addr addr)
+{
+	if(addr >= KERNEL_VIRTUAL_BASE)
+		tlb->kernel = TRUE;
+
+	// Past the threshold only the count matters since the whole TLB will go
+	if(tlb->count < TLB_FLUSH_THRESHOLD)
+		tlb->pages[tlb->count] = addr;
+
+	++tlb->count;
+}
+
+/*
+Records a frame that an unmapped page used, to be released with pfdb_put()
+by vmmngr_tlb_gather_flush() once the TLB can no longer reach it. Flushes
+early if there's no room for it.
+*/
+void vmmngr_tlb_gather_frame(tlb_gather_t *tlb, uint32_t frame)
+{
+	if(tlb->frameCount == TLB_FLUSH_THRESHOLD)
+		vmmngr_tlb_gather_flush(tlb);
+
+	tlb->frames[tlb->frameCount++] = frame;
+}
+
+/*
+Flushes every gathered page: one invlpg each up to TLB_FLUSH_THRESHOLD pages,
+otherwise a single CR3 reload (or a global flush if kernel pages were changed),
+then releases the gathered frames. The gather can be reused afterwards.
+*/
+void vmmngr_tlb_gather_flush(tlb_gather_t *tlb)
+{
+	if(tlb->count > TLB_FLUSH_THRESHOLD)
+	{
+		if(tlb->kernel)
+			vmmngr_flush_tlb_global();
+		else
+			pmmngr_set_cr3(currentDirectory);
+
+		++tlbFullFlushes;
+	}
+	else
+	{
+		for(uint32_t i = 0; i < tlb->count; ++i)
+			vmmngr_flush_tlb_entry(tlb->pages[i]);
+
+		tlbPageFlushes += tlb->count;
+	}
+
+	for(uint32_t i = 0; i < tlb->frameCount; ++i)
+		pfdb_put(tlb->frames[i]);
+
+	vmmngr_tlb_gather_init(tlb);
+}
+
+/*
+Number of invlpg flushes and full TLB flushes issued by vmmngr_tlb_gather_flush().
+*/
+void vmmngr_get_tlb_flush_stats(uint32_t *pageFlushes, uint32_t *fullFlushes)
+{
+	*pageFlushes = tlbPageFlushes;
+	*fullFlushes = tlbFullFlushes;
+}
 
 bool vmmngr_map_page(physical_addr phys, virtual_addr virt)
 {
-	pdirectory *pd = (pdirectory *)PAGE_DIRECTORY_ADDRESS;
-	pd_entry *pde = &pd->entries [PAGE_DIRECTORY_INDEX(virt)];
-	
-	if((!pd) || (!pde))
+	return vmmngr_map_frame(phys / PAGE_SIZE, virt);
+}
+
+bool vmmngr_map_frame(uint32_t frame, virtual_addr virt)
+{
+	if(!vmmngr_ptable_alloc(virt) || vmmngr_pde_is_large(virt))
 		return FALSE;
-	
-	
-	if(!pd_entry_is_present(*pde))
+
+	page_frame_t *table = vmmngr_ptable_frame(virt);
+
+	if(paeEnabled)
 	{
-		//make ptable
-		ptable *newpt = pmmngr_alloc_block();
-		if(!newpt)
-			return FALSE;
-		
-		*pde = (pd_entry)0;
+		pae_entry *pte = pae_pte(virt);
+
+		if(*pte == 0 && table != NULL)
+			table->tableEntries++;
+
+		pae_entry_set_frame(pte, frame);
+		pae_entry_add_attrib(pte, PAE_PRESENT | PAE_WRITABLE | vmmngr_global_attrib(virt));
+	}
+	else
+	{
+		ptable *pt = vmmngr_get_ptable_address(virt);
+		pt_entry *pte = &pt->entries[PAGE_TABLE_INDEX(virt)];
+
+		if(*pte == 0 && table != NULL)
+			table->tableEntries++;
 		
-		pd_entry_add_attrib(pde, PDE_PRESENT);
-		pd_entry_add_attrib(pde, PDE_WRITABLE);
-		pd_entry_set_frame(pde, (physical_addr)newpt);
-		vmmngr_ptable_clear(vmmngr_get_ptable_address(virt));
+		pt_entry_set_frame(pte, frame * PAGE_SIZE);
+		pt_entry_add_attrib(pte, PTE_PRESENT | PTE_WRITABLE | vmmngr_global_attrib(virt));
 	}
-	
-	ptable *pt = vmmngr_get_ptable_address(virt);
-	pt_entry *pte = &pt->entries[PAGE_TABLE_INDEX(virt)];
-	
-	pt_entry_set_frame(pte, phys);
-	pt_entry_add_attrib(pte, PTE_PRESENT);
 
 	return TRUE;
 }
 
+/*
+Maps count consecutive frames starting at frame to count pages starting at the
+page aligned address virt. flags is a combination of the VMM_ flags. Existing
+mappings are replaced and flushed from the TLB together at the end. Each page
+table is looked up (or allocated) once and its entries filled in one go.
+*/
+bool vmmngr_map_range(uint32_t frame, virtual_addr virt, uint32_t count, uint32_t flags)
+{
+	tlb_gather_t tlb;
+	bool ret = TRUE;
+
+	vmmngr_tlb_gather_init(&tlb);
+
+	while(count > 0)
+	{
+		uint32_t n = vmmngr_range_span(virt, count, flags);
+
+		if(n == 0)
+		{
+			ret = FALSE;
+
+			break;
+		}
+
+		uint32_t attrib = vmmngr_range_attrib(virt, flags);
+		page_frame_t *table = vmmngr_ptable_frame(virt);
+		uint32_t added = 0;
+
+		if(paeEnabled)
+		{
+			pae_entry *pte = pae_pte(virt);
+
+			for(uint32_t i = 0; i < n; ++i)
+			{
+				if(pae_entry_is_present(pte[i]))
+					vmmngr_tlb_gather_page(&tlb, virt + i * PAGE_SIZE);
+				else if(pte[i] == 0)
+					added++;
+
+				pte[i] = ((pae_entry)(frame + i) << 12) | attrib;
+			}
+		}
+		else
+		{
+			pt_entry *pte = &vmmngr_get_ptable_address(virt)->entries[PAGE_TABLE_INDEX(virt)];
+
+			for(uint32_t i = 0; i < n; ++i)
+			{
+				if(pt_entry_is_present(pte[i]))
+					vmmngr_tlb_gather_page(&tlb, virt + i * PAGE_SIZE);
+				else if(pte[i] == 0)
+					added++;
+
+				pte[i] = ((frame + i) << 12) | attrib;
+			}
+		}
+
+		if(table != NULL)
+			table->tableEntries = (uint16_t)(table->tableEntries + added);
+
+		frame += n;
+		virt += n * PAGE_SIZE;
+		count -= n;
+	}
+
+	vmmngr_tlb_gather_flush(&tlb);
+
+	return ret;
+}
+
+/*
+Makes sure count pages starting at the page aligned address virt are backed
+by memory, allocating frames for the ones that aren't mapped yet or that map
+the shared zero page. New pages in the user half are zeroed. flags is a
+combination of the VMM_ flags and is applied to existing pages as well. New
+frames are recorded in the page frame database as belonging to owner. If
+frames isn't NULL it receives the frame number of every page in the range. On
+failure the pages mapped so far are left in place. Existing pages whose
+attributes change are flushed from the TLB together at the end.
+*/
+bool vmmngr_alloc_range(virtual_addr virt, uint32_t count, uint32_t flags, uint32_t owner, uint32_t *frames)
+{
+	uint16_t pfdbFlags = (flags & VMM_USER) ? PFDB_USER : ((virt >= KERNEL_VIRTUAL_BASE) ? PFDB_KERNEL : 0);
+	tlb_gather_t tlb;
+	bool ret = TRUE;
+
+	vmmngr_tlb_gather_init(&tlb);
+
+	while(count > 0 && ret)
+	{
+		uint32_t n = vmmngr_range_span(virt, count, flags);
+
+		if(n == 0)
+		{
+			ret = FALSE;
+
+			break;
+		}
+
+		uint32_t attrib = vmmngr_range_attrib(virt, flags);
+		// Shared copy-on-write pages only become writable through vmmngr_copy_on_write()
+		uint32_t cowAttrib = attrib & ~(uint32_t)PTE_WRITABLE;
+		pae_entry *paePte = paeEnabled ? pae_pte(virt) : NULL;
+		pt_entry *pte = paeEnabled ? NULL : &vmmngr_get_ptable_address(virt)->entries[PAGE_TABLE_INDEX(virt)];
+		page_frame_t *table = vmmngr_ptable_frame(virt);
+
+		for(uint32_t i = 0; i < n; ++i, virt += PAGE_SIZE)
+		{
+			uint32_t frame;
+			bool present = paeEnabled ? pae_entry_is_present(paePte[i]) : pt_entry_is_present(pte[i]);
+
+			// Swapped out pages are brought back rather than replaced
+			if(!present && (paeEnabled ? (paePte[i] & PAE_SWAPPED) : (pte[i] & PTE_SWAPPED)))
+			{
+				if(!vmmngr_swap_in(virt, owner))
+				{
+					ret = FALSE;
+
+					break;
+				}
+
+				present = TRUE;
+			}
+
+			// The shared zero page is replaced by a frame of the page's own
+			if(present && (paeEnabled ? pae_entry_frame(paePte[i]) : pt_entry_frame(pte[i]) / PAGE_SIZE) == zeroFrame)
+			{
+				vmmngr_tlb_gather_page(&tlb, virt);
+				present = FALSE;
+			}
+
+			if(present)
+			{
+				if(paeEnabled)
+				{
+					uint32_t a = (paePte[i] & PAE_COPY_ON_WRITE) ? cowAttrib : attrib;
+
+					if((paePte[i] & a) != a)
+						vmmngr_tlb_gather_page(&tlb, virt);
+
+					pae_entry_add_attrib(&paePte[i], a);
+					frame = pae_entry_frame(paePte[i]);
+				}
+				else
+				{
+					uint32_t a = (pte[i] & PTE_COPY_ON_WRITE) ? cowAttrib : attrib;
+
+					if((pte[i] & a) != a)
+						vmmngr_tlb_gather_page(&tlb, virt);
+
+					pt_entry_add_attrib(&pte[i], a);
+					frame = pt_entry_frame(pte[i]) / PAGE_SIZE;
+				}
+			}
+			else
+			{
+				bool zeroed;
+
+				frame = vmmngr_alloc_frame(virt, &zeroed);
+
+				if(!frame)
+				{
+					ret = FALSE;
+
+					break;
+				}
+
+				pfdb_frame_set(frame, pfdbFlags, owner);
+
+				if(table != NULL && (paeEnabled ? (paePte[i] == 0) : (pte[i] == 0)))
+					table->tableEntries++;
+
+				// Cleared away from the mapping so the page stays clean (see above).
+				// New user pages start out accessed so reclaim passes them over once.
+				if(virt < KERNEL_VIRTUAL_BASE)
+				{
+					if(!zeroed)
+						vmmngr_zero_frame(frame);
+
+					if(paeEnabled)
+						paePte[i] = ((pae_entry)frame << 12) | attrib | PAE_ACCESSED;
+					else
+						pte[i] = (frame << 12) | attrib | PTE_ACCESSED;
+				}
+				else if(paeEnabled)
+					paePte[i] = ((pae_entry)frame << 12) | attrib;
+				else
+					pte[i] = (frame << 12) | attrib;
+			}
+
+			if(frames)
+				*frames++ = frame;
+		}
+
+		count -= n;
+	}
+
+	vmmngr_tlb_gather_flush(&tlb);
+
+	return ret;
+}
+
+/*
+Removes the page table covering virt from the current address space without
+freeing anything it maps. Returns the physical address of the page table, or 0
+if there wasn't one.
+*/
+physical_addr vmmngr_unmap_ptable(virtual_addr virt)
+{
+	physical_addr pt = 0;
+
+	if(vmmngr_pde_is_large(virt))
+		return 0;
+
+	if(paeEnabled)
+	{
+		pae_entry *pde = pae_pde(virt);
+
+		if(pae_entry_is_present(*pde))
+		{
+			pt = pae_entry_frame(*pde) * PAGE_SIZE;
+			pae_entry_del_attrib(pde, PAE_PRESENT);
+		}
+	}
+	else
+	{
+		pd_entry *pde = vmmngr_pdirectory_lookup_entry((pdirectory *)PAGE_DIRECTORY_ADDRESS, virt);
+
+		if(pd_entry_is_present(*pde))
+		{
+			pt = pd_entry_frame(*pde);
+			pd_entry_del_attrib(pde, PDE_PRESENT);
+		}
+	}
+
+	if(pt)
+		vmmngr_flush_tlb_global();
+
+	return pt;
+}
+
 void vmmngr_ptable_clear(ptable *pt)
 {
 	memsetd((uint32_t *)pt, 0, sizeof(ptable) / 4);
 }
 
-bool vmmngr_alloc_page(virtual_addr virt)
+/*
+Adds one more cleared page table to the pool. Called from the idle loop with
+interrupts enabled; returns FALSE when the pool is full or memory is low.
+*/
+bool vmmngr_ptable_pool_fill(void)
 {
-	pdirectory *pd = (pdirectory *)PAGE_DIRECTORY_ADDRESS;
-	pd_entry *pde = &pd->entries[PAGE_DIRECTORY_INDEX(virt)];
-	
-	if((!pd) || (!pde))
-		return FALSE;
-	
-	
-	if(!pd_entry_is_present(*pde))
+	bool ret = FALSE;
+
+	// Page faults take from the pool and unmapping gives back to it
+	disable_interrupts();
+
+	if(ptablePoolCount < PTABLE_POOL_SIZE &&
+		pmmngr_get_zone_free_block_count(PMMNGR_ZONE_NORMAL) >= PTABLE_POOL_MIN_FREE)
 	{
-		//make ptable
-		ptable *newpt = pmmngr_alloc_block();
-		
-		if(!newpt)
-			return FALSE;
-		
-		*pde = (pd_entry)0;
-		
-		pd_entry_add_attrib(pde, PDE_PRESENT);
-		pd_entry_add_attrib(pde, PDE_WRITABLE);
-		pd_entry_set_frame(pde, (physical_addr)newpt);
-		vmmngr_ptable_clear(vmmngr_get_ptable_address(virt));
+		physical_addr pt = (physical_addr)pmmngr_alloc_zeroed_block();
+
+		if(pt)
+		{
+			pfdb_frame_set(pt / PAGE_SIZE, PFDB_PAGE_TABLE | PFDB_ZEROED, 0);
+			ptablePool[ptablePoolCount++] = pt;
+			ret = TRUE;
+		}
 	}
-	
-	ptable *pt = vmmngr_get_ptable_address(virt);
-	
-	pt_entry *pte = &pt->entries[PAGE_TABLE_INDEX(virt)];
-	
-	if(pt_entry_is_present(*pte))
+
+	enable_interrupts();
+
+	return ret;
+}
+
+bool vmmngr_alloc_page(virtual_addr virt)
+{
+	if(!vmmngr_ptable_alloc(virt))
+		return FALSE;
+
+	if(vmmngr_get_frame(virt))
 		return TRUE;
-	
-	if(!vmmngr_commit_page(pte))
+
+	bool zeroed;
+	uint32_t frame = vmmngr_alloc_frame(virt, &zeroed);
+
+	if(!frame)
 		return FALSE;
+
+	pfdb_frame_set(frame, (virt >= KERNEL_VIRTUAL_BASE) ? PFDB_KERNEL : 0, 0);
+
+	page_frame_t *table = vmmngr_ptable_frame(virt);
+
+	if(paeEnabled)
+	{
+		pae_entry *pte = pae_pte(virt);
+
+		if(*pte == 0 && table != NULL)
+			table->tableEntries++;
+
+		pae_entry_set_frame(pte, frame);
+		pae_entry_add_attrib(pte, PAE_PRESENT | PAE_WRITABLE | vmmngr_global_attrib(virt));
+	}
+	else
+	{
+		ptable *pt = vmmngr_get_ptable_address(virt);
+		pt_entry *pte = &pt->entries[PAGE_TABLE_INDEX(virt)];
+
+		if(*pte == 0 && table != NULL)
+			table->tableEntries++;
+
+		pt_entry_set_frame(pte, frame * PAGE_SIZE);
+		pt_entry_add_attrib(pte, PTE_PRESENT);
+		pt_entry_add_attrib(pte, PTE_WRITABLE | vmmngr_global_attrib(virt));
+	}
+
+	if(virt < KERNEL_VIRTUAL_BASE && !zeroed)
+		memsetd((uint32_t *)(virt & ~(uint32_t)(PAGE_SIZE - 1)), 0, PAGE_SIZE / 4);
 	
 	return TRUE;
 }
 
-ptable *vmmngr_get_ptable_address(virtual_addr addr)
+/*
+Sets aside the frame every untouched demand-zero page is mapped to. Must be
+called once the page frame database is up.
+*/
+bool vmmngr_init_zero_page(void)
 {
-	return (ptable *)(PAGE_TABLES_ADDR + PAGE_DIRECTORY_INDEX(addr) * PAGE_SIZE);
-}
+	physical_addr phys = (physical_addr)pmmngr_alloc_zeroed_block();
 
-physical_addr vmmngr_get_physical_address(virtual_addr addr)
-{
-	pdirectory *pd = (pdirectory *)PAGE_DIRECTORY_ADDRESS;
+	if(phys == 0)
+		return FALSE;
 
-	pd_entry *pde = (pd_entry *)&pd->entries[PAGE_DIRECTORY_INDEX(addr)];
+	zeroFrame = phys / PAGE_SIZE;
+	pfdb_frame_set(zeroFrame, PFDB_KERNEL | PFDB_PINNED | PFDB_ZEROED, 0);
 
-	if(!pd_entry_is_present(*pde))
-		return NULL;
+	return TRUE;
+}
+
+/*
+Maps the shared zero page read-only at the unmapped user page virt of the
+current address space. If writable, the page is marked copy-on-write so the
+first write gives it a zeroed frame of its own. Returns FALSE if a page table
+can't be allocated.
+*/
+bool vmmngr_map_zero_page(virtual_addr virt, bool writable)
+{
+	virt &= ~(uint32_t)(PAGE_SIZE - 1);
+
+	if(zeroFrame == 0 || virt >= KERNEL_VIRTUAL_BASE || vmmngr_range_span(virt, 1, VMM_USER) == 0)
+		return FALSE;
+
+	uint32_t attrib = PTE_PRESENT | PTE_USER | (writable ? PTE_COPY_ON_WRITE : 0);
+	page_frame_t *table = vmmngr_ptable_frame(virt);
+
+	// Not present entries aren't cached, so there is nothing to flush
+	if(paeEnabled)
+	{
+		pae_entry *pte = pae_pte(virt);
+
+		if(*pte == 0 && table != NULL)
+			table->tableEntries++;
+
+		*pte = ((pae_entry)zeroFrame << 12) | attrib;
+	}
+	else
+	{
+		pt_entry *pte = &vmmngr_get_ptable_address(virt)->entries[PAGE_TABLE_INDEX(virt)];
+
+		if(*pte == 0 && table != NULL)
+			table->tableEntries++;
+
+		*pte = (zeroFrame << 12) | attrib;
+	}
+
+	return TRUE;
+}
+
+ptable *vmmngr_get_ptable_address(virtual_addr addr)
+{
+	return (ptable *)(PAGE_TABLES_ADDR + PAGE_DIRECTORY_INDEX(addr) * PAGE_SIZE);
+}
+
+/*
+Returns the physical address of the page mapped at addr, or NULL if it isn't
+mapped or is high memory. Use vmmngr_get_frame() for pages that may be high.
+*/
+physical_addr vmmngr_get_physical_address(virtual_addr addr)
+{
+	uint32_t frame = vmmngr_get_frame(addr);
+
+	if(frame >= PMMNGR_ZONE_HIGH_FRAME)
+		return NULL;
+
+	return frame * PAGE_SIZE;
+}
+
+/*
+Returns the frame number of the page mapped at addr, or 0 if it isn't mapped.
+*/
+uint32_t vmmngr_get_frame(virtual_addr addr)
+{
+	if(paeEnabled)
+	{
+		pae_entry pde = *pae_pde(addr);
+
+		if(!pae_entry_is_present(pde))
+			return 0;
+
+		if(pde & PAE_LARGE)
+			return pae_entry_frame(pde) + ((addr >> 12) & (PAE_ENTRIES_PER_TABLE - 1));
+
+		if(!pae_entry_is_present(*pae_pte(addr)))
+			return 0;
+
+		return pae_entry_frame(*pae_pte(addr));
+	}
+
+	pdirectory *pd = (pdirectory *)PAGE_DIRECTORY_ADDRESS;
+
+	pd_entry *pde = (pd_entry *)&pd->entries[PAGE_DIRECTORY_INDEX(addr)];
+
+	if(!pd_entry_is_present(*pde))
+		return 0;
+
+	if(pd_entry_is_4mb(*pde))
+		return pd_entry_frame(*pde) / PAGE_SIZE + PAGE_TABLE_INDEX(addr);
 
 	ptable *pt = vmmngr_get_ptable_address(addr);
 
 	pt_entry *pte = (pt_entry *)&pt->entries[PAGE_TABLE_INDEX(addr)];
 
 	if(!pt_entry_is_present(*pte))
+		return 0;
+
+	return pt_entry_frame(*pte) / PAGE_SIZE;
+}
+
+/*
+Lets ring 3 reach a mapped page. The user bit is set on the page directory
+entry as well since both levels are checked.
+*/
+void vmmngr_make_page_user(virtual_addr addr)
+{
+	if(vmmngr_pde_is_large(addr))
+		return;
+
+	if(paeEnabled)
+	{
+		pae_entry_add_attrib(pae_pde(addr), PAE_USER);
+		pae_entry_add_attrib(pae_pte(addr), PAE_USER);
+	}
+	else
+	{
+		pd_entry_add_attrib(vmmngr_pdirectory_lookup_entry((pdirectory *)PAGE_DIRECTORY_ADDRESS, addr), PDE_USER);
+		pt_entry_add_attrib(vmmngr_ptable_lookup_entry(vmmngr_get_ptable_address(addr), addr), PTE_USER);
+	}
+}
+
+/*
+Allocates the (zeroed) top level paging structures for a new address space
+and fills in the kernel half. Returns the value to load into CR3, or 0 if out
+of memory. The address space is up to date with kernel space generation
+vmmngr_kernel_space_generation().
+*/
+physical_addr vmmngr_create_address_space(uint16_t pfdbFlags, uint32_t owner)
+{
+	physical_addr pdPhysical = (physical_addr)pmmngr_alloc_zeroed_block();
+
+	if(pdPhysical == 0)
+		return 0;
+
+	pfdb_frame_set(pdPhysical / PAGE_SIZE, pfdbFlags, owner);
+
+	if(!paeEnabled)
+	{
+		vmmngr_copy_kernel_space(pdPhysical);
+
+		return pdPhysical;
+	}
+
+	// PDPT entries are only read when CR3 is loaded, so all four page
+	// directories are allocated up front rather than on demand
+	pae_entry *pdpt = (pae_entry *)phys_to_virt(pdPhysical);
+
+	for(uint32_t i = 0; i < PAE_DIRECTORY_COUNT; ++i)
+	{
+		physical_addr dir = (physical_addr)pmmngr_alloc_zeroed_block();
+
+		if(dir == 0)
+		{
+			vmmngr_free_address_space(pdPhysical);
+
+			return 0;
+		}
+
+		pfdb_frame_set(dir / PAGE_SIZE, pfdbFlags, owner);
+
+		pae_entry_set_frame(&pdpt[i], dir / PAGE_SIZE);
+		pae_entry_add_attrib(&pdpt[i], PAE_PRESENT);
+	}
+
+	vmmngr_copy_kernel_space(pdPhysical);
+
+	return pdPhysical;
+}
+
+/*
+Allocates a page table for every part of the kernel half that isn't covered by
+large pages, so the kernel's page directory entries never change once processes
+exist. The unused end of the direct map is skipped since nothing is ever mapped
+there. Must be called after the page frame database is set up and before the
+first address space is created.
+*/
+bool vmmngr_preallocate_kernel_tables(void)
+{
+	uint32_t span = paeEnabled ? LARGE_PAGE_SIZE_PAE : LARGE_PAGE_SIZE_32BIT;
+	virtual_addr end = paeEnabled ? PAE_PAGE_TABLES_ADDR : PAGE_TABLES_ADDR;
+
+	for(virtual_addr virt = KERNEL_VIRTUAL_BASE; virt < end; virt += span)
+	{
+		if((virt >= DIRECT_MAP_BASE + directMapSize) && (virt < DIRECT_MAP_BASE + DIRECT_MAP_SIZE))
+			continue;
+
+		if(!vmmngr_ptable_alloc(virt))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+Bumped whenever a page directory entry in the kernel half changes.
+*/
+uint32_t vmmngr_kernel_space_generation(void)
+{
+	return kernelGeneration;
+}
+
+/*
+Brings the kernel half of another address space up to date if the kernel's
+page directory entries changed since generation. Cheap when nothing changed,
+which after boot is always.
+*/
+void vmmngr_sync_kernel_space(physical_addr pd_physical, uint32_t *generation)
+{
+	if(*generation == kernelGeneration)
+		return;
+
+	vmmngr_copy_kernel_space(pd_physical);
+
+	*generation = kernelGeneration;
+}
+
+/*
+Copies the kernel's page directory entries from the current address space
+into another one and points its recursive mapping at itself.
+*/
+static void vmmngr_copy_kernel_space(physical_addr pd_physical)
+{
+	if(paeEnabled)
+	{
+		pae_entry *pdpt = (pae_entry *)phys_to_virt(pd_physical);
+		pae_entry *pd = (pae_entry *)phys_to_virt(pae_entry_frame(pdpt[PAE_DIRECTORY_COUNT - 1]) * PAGE_SIZE);
+
+		// The kernel's 1GiB is the whole of the last page directory
+		memcpy(pd, pae_pde(KERNEL_VIRTUAL_BASE), PAE_RECURSIVE_INDEX * sizeof(pae_entry));
+
+		for(uint32_t i = 0; i < PAE_DIRECTORY_COUNT; ++i)
+		{
+			pd[PAE_RECURSIVE_INDEX + i] = 0;
+			pae_entry_set_frame(&pd[PAE_RECURSIVE_INDEX + i], pae_entry_frame(pdpt[i]));
+			pae_entry_add_attrib(&pd[PAE_RECURSIVE_INDEX + i], PAE_PRESENT | PAE_WRITABLE);
+		}
+
+		return;
+	}
+
+	uint32_t pdOffset = PAGE_DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE) * sizeof(pd_entry);
+	pdirectory *pd = (pdirectory *)phys_to_virt(pd_physical);
+
+	// Copy kernel address space
+	memcpy((uint8_t *)pd + pdOffset, (void *)(PAGE_DIRECTORY_ADDRESS + pdOffset), PAGE_DIRECTORY_SIZE - pdOffset);
+
+	// Update physical address of page directory to match new process (recursive paging)
+	pd_entry *pde = vmmngr_pdirectory_lookup_entry(pd, PAGE_DIRECTORY_ADDRESS);
+	pd_entry_set_frame(pde, pd_physical);
+}
+
+/*
+Gives the empty address space pd_physical a copy-on-write copy of the current
+address space's user half. Only the page tables are copied: writable pages
+become read-only and marked copy-on-write in both address spaces and each
+frame gains a reference, so the first write to one by either side makes a
+private copy (see vmmngr_copy_on_write()). New page tables are recorded as
+belonging to owner. On failure pd_physical is left partly filled in and should
+be released with vmmngr_release_user_space().
+*/
+bool vmmngr_clone_user_space(physical_addr pd_physical, uint32_t owner)
+{
+	tlb_gather_t tlb;
+	bool ret = TRUE;
+
+	vmmngr_tlb_gather_init(&tlb);
+
+	if(paeEnabled)
+	{
+		pae_entry *pdpt = (pae_entry *)phys_to_virt(pd_physical);
+
+		for(uint32_t d = 0; (d < PAE_DIRECTORY_COUNT - 1) && ret; ++d)
+		{
+			pae_entry *pd = (pae_entry *)phys_to_virt(pae_entry_frame(pdpt[d]) * PAGE_SIZE);
+
+			for(uint32_t i = 0; i < PAE_ENTRIES_PER_TABLE; ++i)
+			{
+				virtual_addr base = (d << 30) | (i << 21);
+				pae_entry *srcPde = pae_pde(base);
+
+				if(!pae_entry_is_present(*srcPde))
+					continue;
+
+				uint32_t newpt = (uint32_t)pmmngr_alloc_block() / PAGE_SIZE;
+
+				if(!newpt)
+				{
+					ret = FALSE;
+
+					break;
+				}
+
+				pfdb_frame_set(newpt, PFDB_PAGE_TABLE, owner);
+
+				pd[i] = (*srcPde & ~PAE_FRAME & ~(pae_entry)PAE_ACCESSED) | ((pae_entry)newpt << 12);
+
+				pae_entry *table = (pae_entry *)phys_to_virt(newpt * PAGE_SIZE);
+				pae_entry *src = pae_pte(base);
+				uint16_t used = 0;
+
+				for(uint32_t j = 0; j < PAE_ENTRIES_PER_TABLE; ++j)
+				{
+					if(!pae_entry_is_present(src[j]))
+					{
+						// Swapped out pages share the slot instead
+						if(src[j] & PAE_SWAPPED)
+						{
+							swap_slot_ref(pae_entry_frame(src[j]));
+							used++;
+						}
+
+						table[j] = (src[j] & PAE_SWAPPED) ? src[j] : 0;
+						continue;
+					}
+
+					if(src[j] & PAE_WRITABLE)
+					{
+						src[j] = (src[j] & ~(pae_entry)PAE_WRITABLE) | PAE_COPY_ON_WRITE;
+						vmmngr_tlb_gather_page(&tlb, base + j * PAGE_SIZE);
+					}
+
+					pfdb_ref(pae_entry_frame(src[j]));
+					table[j] = src[j];
+					used++;
+				}
+
+				pfdb_get(newpt)->tableEntries = used;
+			}
+		}
+	}
+	else
+	{
+		pdirectory *pd = (pdirectory *)phys_to_virt(pd_physical);
+		pdirectory *srcPd = (pdirectory *)PAGE_DIRECTORY_ADDRESS;
+
+		for(uint32_t i = 0; i < PAGE_DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE); ++i)
+		{
+			if(!pd_entry_is_present(srcPd->entries[i]))
+				continue;
+
+			physical_addr newpt = (physical_addr)pmmngr_alloc_block();
+
+			if(!newpt)
+			{
+				ret = FALSE;
+
+				break;
+			}
+
+			pfdb_frame_set(newpt / PAGE_SIZE, PFDB_PAGE_TABLE, owner);
+
+			pd->entries[i] = (srcPd->entries[i] & (PAGE_SIZE - 1) & ~(uint32_t)PDE_ACCESSED) | newpt;
+
+			ptable *table = (ptable *)phys_to_virt(newpt);
+			virtual_addr base = i << 22;
+			ptable *src = vmmngr_get_ptable_address(base);
+			uint16_t used = 0;
+
+			for(uint32_t j = 0; j < PAGES_PER_TABLE; ++j)
+			{
+				pt_entry e = src->entries[j];
+
+				if(!pt_entry_is_present(e))
+				{
+					// Swapped out pages share the slot instead
+					if(e & PTE_SWAPPED)
+					{
+						swap_slot_ref(pt_entry_frame(e) / PAGE_SIZE);
+						used++;
+					}
+
+					table->entries[j] = (e & PTE_SWAPPED) ? e : 0;
+					continue;
+				}
+
+				if(e & PTE_WRITABLE)
+				{
+					e = (e & ~(uint32_t)PTE_WRITABLE) | PTE_COPY_ON_WRITE;
+					src->entries[j] = e;
+					vmmngr_tlb_gather_page(&tlb, base + j * PAGE_SIZE);
+				}
+
+				pfdb_ref(pt_entry_frame(e) / PAGE_SIZE);
+				table->entries[j] = e;
+				used++;
+			}
+
+			pfdb_get(newpt / PAGE_SIZE)->tableEntries = used;
+		}
+	}
+
+	// Our own pages that became read-only
+	vmmngr_tlb_gather_flush(&tlb);
+
+	return ret;
+}
+
+/*
+Resolves a write fault on a copy-on-write page of the current address space.
+The faulting page gets a private copy of the frame, recorded as belonging to
+owner, unless nothing else maps the frame any more, in which case it is just
+made writable again. A page mapping the shared zero page gets a zeroed frame
+instead of a copy. Returns FALSE if addr isn't a copy-on-write page or if out
+of memory.
+*/
+bool vmmngr_copy_on_write(virtual_addr addr, uint32_t owner)
+{
+	virtual_addr virt = addr & ~(uint32_t)(PAGE_SIZE - 1);
+
+	if((virt >= KERNEL_VIRTUAL_BASE) || vmmngr_pde_is_large(virt))
+		return FALSE;
+
+	uint32_t frame = vmmngr_get_frame(virt);
+
+	if(!frame)
+		return FALSE;
+
+	pae_entry *paePte = paeEnabled ? pae_pte(virt) : NULL;
+	pt_entry *pte = paeEnabled ? NULL : &vmmngr_get_ptable_address(virt)->entries[PAGE_TABLE_INDEX(virt)];
+
+	if(paeEnabled ? !(*paePte & PAE_COPY_ON_WRITE) : !(*pte & PTE_COPY_ON_WRITE))
+		return FALSE;
+
+	page_frame_t *pf = pfdb_get(frame);
+
+	if(frame == zeroFrame)
+	{
+		bool zeroed;
+		uint32_t copy = vmmngr_alloc_frame(virt, &zeroed);
+
+		if(!copy)
+			return FALSE;
+
+		// Cleared away from the mapping, so it can stay clean
+		if(!zeroed)
+			vmmngr_zero_frame(copy);
+
+		pfdb_frame_set(copy, PFDB_USER, owner);
+
+		if(paeEnabled)
+			*paePte = ((pae_entry)copy << 12) | (*paePte & (PAE_USER | PAE_PRESENT)) | PAE_WRITABLE | PAE_ACCESSED;
+		else
+			*pte = (copy << 12) | (*pte & (PTE_USER | PTE_PRESENT)) | PTE_WRITABLE | PTE_ACCESSED;
+
+		vmmngr_flush_tlb_entry(virt);
+
+		return TRUE;
+	}
+
+	if((pf != NULL) && (pf->refCount > 1))
+	{
+		uint32_t copy = vmmngr_alloc_frame(virt, NULL);
+
+		if(!copy)
+			return FALSE;
+
+		memcpy(vmmngr_frame_window(copy, PAGECOPY_TEMP), (const void *)virt, PAGE_SIZE);
+
+		pfdb_frame_set(copy, PFDB_USER, owner);
+
+		// Whoever else maps the frame keeps it
+		pfdb_put(frame);
+
+		frame = copy;
+	}
+
+	// Dirty since the contents weren't written through this mapping
+	if(paeEnabled)
+	{
+		*paePte &= ~(PAE_FRAME | PAE_COPY_ON_WRITE);
+		*paePte |= ((pae_entry)frame << 12) | PAE_WRITABLE | PAE_DIRTY;
+	}
+	else
+	{
+		*pte = (*pte & (PAGE_SIZE - 1) & ~(uint32_t)PTE_COPY_ON_WRITE) | (frame << 12) | PTE_WRITABLE | PTE_DIRTY;
+	}
+
+	vmmngr_flush_tlb_entry(virt);
+
+	return TRUE;
+}
+
+/*
+Drops the address space's reference to every frame mapped in its user half, to
+the swap slots of its swapped out pages and to its user page tables. Shared
+frames and slots are only freed once nothing else uses them. The address space
+must not be the current one.
+*/
+void vmmngr_release_user_space(physical_addr pd_physical)
+{
+	if(paeEnabled)
+	{
+		pae_entry *pdpt = (pae_entry *)phys_to_virt(pd_physical);
+
+		// The last page directory is the kernel's
+		for(uint32_t d = 0; d < PAE_DIRECTORY_COUNT - 1; ++d)
+		{
+			pae_entry *pd = (pae_entry *)phys_to_virt(pae_entry_frame(pdpt[d]) * PAGE_SIZE);
+
+			for(uint32_t i = 0; i < PAE_ENTRIES_PER_TABLE; ++i)
+			{
+				if(!pae_entry_is_present(pd[i]))
+					continue;
+
+				pae_entry *table = (pae_entry *)phys_to_virt(pae_entry_frame(pd[i]) * PAGE_SIZE);
+
+				for(uint32_t j = 0; j < PAE_ENTRIES_PER_TABLE; ++j)
+				{
+					if(pae_entry_is_present(table[j]))
+						pfdb_put(pae_entry_frame(table[j]));
+					else if(table[j] & PAE_SWAPPED)
+						swap_slot_put(pae_entry_frame(table[j]));
+				}
+
+				pfdb_put(pae_entry_frame(pd[i]));
+			}
+		}
+
+		return;
+	}
+
+	pdirectory *pd = (pdirectory *)phys_to_virt(pd_physical);
+
+	for(uint32_t i = 0; i < PAGE_DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE); ++i)
+	{
+		if(!pd_entry_is_present(pd->entries[i]))
+			continue;
+
+		ptable *pt = (ptable *)phys_to_virt(pd_entry_frame(pd->entries[i]));
+
+		for(uint32_t j = 0; j < PAGES_PER_TABLE; ++j)
+		{
+			if(pt_entry_is_present(pt->entries[j]))
+				pfdb_put(pt_entry_frame(pt->entries[j]) / PAGE_SIZE);
+			else if(pt->entries[j] & PTE_SWAPPED)
+				swap_slot_put(pt_entry_frame(pt->entries[j]) / PAGE_SIZE);
+		}
+
+		pfdb_put(pd_entry_frame(pd->entries[i]) / PAGE_SIZE);
+	}
+}
+
+/*
+Moves the reclaim clock hand through the user half of an address space from
+*hand, giving each resident page a second chance: one accessed since the last
+pass just loses its accessed bit, others that only this address space maps are
+swapped out. Stops once target frames have been freed or the hand reaches
+KERNEL_VIRTUAL_BASE, leaving *hand where the scan should carry on. Returns the
+number of frames freed.
+*/
+uint32_t vmmngr_reclaim_user_pages(physical_addr pd_physical, virtual_addr *hand, uint32_t target)
+{
+	tlb_gather_t tlb;
+	uint32_t freed = 0;
+	virtual_addr virt = *hand & ~(uint32_t)(PAGE_SIZE - 1);
+
+	// Other address spaces have nothing in the TLB
+	vmmngr_tlb_gather_init(&tlb);
+
+	while(virt < KERNEL_VIRTUAL_BASE && freed < target)
+	{
+		uint32_t frame = 0;
+
+		if(paeEnabled)
+		{
+			pae_entry *pdpt = (pae_entry *)phys_to_virt(pd_physical);
+			pae_entry *pd = (pae_entry *)phys_to_virt(pae_entry_frame(pdpt[virt >> 30]) * PAGE_SIZE);
+			pae_entry pde = pd[(virt >> 21) & (PAE_ENTRIES_PER_TABLE - 1)];
+
+			if(!pae_entry_is_present(pde) || (pde & PAE_LARGE))
+			{
+				virt = (virt + LARGE_PAGE_SIZE_PAE) & ~(uint32_t)(LARGE_PAGE_SIZE_PAE - 1);
+				continue;
+			}
+
+			pae_entry *e = (pae_entry *)phys_to_virt(pae_entry_frame(pde) * PAGE_SIZE) + ((virt >> 12) & (PAE_ENTRIES_PER_TABLE - 1));
+
+			if(pae_entry_is_present(*e))
+				*e = vmmngr_reclaim_entry(*e, &frame);
+		}
+		else
+		{
+			pd_entry pde = ((pdirectory *)phys_to_virt(pd_physical))->entries[PAGE_DIRECTORY_INDEX(virt)];
+
+			if(!pd_entry_is_present(pde) || pd_entry_is_4mb(pde))
+			{
+				virt = (virt + LARGE_PAGE_SIZE_32BIT) & ~(uint32_t)(LARGE_PAGE_SIZE_32BIT - 1);
+				continue;
+			}
+
+			pt_entry *e = &((ptable *)phys_to_virt(pd_entry_frame(pde)))->entries[PAGE_TABLE_INDEX(virt)];
+
+			if(pt_entry_is_present(*e))
+				*e = (pt_entry)vmmngr_reclaim_entry(*e, &frame);
+		}
+
+		if(frame)
+		{
+			freed++;
+
+			if(pd_physical == currentDirectory)
+				vmmngr_tlb_gather_page(&tlb, virt);
+
+			// Put once the flush below has dropped any stale translation
+			vmmngr_tlb_gather_frame(&tlb, frame);
+		}
+
+		virt += PAGE_SIZE;
+	}
+
+	vmmngr_tlb_gather_flush(&tlb);
+
+	*hand = virt;
+
+	return freed;
+}
+
+/*
+Brings a swapped out page of the current address space back into memory,
+recording the new frame as belonging to owner. Returns FALSE if the page at
+addr isn't swapped out, or if out of memory or reading it back fails.
+*/
+bool vmmngr_swap_in(virtual_addr addr, uint32_t owner)
+{
+	virtual_addr virt = addr & ~(uint32_t)(PAGE_SIZE - 1);
+
+	if(virt >= KERNEL_VIRTUAL_BASE || vmmngr_ptable_frame(virt) == NULL)
+		return FALSE;
+
+	pae_entry e = paeEnabled ? *pae_pte(virt) : vmmngr_get_ptable_address(virt)->entries[PAGE_TABLE_INDEX(virt)];
+
+	if((e & PTE_PRESENT) || !(e & PTE_SWAPPED))
+		return FALSE;
+
+	uint32_t slot = (uint32_t)((e & PAE_FRAME) >> 12);
+	bool zeroed;
+	uint32_t frame = vmmngr_alloc_frame(virt, &zeroed);
+
+	if(!frame)
+		return FALSE;
+
+	uint32_t attrib = (uint32_t)e & (PTE_WRITABLE | PTE_USER | PTE_COPY_ON_WRITE);
+
+	if(slot == SWAP_SLOT_ZERO)
+	{
+		if(!zeroed)
+			vmmngr_zero_frame(frame);
+	}
+	else
+	{
+		if(!swap_in(slot, vmmngr_frame_window(frame, PAGECOPY_TEMP)))
+		{
+			pmmngr_free_frame(frame);
+
+			return FALSE;
+		}
+
+		// The slot is given up, so memory holds the only copy
+		swap_slot_put(slot);
+		attrib |= PTE_DIRTY;
+	}
+
+	pfdb_frame_set(frame, PFDB_USER, owner);
+
+	// Not present entries aren't cached, so there is nothing to flush
+	if(paeEnabled)
+		*pae_pte(virt) = ((pae_entry)frame << 12) | attrib | PAE_PRESENT | PAE_ACCESSED;
+	else
+		vmmngr_get_ptable_address(virt)->entries[PAGE_TABLE_INDEX(virt)] = (frame << 12) | attrib | PTE_PRESENT | PTE_ACCESSED;
+
+	return TRUE;
+}
+
+/*
+Frees the top level paging structures of an address space. The address space
+must not be the current one.
+*/
+void vmmngr_free_address_space(physical_addr pd_physical)
+{
+	if(paeEnabled)
+	{
+		pae_entry *pdpt = (pae_entry *)phys_to_virt(pd_physical);
+
+		for(uint32_t i = 0; i < PAE_DIRECTORY_COUNT; ++i)
+		{
+			if(pae_entry_is_present(pdpt[i]))
+				pfdb_put(pae_entry_frame(pdpt[i]));
+		}
+	}
+
+	pfdb_put(pd_physical / PAGE_SIZE);
+}
+
+/*
+Clears a frame, through a temporary mapping if it is outside the direct map.
+The mapping is shared, so this must not be interrupted by anything else that
+uses it.
+*/
+void vmmngr_zero_frame(uint32_t frame)
+{
+	memsetd((uint32_t *)vmmngr_frame_window(frame, PAGEZERO_TEMP), 0, PAGE_SIZE / 4);
+}
+
+/*
+Returns the address of phys in the direct map, or NULL if it is high memory.
+*/
+void *phys_to_virt(physical_addr phys)
+{
+	if(phys >= directMapSize)
+		return NULL;
+
+	return (void *)(DIRECT_MAP_BASE + phys);
+}
+
+/*
+Returns the physical address of a kernel address, looking it up in the page
+tables unless it is in the direct map. Returns 0 if it isn't mapped.
+*/
+physical_addr virt_to_phys(const void *virt)
+{
+	virtual_addr addr = (virtual_addr)virt;
+
+	if((addr >= DIRECT_MAP_BASE) && (addr - DIRECT_MAP_BASE < directMapSize))
+		return addr - DIRECT_MAP_BASE;
+
+	physical_addr page = vmmngr_get_physical_address(addr);
+
+	if(page == 0)
+		return 0;
+
+	return page + (addr & (PAGE_SIZE - 1));
+}
+
+/*
+Returns an address frame can be reached at: its place in the direct map, or
+else window after mapping it there.
+*/
+static void *vmmngr_frame_window(uint32_t frame, virtual_addr window)
+{
+	// Frames in the direct map don't need a mapping of their own
+	if(frame < directMapSize / PAGE_SIZE)
+		return phys_to_virt(frame * PAGE_SIZE);
+
+	vmmngr_map_frame(frame, window);
+	vmmngr_flush_tlb_entry(window);
+
+	return (void *)window;
+}
+
+/*
+Attribute to add to a page (or large page directory entry) mapped at virt.
+*/
+static uint32_t vmmngr_global_attrib(virtual_addr virt)
+{
+	return (globalPagesEnabled && virt >= KERNEL_VIRTUAL_BASE) ? PTE_CPU_GLOBAL : 0;
+}
+
+/*
+Marks the kernel mappings stage 2 made (the kernel and its stack) global, then
+turns global pages on.
+*/
+static void vmmngr_enable_global_pages(void)
+{
+	uint32_t span = paeEnabled ? LARGE_PAGE_SIZE_PAE : LARGE_PAGE_SIZE_32BIT;
+	virtual_addr end = paeEnabled ? PAE_PAGE_TABLES_ADDR : PAGE_TABLES_ADDR;
+
+	for(virtual_addr virt = KERNEL_VIRTUAL_BASE; virt < end; virt += span)
+	{
+		if(paeEnabled)
+		{
+			pae_entry *pde = pae_pde(virt);
+
+			if(!pae_entry_is_present(*pde))
+				continue;
+
+			if(*pde & PAE_LARGE)
+			{
+				pae_entry_add_attrib(pde, PAE_CPU_GLOBAL);
+				continue;
+			}
+
+			pae_entry *pt = pae_pte(virt);
+
+			for(uint32_t i = 0; i < PAE_ENTRIES_PER_TABLE; ++i)
+			{
+				if(pae_entry_is_present(pt[i]))
+					pae_entry_add_attrib(&pt[i], PAE_CPU_GLOBAL);
+			}
+		}
+		else
+		{
+			pd_entry *pde = vmmngr_pdirectory_lookup_entry((pdirectory *)PAGE_DIRECTORY_ADDRESS, virt);
+
+			if(!pd_entry_is_present(*pde))
+				continue;
+
+			if(pd_entry_is_4mb(*pde))
+			{
+				pd_entry_add_attrib(pde, PDE_CPU_GLOBAL);
+				continue;
+			}
+
+			ptable *pt = vmmngr_get_ptable_address(virt);
+
+			for(uint32_t i = 0; i < PAGES_PER_TABLE; ++i)
+			{
+				if(pt_entry_is_present(pt->entries[i]))
+					pt_entry_add_attrib(&pt->entries[i], PTE_CPU_GLOBAL);
+			}
+		}
+	}
+
+	uint32_t cr4;
+
+	__asm__ __volatile__("movl %%cr4, %0" : "=r" (cr4));
+	__asm__ __volatile__("movl %0, %%cr4" : : "r" (cr4 | CR4_PGE) : "memory");
+
+	globalPagesEnabled = TRUE;
+}
+
+/*
+Makes sure the page table covering virt exists and allows what flags asks for.
+Returns how many of the count pages from virt it covers, or 0 on failure.
+*/
+static uint32_t vmmngr_range_span(virtual_addr virt, uint32_t count, uint32_t flags)
+{
+	if(!vmmngr_ptable_alloc(virt) || vmmngr_pde_is_large(virt))
+		return 0;
+
+	uint32_t perTable = paeEnabled ? PAE_ENTRIES_PER_TABLE : PAGES_PER_TABLE;
+	uint32_t left = perTable - ((virt >> 12) & (perTable - 1));
+
+	if(flags & VMM_USER)
+	{
+		if(paeEnabled)
+			pae_entry_add_attrib(pae_pde(virt), PAE_USER);
+		else
+			pd_entry_add_attrib(vmmngr_pdirectory_lookup_entry((pdirectory *)PAGE_DIRECTORY_ADDRESS, virt), PDE_USER);
+	}
+
+	return (count < left) ? count : left;
+}
+
+/*
+Page table entry attributes for VMM_ flags. The bits are the same in both
+paging modes.
+*/
+static uint32_t vmmngr_range_attrib(virtual_addr virt, uint32_t flags)
+{
+	uint32_t attrib = PTE_PRESENT;
+
+	if(flags & VMM_WRITABLE)
+		attrib |= PTE_WRITABLE;
+
+	if(flags & VMM_USER)
+		attrib |= PTE_USER;
+
+	if(flags & VMM_NOCACHE)
+		attrib |= PTE_NOT_CACHEABLE;
+
+	if(flags & VMM_GLOBAL)
+		attrib |= vmmngr_global_attrib(virt);
+
+	return attrib;
+}
+
+static bool vmmngr_pde_is_large(virtual_addr virt)
+{
+	if(paeEnabled)
+		return (*pae_pde(virt) & (PAE_PRESENT | PAE_LARGE)) == (PAE_PRESENT | PAE_LARGE);
+
+	pd_entry pde = *vmmngr_pdirectory_lookup_entry((pdirectory *)PAGE_DIRECTORY_ADDRESS, virt);
+
+	return pd_entry_is_present(pde) && pd_entry_is_4mb(pde);
+}
+
+/*
+Makes sure there is a page table covering virt in the current address space,
+allocating a new one if needed. New tables come from the page table pool or
+the pre-zeroed pool when possible, otherwise they are cleared through the
+recursive mapping. This never uses pmmngr_alloc_zeroed_block() since that may
+need to create the page table for the zeroing window.
+*/
+static bool vmmngr_ptable_alloc(virtual_addr virt)
+{
+	if(paeEnabled ? pae_entry_is_present(*pae_pde(virt))
+		: pd_entry_is_present(*vmmngr_pdirectory_lookup_entry((pdirectory *)PAGE_DIRECTORY_ADDRESS, virt)))
+		return TRUE;
+
+	physical_addr newpt = (ptablePoolCount > 0) ? ptablePool[--ptablePoolCount] : (physical_addr)pmmngr_zero_pool_alloc();
+	bool zeroed = (newpt != 0);
+
+	if(!newpt)
+		newpt = (physical_addr)pmmngr_alloc_block();
+
+	if(!newpt)
+		return FALSE;
+
+	if(paeEnabled)
+	{
+		pae_entry *pde = pae_pde(virt);
+
+		*pde = 0;
+		pae_entry_set_frame(pde, newpt / PAGE_SIZE);
+		pae_entry_add_attrib(pde, PAE_PRESENT | PAE_WRITABLE);
+
+		if(!zeroed)
+			memsetd((uint32_t *)((virtual_addr)pae_pte(virt) & ~(uint32_t)(PAGE_SIZE - 1)), 0, PAGE_SIZE / 4);
+	}
+	else
+	{
+		pd_entry *pde = vmmngr_pdirectory_lookup_entry((pdirectory *)PAGE_DIRECTORY_ADDRESS, virt);
+
+		*pde = (pd_entry)0;
+		
+		pd_entry_add_attrib(pde, PDE_PRESENT);
+		pd_entry_add_attrib(pde, PDE_WRITABLE);
+		pd_entry_set_frame(pde, newpt);
+
+		if(!zeroed)
+			vmmngr_ptable_clear(vmmngr_get_ptable_address(virt));
+	}
+
+	if(virt >= KERNEL_VIRTUAL_BASE)
+	{
+		pfdb_frame_set(newpt / PAGE_SIZE, PFDB_PAGE_TABLE | PFDB_KERNEL, 0);
+
+		// Other address spaces need the new entry
+		++kernelGeneration;
+	}
+	else
+		pfdb_frame_set(newpt / PAGE_SIZE, PFDB_PAGE_TABLE, 0);
+
+	return TRUE;
+}
+
+/*
+Returns the page frame database entry of the page table covering virt in the
+current address space, or NULL if there isn't one.
+*/
+static page_frame_t *vmmngr_ptable_frame(virtual_addr virt)
+{
+	if(paeEnabled)
+	{
+		pae_entry pde = *pae_pde(virt);
+
+		if(!pae_entry_is_present(pde) || (pde & PAE_LARGE))
+			return NULL;
+
+		return pfdb_get(pae_entry_frame(pde));
+	}
+
+	pd_entry pde = *vmmngr_pdirectory_lookup_entry((pdirectory *)PAGE_DIRECTORY_ADDRESS, virt);
+
+	if(!pd_entry_is_present(pde) || pd_entry_is_4mb(pde))
 		return NULL;
 
-	return pt_entry_frame(*pte);
+	return pfdb_get(pd_entry_frame(pde) / PAGE_SIZE);
+}
+
+/*
+Unhooks the empty page table covering the user address virt from the current
+address space. Kernel page tables are shared by every address space so they
+are never released.
+*/
+static void vmmngr_ptable_release(virtual_addr virt)
+{
+	if(virt >= KERNEL_VIRTUAL_BASE)
+		return;
+
+	physical_addr pt;
+	virtual_addr mapping;
+
+	if(paeEnabled)
+	{
+		pae_entry *pde = pae_pde(virt);
+
+		pt = pae_entry_frame(*pde) * PAGE_SIZE;
+		mapping = (virtual_addr)pae_pte(virt) & ~(uint32_t)(PAGE_SIZE - 1);
+		*pde = 0;
+	}
+	else
+	{
+		pd_entry *pde = vmmngr_pdirectory_lookup_entry((pdirectory *)PAGE_DIRECTORY_ADDRESS, virt);
+
+		pt = pd_entry_frame(*pde);
+		mapping = (virtual_addr)vmmngr_get_ptable_address(virt);
+		*pde = (pd_entry)0;
+	}
+
+	// Drop the table's place in the recursive mapping. invlpg also drops any
+	// cached directory entries.
+	vmmngr_flush_tlb_entry(mapping);
+
+	// Every entry is clear, so it can be used again as it is
+	if(ptablePoolCount < PTABLE_POOL_SIZE)
+		ptablePool[ptablePoolCount++] = pt;
+	else
+		pfdb_put(pt / PAGE_SIZE);
+}
+
+/*
+Allocates a frame to back the page at virt. User pages get a pre-zeroed frame
+if zeroed isn't NULL and one is available (setting *zeroed), otherwise any
+frame, from high memory first. Kernel pages get a frame from the direct map.
+If none are free, user pages are reclaimed and the allocation tried again.
+*/
+static uint32_t vmmngr_alloc_frame(virtual_addr virt, bool *zeroed)
+{
+	uint32_t frame = 0;
+
+	if(zeroed != NULL)
+		*zeroed = FALSE;
+
+	for(uint32_t attempt = 0; attempt < 2 && !frame; ++attempt)
+	{
+		if(attempt > 0 && swap_reclaim(SWAP_RECLAIM_BATCH) == 0)
+			break;
+
+		if(virt >= KERNEL_VIRTUAL_BASE)
+		{
+			frame = (uint32_t)pmmngr_alloc_block() / PAGE_SIZE;
+		}
+		else
+		{
+			if(zeroed != NULL)
+			{
+				frame = (uint32_t)pmmngr_zero_pool_alloc() / PAGE_SIZE;
+				*zeroed = (frame != 0);
+			}
+
+			if(!frame)
+				frame = pmmngr_alloc_user_frame();
+		}
+	}
+
+	return frame;
+}
+
+/*
+Does the reclaim clock's work on the present user page table entry e and
+returns what the entry should become. Only pages that no other address space
+maps are reclaimed. Dirty pages are saved with swap_out(); clean ones hold
+only zeroes and are dropped. Sets *reclaimed to the reclaimed frame, which
+the caller must pfdb_put() once the old entry is flushed from the TLB.
+*/
+static pae_entry vmmngr_reclaim_entry(pae_entry e, uint32_t *reclaimed)
+{
+	// Second chance for pages used since the last pass. The stale TLB entry can
+	// stay, at worst the page looks unused for a little longer.
+	if(e & PTE_ACCESSED)
+		return e & ~(pae_entry)PTE_ACCESSED;
+
+	uint32_t frame = (uint32_t)((e & PAE_FRAME) >> 12);
+	page_frame_t *pf = pfdb_get(frame);
+
+	if(pf == NULL || !(pf->flags & PFDB_USER) || (pf->flags & PFDB_PINNED) || pf->refCount != 1)
+		return e;
+
+	uint32_t slot = SWAP_SLOT_ZERO;
+
+	if(e & PTE_DIRTY)
+	{
+		slot = swap_out(vmmngr_frame_window(frame, PAGECOPY_TEMP));
+
+		if(slot == 0)
+			return e;
+	}
+
+	*reclaimed = frame;
+
+	return ((pae_entry)slot << 12) | PTE_SWAPPED | (e & (PTE_WRITABLE | PTE_USER | PTE_COPY_ON_WRITE));
 }
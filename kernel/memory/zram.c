@@ -0,0 +1,454 @@
+/*
+Lithium OS compressed page store.
+
+Reclaimed user pages are compressed and kept in memory here before any are
+written to the swap drive, which is much slower. The compressor is an LZF
+style LZ77 codec that works on whole pages:
+
+	000LLLLL <L + 1 literal bytes>
+	LLLOOOOO OOOOOOOO				copy L + 2 bytes from O + 1 bytes back
+	111OOOOO LLLLLLLL OOOOOOOO		copy L + 9 bytes from O + 1 bytes back
+
+Compressed pages are kept in pool frames of their own, split into objects of
+one size class each (multiples of ZRAM_CLASS_GRANULE bytes). A pool frame
+starts with a header linking it to the other frames of its class and holding
+its free object list; it is freed when its last object is. Pages that don't
+compress to at most ZRAM_MAX_COMPRESSED bytes, so that at least two fit in a
+pool frame, are turned away.
+
+Stored pages are referred to by handle, an index into the handle table, which
+also keeps their compressed size and a reference count for pages shared after
+fork(). Pool frames come from the direct map. The store is used while memory
+has run out, so a few frames are kept in reserve for when the physical memory
+manager has none to give.
+*/
+
+#include <zram.h>
+#include <kmalloc.h>
+#include <pmmngr.h>
+#include <vmmngr.h>
+#include <pfdb.h>
+
+#define ZRAM_MAX_HANDLES		32768
+#define ZRAM_CLASS_GRANULE		32
+#define ZRAM_POOL_HEADER_SIZE	((uint32_t)sizeof(zram_pool_t))
+#define ZRAM_MAX_COMPRESSED		((PAGE_SIZE - ZRAM_POOL_HEADER_SIZE) / 2 / ZRAM_CLASS_GRANULE * ZRAM_CLASS_GRANULE)
+#define ZRAM_CLASS_COUNT		(ZRAM_MAX_COMPRESSED / ZRAM_CLASS_GRANULE)
+#define ZRAM_RESERVE_FRAMES		4
+#define ZRAM_HASH_BITS			10
+#define ZRAM_MAX_OFFSET			8192
+#define ZRAM_MAX_MATCH			264
+
+typedef struct zram_pool_struct
+{
+	struct zram_pool_struct *next;	// Next pool frame of the same class
+	void *freeObjects;				// Each free object starts with a pointer to the next
+	uint32_t usedObjects;
+	uint32_t sizeClass;
+} zram_pool_t;
+
+typedef struct
+{
+	void *object;		// NULL if the handle is free
+	uint16_t size;		// Compressed size
+	uint16_t refCount;
+} zram_handle_t;
+
+static zram_handle_t *handles = NULL;
+static uint32_t nextHandle = 0;
+static zram_pool_t *pools[ZRAM_CLASS_COUNT];
+static void *reserve[ZRAM_RESERVE_FRAMES];
+static uint32_t reserveCount = 0;
+static zram_stats_t stats;
+
+// Compressor state, only used with interrupts disabled
+static uint16_t hashTable[1 << ZRAM_HASH_BITS];
+static uint8_t compressBuffer[ZRAM_MAX_COMPRESSED];
+
+static uint32_t zram_compress(const uint8_t *in, uint8_t *out, uint32_t outMax);
+static bool zram_decompress(const uint8_t *in, uint32_t inLength, uint8_t *out);
+static void *zram_object_alloc(uint32_t size);
+static void zram_object_free(void *object, uint32_t size);
+static void *zram_frame_alloc(void);
+static void zram_frame_free(void *frame);
+static inline uint32_t zram_cycles(void);
+
+/*
+Sets up the handle table and the reserve frames. Must be called after
+kmalloc_init().
+*/
+bool zram_init(void)
+{
+	handles = (zram_handle_t *)kmalloc(ZRAM_MAX_HANDLES * sizeof(zram_handle_t));
+
+	if(handles == NULL)
+		return FALSE;
+
+	memset(handles, 0, ZRAM_MAX_HANDLES * sizeof(zram_handle_t));
+
+	while(reserveCount < ZRAM_RESERVE_FRAMES)
+	{
+		void *frame = zram_frame_alloc();
+
+		if(frame == NULL)
+			break;
+
+		reserve[reserveCount++] = frame;
+	}
+
+	return TRUE;
+}
+
+/*
+Compresses page into the store. Returns its handle, with a single reference,
+or ZRAM_NO_HANDLE if it doesn't compress well enough or the store is full.
+*/
+uint32_t zram_store(const void *page)
+{
+	if(handles == NULL)
+		return ZRAM_NO_HANDLE;
+
+	uint32_t size = zram_compress((const uint8_t *)page, compressBuffer, ZRAM_MAX_COMPRESSED);
+
+	if(size == 0)
+	{
+		stats.rejectedPages++;
+
+		return ZRAM_NO_HANDLE;
+	}
+
+	for(uint32_t i = 0; i < ZRAM_MAX_HANDLES; ++i)
+	{
+		uint32_t handle = nextHandle;
+
+		if(++nextHandle == ZRAM_MAX_HANDLES)
+			nextHandle = 0;
+
+		if(handles[handle].object != NULL)
+			continue;
+
+		void *object = zram_object_alloc(size);
+
+		if(object == NULL)
+			return ZRAM_NO_HANDLE;
+
+		memcpy(object, compressBuffer, size);
+
+		handles[handle].object = object;
+		handles[handle].size = (uint16_t)size;
+		handles[handle].refCount = 1;
+
+		stats.storedPages++;
+		stats.compressedBytes += size;
+
+		return handle;
+	}
+
+	return ZRAM_NO_HANDLE;
+}
+
+/*
+Decompresses a stored page into page. The page stays in the store until its
+last reference is dropped.
+*/
+bool zram_load(uint32_t handle, void *page)
+{
+	if(handle >= ZRAM_MAX_HANDLES || handles[handle].object == NULL)
+		return FALSE;
+
+	uint32_t start = zram_cycles();
+
+	if(!zram_decompress((const uint8_t *)handles[handle].object, handles[handle].size, (uint8_t *)page))
+		return FALSE;
+
+	uint32_t time = zram_cycles() - start;
+
+	stats.faultIns++;
+	stats.faultInCycles += time;
+
+	if(time > stats.maxFaultInCycles)
+		stats.maxFaultInCycles = time;
+
+	return TRUE;
+}
+
+void zram_ref(uint32_t handle)
+{
+	if(handle < ZRAM_MAX_HANDLES && handles[handle].object != NULL)
+		handles[handle].refCount++;
+}
+
+/*
+Drops a reference to a stored page, freeing it when there are none left.
+*/
+void zram_put(uint32_t handle)
+{
+	if(handle >= ZRAM_MAX_HANDLES || handles[handle].object == NULL)
+		return;
+
+	if(--handles[handle].refCount > 0)
+		return;
+
+	zram_object_free(handles[handle].object, handles[handle].size);
+
+	stats.storedPages--;
+	stats.compressedBytes -= handles[handle].size;
+
+	handles[handle].object = NULL;
+	handles[handle].size = 0;
+}
+
+void zram_get_stats(zram_stats_t *out)
+{
+	memcpy(out, &stats, sizeof(zram_stats_t));
+}
+
+/*
+Compresses a page into out. Returns the compressed size, or 0 if it would be
+more than outMax bytes.
+*/
+static uint32_t zram_compress(const uint8_t *in, uint8_t *out, uint32_t outMax)
+{
+	uint32_t ip = 0, op = 0, literals = 0;
+
+	// Positions are stored plus one so that 0 means none
+	memset(hashTable, 0, sizeof(hashTable));
+
+	while(ip + 2 < PAGE_SIZE)
+	{
+		uint32_t sequence = ((uint32_t)in[ip] << 16) | ((uint32_t)in[ip + 1] << 8) | in[ip + 2];
+		uint32_t hash = (sequence * 2654435761u) >> (32 - ZRAM_HASH_BITS);
+		uint32_t ref = hashTable[hash];
+
+		hashTable[hash] = (uint16_t)(ip + 1);
+
+		if(ref == 0 || ip - ref >= ZRAM_MAX_OFFSET || in[ref - 1] != in[ip] ||
+			in[ref] != in[ip + 1] || in[ref + 1] != in[ip + 2])
+		{
+			ip++;
+			literals++;
+			continue;
+		}
+
+		ref--;
+
+		uint32_t length = 3;
+		uint32_t maxLength = PAGE_SIZE - ip;
+
+		if(maxLength > ZRAM_MAX_MATCH)
+			maxLength = ZRAM_MAX_MATCH;
+
+		while(length < maxLength && in[ref + length] == in[ip + length])
+			length++;
+
+		// Literals before the match, in runs of up to 32
+		for(uint32_t start = ip - literals; literals > 0;)
+		{
+			uint32_t run = (literals > 32) ? 32 : literals;
+
+			if(op + run + 1 > outMax)
+				return 0;
+
+			out[op++] = (uint8_t)(run - 1);
+			memcpy(&out[op], &in[start], run);
+			op += run;
+			start += run;
+			literals -= run;
+		}
+
+		uint32_t offset = ip - ref - 1;
+		uint32_t code = length - 2;
+
+		if(op + 3 > outMax)
+			return 0;
+
+		if(code < 7)
+		{
+			out[op++] = (uint8_t)((code << 5) | (offset >> 8));
+		}
+		else
+		{
+			out[op++] = (uint8_t)((7 << 5) | (offset >> 8));
+			out[op++] = (uint8_t)(code - 7);
+		}
+
+		out[op++] = (uint8_t)(offset & 0xFF);
+		ip += length;
+	}
+
+	// Whatever is left at the end
+	literals += PAGE_SIZE - ip;
+
+	for(uint32_t start = PAGE_SIZE - literals; literals > 0;)
+	{
+		uint32_t run = (literals > 32) ? 32 : literals;
+
+		if(op + run + 1 > outMax)
+			return 0;
+
+		out[op++] = (uint8_t)(run - 1);
+		memcpy(&out[op], &in[start], run);
+		op += run;
+		start += run;
+		literals -= run;
+	}
+
+	return op;
+}
+
+/*
+Decompresses inLength bytes into a page. Returns FALSE if they don't make up
+exactly one page.
+*/
+static bool zram_decompress(const uint8_t *in, uint32_t inLength, uint8_t *out)
+{
+	uint32_t ip = 0, op = 0;
+
+	while(ip < inLength)
+	{
+		uint32_t control = in[ip++];
+
+		if(control < 32)
+		{
+			uint32_t run = control + 1;
+
+			if(ip + run > inLength || op + run > PAGE_SIZE)
+				return FALSE;
+
+			memcpy(&out[op], &in[ip], run);
+			ip += run;
+			op += run;
+
+			continue;
+		}
+
+		uint32_t length = control >> 5;
+
+		if(length == 7)
+		{
+			if(ip >= inLength)
+				return FALSE;
+
+			length += in[ip++];
+		}
+
+		if(ip >= inLength)
+			return FALSE;
+
+		uint32_t back = ((control & 0x1F) << 8) + in[ip++] + 1;
+
+		length += 2;
+
+		if(back > op || op + length > PAGE_SIZE)
+			return FALSE;
+
+		// Byte by byte since the source can overlap what is being written
+		for(uint32_t i = 0; i < length; ++i, ++op)
+			out[op] = out[op - back];
+	}
+
+	return (op == PAGE_SIZE) ? TRUE : FALSE;
+}
+
+static void *zram_object_alloc(uint32_t size)
+{
+	uint32_t sizeClass = (size + ZRAM_CLASS_GRANULE - 1) / ZRAM_CLASS_GRANULE - 1;
+	zram_pool_t *pool = pools[sizeClass];
+
+	while(pool != NULL && pool->freeObjects == NULL)
+		pool = pool->next;
+
+	if(pool == NULL)
+	{
+		pool = (zram_pool_t *)zram_frame_alloc();
+
+		if(pool == NULL)
+			return NULL;
+
+		uint32_t objectSize = (sizeClass + 1) * ZRAM_CLASS_GRANULE;
+		uint8_t *object = (uint8_t *)pool + ZRAM_POOL_HEADER_SIZE;
+
+		pool->freeObjects = NULL;
+		pool->usedObjects = 0;
+		pool->sizeClass = sizeClass;
+
+		for(; object + objectSize <= (uint8_t *)pool + PAGE_SIZE; object += objectSize)
+		{
+			*(void **)object = pool->freeObjects;
+			pool->freeObjects = object;
+		}
+
+		pool->next = pools[sizeClass];
+		pools[sizeClass] = pool;
+		stats.poolFrames++;
+	}
+
+	void *object = pool->freeObjects;
+
+	pool->freeObjects = *(void **)object;
+	pool->usedObjects++;
+
+	return object;
+}
+
+static void zram_object_free(void *object, uint32_t size)
+{
+	zram_pool_t *pool = (zram_pool_t *)((virtual_addr)object & ~(uint32_t)(PAGE_SIZE - 1));
+	uint32_t sizeClass = (size + ZRAM_CLASS_GRANULE - 1) / ZRAM_CLASS_GRANULE - 1;
+
+	*(void **)object = pool->freeObjects;
+	pool->freeObjects = object;
+
+	if(--pool->usedObjects > 0)
+		return;
+
+	// Last object gone, so give the frame back
+	zram_pool_t **link = &pools[sizeClass];
+
+	while(*link != pool)
+		link = &(*link)->next;
+
+	*link = pool->next;
+	stats.poolFrames--;
+
+	zram_frame_free(pool);
+}
+
+/*
+Returns a frame for the pool through the direct map, falling back on the
+reserve when the physical memory manager has run out.
+*/
+static void *zram_frame_alloc(void)
+{
+	void *frame = pmmngr_alloc_block();
+
+	if(frame != NULL)
+	{
+		pfdb_frame_set((physical_addr)frame / PAGE_SIZE, PFDB_KERNEL, 0);
+
+		return phys_to_virt((physical_addr)frame);
+	}
+
+	if(reserveCount > 0)
+		return reserve[--reserveCount];
+
+	return NULL;
+}
+
+static void zram_frame_free(void *frame)
+{
+	if(reserveCount < ZRAM_RESERVE_FRAMES)
+		reserve[reserveCount++] = frame;
+	else
+		pfdb_put(virt_to_phys(frame) / PAGE_SIZE);
+}
+
+// Low half of the time stamp counter, plenty for timing one page
+static inline uint32_t zram_cycles(void)
+{
+	uint32_t low, high;
+
+	__asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
+
+	return low;
+}
@@ -2,46 +2,59 @@
 #include <vmmngr.h>
 #include <errorcodes.h>
 #include <elf.h>
-#include <kmalloc.h>
+#include <pfdb.h>
+#include <vmregion.h>
+#include <slab.h>
+#include <kpage.h>
 
 // Stack size must be a multiple of PAGE_SIZE
 #define STACK_SIZE 				PAGE_SIZE * 2
-#define PAGEDIR_TEMP 			0xFFBFF000
+#define KERNEL_PROCESS_STACK_PAGES	1
 
 uint32_t idCounter = 0;
 
+static kmem_cache_t *processCache = NULL;
+static kmem_cache_t *threadCache = NULL;
+
+/*
+Creates the caches processes and threads are allocated from. Must be called
+after kmalloc_init().
+*/
+bool process_init(void)
+{
+	processCache = kmem_cache_create("process", sizeof(process_t));
+	threadCache = kmem_cache_create("thread", sizeof(thread_t));
+
+	return (processCache != NULL) && (threadCache != NULL);
+}
+
 process_t *add_process(void *binary, size_t binarySize)
 {
 	// Setup paging structures
-	physical_addr pdPhysical = (physical_addr)pmmngr_alloc_block();
+	physical_addr pdPhysical = vmmngr_create_address_space(PFDB_PAGE_TABLE, idCounter + 1);
 
 	if(pdPhysical == 0)
 		return NULL;
 
-	if(!vmmngr_map_page(pdPhysical, PAGEDIR_TEMP))
+	// Set up process struct and add to queue.
+	// Will use 0xDEADBEEF for EIP so the page fault handler will
+	// know that it needs to call scheduler_setup_current_thread().
+	process_t *proc = (process_t *)kmem_cache_alloc(processCache);
+	thread_t *thread = (thread_t *)kmem_cache_alloc(threadCache);
+
+	if((proc == NULL) || (thread == NULL))
 	{
-		pmmngr_free_block(pdPhysical);
+		kmem_cache_free(processCache, proc);
+		kmem_cache_free(threadCache, thread);
+		vmmngr_free_address_space(pdPhysical);
 
 		return NULL;
 	}
 
-	vmmngr_flush_tlb_entry(PAGEDIR_TEMP);
-
-	pdirectory *pd = (pdirectory *)PAGEDIR_TEMP;
-
-	// Clear page directory
-	memsetd((uint32_t *)pd, 0, sizeof(pdirectory) / 4);
-
-	// Set up process struct and add to queue.
-	// Will use 0xDEADBEEF for EIP so the page fault handler will
-	// know that it needs to call scheduler_setup_current_thread().
-	process_t *proc = (process_t *)kmalloc(sizeof(process_t));
-
 	proc->threadIDCounter = 0;
-	proc->threads = (thread_t *)kmalloc(sizeof(thread_t));
+	proc->threads = thread;
 	proc->threads->next = NULL;
 	proc->threads->id = ++(proc->threadIDCounter);
-	proc->threads->pmemRegions = NULL;
 	proc->blockedThreads = NULL;
 
 	registers_t *pRegs = &proc->threads->regs;
@@ -56,18 +69,22 @@ process_t *add_process(void *binary, size_t binarySize)
 	pRegs->eflags = 0x202; // Standard EFLAGS
 
 	proc->pdPhysical = pdPhysical;
+	proc->kernelGeneration = vmmngr_kernel_space_generation();
+	proc->regions = NULL;
 	proc->next = NULL;
 	proc->loadBinaryFrom = binary;
 	proc->binarySize = binarySize;
 	proc->id = ++idCounter;
-	proc->pmemRegions = NULL;
 
 	return proc;
 }
 
 thread_t *add_thread(process_t *proc, uint32_t entryPoint)
 {
-	thread_t *newThread = (thread_t *)kmalloc(sizeof(thread_t));
+	thread_t *newThread = (thread_t *)kmem_cache_alloc(threadCache);
+
+	if(newThread == NULL)
+		return NULL;
 
 	newThread->next = NULL;
 
@@ -109,209 +126,157 @@ uint32_t setup_process(process_t *proc, uint32_t *entryPoint)
 			sizeToMap &= (uint32_t)(~(PAGE_SIZE - 1));
 		}
 
-		for(uint32_t j = 0; j < sizeToMap; j += PAGE_SIZE)
-		{
-			virtual_addr addr = eli.segs[i].addressInMemory + j;
-
-			if(!vmmngr_alloc_page(addr))
-				return ERR_OUT_OF_MEMORY;
-
-			physical_addr phys = vmmngr_get_physical_address(addr);
+		virtual_addr segStart = eli.segs[i].addressInMemory & (uint32_t)(~(PAGE_SIZE - 1));
 
-			if(phys == NULL)
-				return ERR_UNKNOWN;
+		// Segments can share pages, so they all get the same attributes and are merged
+		if(!vmregion_reserve(proc, segStart, sizeToMap / PAGE_SIZE,
+			VM_REGION_READ | VM_REGION_WRITE | VM_REGION_EXECUTE, VM_REGION_ELF, VM_REGION_DEMAND_ZERO))
+			return ERR_VIRTUAL_MAP_FAILED;
 
-			process_add_pmem_region(proc, phys);
+		// Only the pages holding data from the file are committed now
+		uint32_t fileEnd = eli.segs[i].addressInMemory + eli.segs[i].sizeInFile;
+		uint32_t filePages = (fileEnd - segStart + PAGE_SIZE - 1) / PAGE_SIZE;
 
-			pd_entry *pde = vmmngr_pdirectory_lookup_entry((pdirectory *)PAGE_DIRECTORY_ADDRESS, addr);
-			pd_entry_add_attrib(pde, PDE_USER);
-
-			pt_entry *pte = (pt_entry *)((uint32_t)vmmngr_get_ptable_address(addr)
-				+ PAGE_TABLE_INDEX(addr) * 4);
-			pt_entry_add_attrib(pte, PTE_USER);
-		}
+		if(!vmmngr_alloc_range(segStart, filePages, VMM_USER | VMM_WRITABLE, proc->id, NULL))
+			return ERR_OUT_OF_MEMORY;
 
 		// Copy segment to correct location
 		memcpy((void *)eli.segs[i].addressInMemory, (const void *)((uint32_t)elf + eli.segs[i].offsetInFile),
 			eli.segs[i].sizeInFile);
 
-		// Zero any extra memory space
-		uint32_t zeroSpace = eli.segs[i].sizeInMemory - eli.segs[i].sizeInFile;
-
-		if(zeroSpace > 0)
-			memset((uint8_t *)(eli.segs[i].addressInMemory + eli.segs[i].sizeInFile), 0x00, zeroSpace);
+		// The rest of .bss maps the shared zero page until it is written. What
+		// shares a page with the file data is already zero since
+		// vmmngr_alloc_range() gives out zeroed user pages.
 	}
 
 	return SUCCESS;
 }
 
-uint32_t init_thread_stack(thread_t *thread, uint32_t *pStackAddr)
+uint32_t init_thread_stack(process_t *proc, thread_t *thread, uint32_t *pStackAddr)
 {
 	// Threads have stacks based on their id (minimum id is 1)
 	virtual_addr stackAddr = 0xC0000000 - STACK_SIZE * thread->id;
 
-	for(uint32_t addr = stackAddr; addr < stackAddr + STACK_SIZE; addr += PAGE_SIZE)
-	{
-		if(!vmmngr_alloc_page((virtual_addr)addr))
-			return ERR_OUT_OF_MEMORY;
-
-		physical_addr phys = vmmngr_get_physical_address((virtual_addr)addr);
-
-		if(phys == NULL)
-			return ERR_UNKNOWN;
-
-		thread_add_pmem_region(thread, (uint32_t)phys / PAGE_SIZE);
+	if(!vmregion_reserve(proc, stackAddr, STACK_SIZE / PAGE_SIZE, VM_REGION_READ | VM_REGION_WRITE,
+		VM_REGION_STACK, 0))
+		return ERR_VIRTUAL_MAP_FAILED;
 
-		pd_entry *pde = (pd_entry *)(PAGE_DIRECTORY_ADDRESS + PAGE_DIRECTORY_INDEX(addr) * sizeof(pd_entry));
-		pd_entry_add_attrib(pde, PDE_USER);
-
-		pt_entry *pte = (pt_entry *)((uint32_t)vmmngr_get_ptable_address(addr) + PAGE_TABLE_INDEX(addr) * sizeof(pt_entry));
-		pt_entry_add_attrib(pte, PTE_USER);
-
-		vmmngr_flush_tlb_entry(addr);
-	}
+	if(!vmmngr_alloc_range(stackAddr, STACK_SIZE / PAGE_SIZE, VMM_USER | VMM_WRITABLE, proc->id, NULL))
+		return ERR_OUT_OF_MEMORY;
 
 	*pStackAddr = stackAddr + STACK_SIZE;
 
 	return SUCCESS;
 }
 
-void process_add_pmem_region(process_t *proc, uint32_t pageIndex)
-{
-	if(proc->pmemRegions == NULL)
-	{
-		proc->pmemRegions = (pmem_region_t *)kmalloc(sizeof(pmem_region_t));
-		proc->pmemRegions->pageIndex = pageIndex;
-		proc->pmemRegions->next = NULL;
-	}
-	else
-	{
-		pmem_region_t *region = proc->pmemRegions;
-
-		while(region->next != NULL)
-			region = region->next;
-
-		region->next = (pmem_region_t *)kmalloc(sizeof(pmem_region_t));
-
-		region = region->next;
-
-		region->pageIndex = pageIndex;
-
-		region->next = NULL;
-	}
-}
-
-void thread_add_pmem_region(thread_t *thread, uint32_t pageIndex)
-{
-	if(thread->pmemRegions == NULL)
-	{
-		thread->pmemRegions = (pmem_region_t *)kmalloc(sizeof(pmem_region_t));
-		thread->pmemRegions->pageIndex = pageIndex;
-		thread->pmemRegions->next = NULL;
-	}
-	else
-	{
-		pmem_region_t *region = thread->pmemRegions;
-
-		while(region->next != NULL)
-			region = region->next;
-
-		region->next = (pmem_region_t *)kmalloc(sizeof(pmem_region_t));
-
-		region = region->next;
-
-		region->pageIndex = pageIndex;
-
-		region->next = NULL;
-	}
-}
-
 void process_destroy(process_t *proc)
 {
 	thread_t *thread = proc->threads;
-	pmem_region_t *pmr = NULL;
 	void *mem = NULL;
 
-	while(thread != NULL)
-	{
-		pmr = thread->pmemRegions;
-
-		while(pmr != NULL)
-		{
-			pmmngr_free_block((physical_addr)(pmr->pageIndex * PAGE_SIZE));
+	// Shared frames are only freed once no other process maps them
+	vmmngr_release_user_space(proc->pdPhysical);
 
-			mem = (void *)pmr;
-			pmr = pmr->next;
-			kfree(mem);
-		}
+	vmregion_destroy_all(proc);
 
+	while(thread != NULL)
+	{
 		mem = (void *)thread;
 		thread = thread->next;
-		kfree(mem);
+		kmem_cache_free(threadCache, mem);
 	}
 
 	thread = proc->blockedThreads;
 
 	while(thread != NULL)
 	{
-		pmr = thread->pmemRegions;
+		mem = (void *)thread;
+		thread = thread->next;
+		kmem_cache_free(threadCache, mem);
+	}
 
-		while(pmr != NULL)
-		{
-			pmmngr_free_block((physical_addr)(pmr->pageIndex * PAGE_SIZE));
+	kmem_cache_free(processCache, (void *)proc);
+}
 
-			mem = (void *)pmr;
-			pmr = pmr->next;
-			kfree(mem);
-		}
+/*
+Creates a copy of parent sharing its memory copy-on-write. The copy has a
+single thread, a duplicate of thread resuming with registers regs except that
+EAX is 0. Returns NULL if out of memory.
+*/
+process_t *fork_process(process_t *parent, thread_t *thread, registers_t *regs)
+{
+	physical_addr pdPhysical = vmmngr_create_address_space(PFDB_PAGE_TABLE, idCounter + 1);
 
-		mem = (void *)thread;
-		thread = thread->next;
-		kfree(mem);
+	if(pdPhysical == 0)
+		return NULL;
+
+	process_t *proc = (process_t *)kmem_cache_alloc(processCache);
+	thread_t *newThread = (thread_t *)kmem_cache_alloc(threadCache);
+
+	if((proc == NULL) || (newThread == NULL) || !vmmngr_clone_user_space(pdPhysical, idCounter + 1))
+	{
+		kmem_cache_free(processCache, proc);
+		kmem_cache_free(threadCache, newThread);
+
+		vmmngr_release_user_space(pdPhysical);
+		vmmngr_free_address_space(pdPhysical);
+
+		return NULL;
 	}
 
-	pmr = proc->pmemRegions;
+	memcpy(&newThread->regs, regs, sizeof(registers_t));
+	newThread->regs.eax = 0; // fork() returns 0 in the child
+	newThread->entryPoint = thread->entryPoint;
+	newThread->id = thread->id; // Keeps using the same stack
+	newThread->next = NULL;
 
-	while(pmr != NULL)
+	proc->threads = newThread;
+	proc->blockedThreads = NULL;
+	proc->threadIDCounter = parent->threadIDCounter;
+	proc->pdPhysical = pdPhysical;
+	proc->kernelGeneration = vmmngr_kernel_space_generation();
+	proc->regions = NULL;
+	proc->next = NULL;
+	proc->loadBinaryFrom = NULL;
+	proc->binarySize = 0; // Nothing to load
+	proc->id = ++idCounter;
+
+	if(!vmregion_clone(proc, parent))
 	{
-		pmmngr_free_block((physical_addr)(pmr->pageIndex * PAGE_SIZE));
+		process_destroy(proc);
+		vmmngr_free_address_space(pdPhysical);
 
-		mem = pmr;
-		pmr = pmr->next;
-		kfree(mem);
+		return NULL;
 	}
 
-	kfree((void *)proc);
+	return proc;
 }
 
 process_t *add_kernel_process(void *entry)
 {
-	physical_addr pdPhysical = (physical_addr)pmmngr_alloc_block();
+	physical_addr pdPhysical = vmmngr_create_address_space(PFDB_PAGE_TABLE | PFDB_KERNEL, idCounter + 1);
 
 	if(pdPhysical == 0)
 		return NULL;
 
-	if(!vmmngr_map_page(pdPhysical, PAGEDIR_TEMP))
+	process_t *proc = (process_t *)kmem_cache_alloc(processCache);
+	thread_t *thread = (thread_t *)kmem_cache_alloc(threadCache);
+	void *stack = kpage_alloc(KERNEL_PROCESS_STACK_PAGES, 0);
+
+	if((proc == NULL) || (thread == NULL) || (stack == NULL))
 	{
-		pmmngr_free_block(pdPhysical);
+		kpage_free(stack, KERNEL_PROCESS_STACK_PAGES);
+		kmem_cache_free(processCache, proc);
+		kmem_cache_free(threadCache, thread);
+		vmmngr_free_address_space(pdPhysical);
 
 		return NULL;
 	}
 
-	vmmngr_flush_tlb_entry(PAGEDIR_TEMP);
-
-	pdirectory *pd = (pdirectory *)PAGEDIR_TEMP;
-
-	// Clear page directory
-	memsetd((uint32_t *)pd, 0, sizeof(pdirectory) / 4);
-
-	process_t *proc = (process_t *)kmalloc(sizeof(process_t));
-
 	proc->threadIDCounter = 0;
-	proc->threads = (thread_t *)kmalloc(sizeof(thread_t));
+	proc->threads = thread;
 	proc->threads->next = NULL;
 	proc->threads->id = ++(proc->threadIDCounter);
-	proc->threads->pmemRegions = NULL;
 	proc->blockedThreads = NULL;
 
 	registers_t *pRegs = &proc->threads->regs;
@@ -324,14 +289,15 @@ process_t *add_kernel_process(void *entry)
 	pRegs->gs = pRegs->ds;
 	pRegs->ss = pRegs->ds;
 	pRegs->eflags = 0x202; // Standard EFLAGS
-	pRegs->useresp = (uint32_t)kmalloc(1024) + 1024;
+	pRegs->useresp = (uint32_t)stack + KERNEL_PROCESS_STACK_PAGES * PAGE_SIZE;
 
 	proc->pdPhysical = pdPhysical;
+	proc->kernelGeneration = vmmngr_kernel_space_generation();
+	proc->regions = NULL;
 	proc->next = NULL;
 	proc->loadBinaryFrom = NULL;
 	proc->binarySize = 0;
 	proc->id = ++idCounter;
-	proc->pmemRegions = NULL;
 
 	return proc;
 }
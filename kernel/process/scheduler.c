@@ -11,7 +11,6 @@ Task scheduler for Lithium OS.
 #include <print.h>
 
 #define KERNEL_STACK_ADDRESS	0xF0002000
-#define PAGEDIR_TEMP 			0xFFBFF000
 
 process_t *pQueue = NULL;
 process_t *currentProc = NULL;
@@ -75,18 +74,8 @@ void scheduler_switch_process(registers_t *regs)
 
 	memcpy(regs, &currentThread->regs, sizeof(registers_t));
 
-	vmmngr_map_page(currentProc->pdPhysical, PAGEDIR_TEMP);
-	vmmngr_flush_tlb_entry(PAGEDIR_TEMP);
-
-	uint32_t pdOffset = PAGE_DIRECTORY_INDEX(0xC0000000) * sizeof(pd_entry);
-
-	// Copy kernel address space
-	memcpy((void *)(PAGEDIR_TEMP + pdOffset), (void *)(PAGE_DIRECTORY_ADDRESS + pdOffset),
-		PAGE_DIRECTORY_SIZE - pdOffset);
-
-	// Update physical address of page directory to match new process (recursive paging)
-	pd_entry *pde = vmmngr_pdirectory_lookup_entry((pdirectory *)PAGEDIR_TEMP, PAGE_DIRECTORY_ADDRESS);
-	pd_entry_set_frame(pde, currentProc->pdPhysical);
+	// Usually nothing to do since the kernel's page tables are shared
+	vmmngr_sync_kernel_space(currentProc->pdPhysical, &currentProc->kernelGeneration);
 
 	vmmngr_switch_pdirectory(currentProc->pdPhysical);
 }
@@ -120,7 +109,16 @@ void scheduler_setup_tss(void)
 {
 	uint32_t stackAddr = KERNEL_STACK_ADDRESS;
 
-	void *tss = kmalloc(104);
+	// Aligned so the TSS can't straddle a page boundary
+	void *tss = kmalloc_aligned(104, 128);
+
+	// Nothing can run in user mode without it
+	if(tss == NULL)
+	{
+		print_string("Allocating the TSS failed! System halting.\n");
+		disable_interrupts();
+		halt_cpu();
+	}
 
 	memset(tss, 0, 104);
 
@@ -153,7 +151,7 @@ uint32_t scheduler_setup_current_thread(isr_t *stk)
 		currentProc->binarySize = 0;
 	}
 
-	ret = init_thread_stack(currentThread, &stk->useresp);
+	ret = init_thread_stack(currentProc, currentThread, &stk->useresp);
 
 	if(ret)
 		return ret;
@@ -184,6 +182,9 @@ uint32_t scheduler_add_thread(uint32_t procID, uint32_t entryPoint)
 
 	thread->next = add_thread(proc, entryPoint);
 
+	if(thread->next == NULL)
+		return 0;
+
 	return thread->next->id;
 }
 
@@ -192,7 +193,19 @@ void scheduler_remove_current_process(isr_t *stk)
 	process_t *procToRemove = currentProc;
 	uint32_t pdPhysical = procToRemove->pdPhysical;
 
-	previousProc->next = procToRemove->next;
+	// previousProc is the process run last, not necessarily the one before
+	// this one in the queue
+	if(pQueue == procToRemove)
+		pQueue = procToRemove->next;
+	else
+	{
+		process_t *p = pQueue;
+
+		while(p->next != procToRemove)
+			p = p->next;
+
+		p->next = procToRemove->next;
+	}
 
 	registers_t regs;
 	regs.gs = stk->gs;
@@ -237,13 +250,66 @@ void scheduler_remove_current_process(isr_t *stk)
 
 	process_destroy(procToRemove);
 
-	pmmngr_free_block(pdPhysical);
+	vmmngr_free_address_space(pdPhysical);
+}
+
+process_t *scheduler_get_current_process(void)
+{
+	return currentProc;
+}
+
+process_t *scheduler_get_process_queue(void)
+{
+	return pQueue;
+}
+
+/*
+Forks the current process for a system call. The child is added to the end of
+the queue and its ID returned, or 0 if it couldn't be created.
+*/
+uint32_t scheduler_fork_current_process(isr_t *stk)
+{
+	registers_t regs;
+	regs.gs = stk->gs;
+	regs.fs = stk->fs;
+	regs.es = stk->es;
+	regs.ds = stk->ds;
+	regs.edi = stk->edi;
+	regs.esi = stk->esi;
+	regs.ebp = stk->ebp;
+	regs.esp = stk->esp;
+	regs.ebx = stk->ebx;
+	regs.edx = stk->edx;
+	regs.ecx = stk->ecx;
+	regs.eax = stk->eax;
+	regs.eip = stk->eip;
+	regs.cs = stk->cs;
+	regs.eflags = stk->eflags;
+	regs.useresp = stk->useresp;
+	regs.ss = stk->ss;
+
+	process_t *child = fork_process(currentProc, currentThread, &regs);
+
+	if(child == NULL)
+		return 0;
+
+	process_t *p = pQueue;
+
+	while(p->next != NULL)
+		p = p->next;
+
+	p->next = child;
+
+	return child->id;
 }
 
 uint32_t scheduler_add_kernel_process(void *entry)
 {
 	process_t *proc = add_kernel_process(entry);
 
+	if(proc == NULL)
+		return 0;
+
 	process_t *p = pQueue;
 
 	if(p == NULL)
@@ -3,10 +3,38 @@
 #include <stdinc.h>
 #include <vmmngr.h>
 #include <scheduler.h>
+#include <pfdb.h>
+#include <vmregion.h>
+#include <pmmngr.h>
+#include <swap.h>
+#include <zram.h>
 
 #define SYSCALL_PRINT 			0
 #define SYSCALL_VIRTUAL_ALLOC 	1
 #define SYSCALL_EXIT			2
+#define SYSCALL_FORK			3
+#define SYSCALL_MEMINFO			4
+
+// SYSCALL_VIRTUAL_ALLOC flags
+#define VIRTUAL_ALLOC_POPULATE	1	// Commit the pages now rather than on first touch
+
+// Filled in by SYSCALL_MEMINFO, the same as in the API's syscalls.h
+typedef struct
+{
+	uint32_t totalFrames;
+	uint32_t freeFrames;
+	uint32_t zramPages;				// Pages held compressed in memory
+	uint32_t zramCompressedBytes;	// Their total compressed size
+	uint32_t zramPoolFrames;		// Frames used to hold them
+	uint32_t zramRejectedPages;		// Pages that didn't compress well enough
+	uint32_t zramFaultIns;			// Pages decompressed on a page fault
+	uint32_t zramFaultInCycles;		// Time spent on those (wraps around)
+	uint32_t zramMaxFaultInCycles;
+	uint32_t swapSlotsUsed;			// Pages in the swap area
+	uint32_t swapSlotCount;
+	uint32_t swapPagesOut;
+	uint32_t swapPagesIn;
+} meminfo_t;
 
 void call_handler(isr_t *stk)
 {
@@ -19,34 +47,75 @@ void call_handler(isr_t *stk)
 
 		case SYSCALL_VIRTUAL_ALLOC:
 			// EBX: Start address
-			// ECX: Number of pages to map
+			// ECX: Number of pages to reserve
+			// EDX: Flags
 
-			stk->eax = (uint32_t)TRUE;
+			{
+				process_t *proc = scheduler_get_current_process();
+				virtual_addr start = stk->ebx & ~(uint32_t)(PAGE_SIZE - 1);
+
+				// Pages are committed by the page fault handler when first touched
+				// unless they are asked for now. Only the user half can be reserved.
+				// Pages already in a region (like the end of the last ELF segment,
+				// which the heap can share a page with) are left alone.
+				stk->eax = (uint32_t)vmregion_reserve_unused(proc, start, stk->ecx, VM_REGION_READ | VM_REGION_WRITE,
+					VM_REGION_ANONYMOUS, VM_REGION_DEMAND_ZERO);
+
+				if(stk->eax && (stk->edx & VIRTUAL_ALLOC_POPULATE))
+					stk->eax = (uint32_t)vmmngr_alloc_range(start, stk->ecx, VMM_USER | VMM_WRITABLE, proc->id, NULL);
+			}
+
+			break;
+
+		case SYSCALL_EXIT:
+			scheduler_remove_current_process(stk);
+
+			break;
+
+		case SYSCALL_FORK:
+			// Returns the child's ID to the parent, 0 to the child and
+			// 0xFFFFFFFF if the child couldn't be created
+			stk->eax = scheduler_fork_current_process(stk);
+
+			if(stk->eax == 0)
+				stk->eax = 0xFFFFFFFF;
+
+			break;
+
+		case SYSCALL_MEMINFO:
+			// EBX: Address of a meminfo_t to fill in
 
-			for(uint32_t i = 0; i < stk->ecx; ++i)
 			{
-				virtual_addr addr = stk->ebx + i * PAGE_SIZE;
+				process_t *proc = scheduler_get_current_process();
+				vm_region_t *region = vmregion_find(proc, stk->ebx);
 
-				if(!vmmngr_alloc_page(addr))
+				// Only memory the process has reserved can be written to
+				if((region == NULL) || !(region->permissions & VM_REGION_WRITE) ||
+					(region->end - stk->ebx < sizeof(meminfo_t)))
 				{
-					stk->eax = (uint32_t)FALSE;
+					stk->eax = FALSE;
 
 					break;
 				}
 
-				pd_entry *pde = (pd_entry *)(PAGE_DIRECTORY_ADDRESS + PAGE_DIRECTORY_INDEX(addr) * sizeof(pd_entry));
-				pd_entry_add_attrib(pde, PDE_USER);
+				meminfo_t *info = (meminfo_t *)stk->ebx;
+				zram_stats_t zram;
 
-				pt_entry *pte = (pt_entry *)((uint32_t)vmmngr_get_ptable_address(addr) +
-					PAGE_TABLE_INDEX(addr) * sizeof(pt_entry));
+				zram_get_stats(&zram);
 
-				pt_entry_add_attrib(pte, PTE_USER);
-			}
-
-			break;
+				info->totalFrames = pmmngr_get_block_count();
+				info->freeFrames = pmmngr_get_free_block_count();
+				info->zramPages = zram.storedPages;
+				info->zramCompressedBytes = zram.compressedBytes;
+				info->zramPoolFrames = zram.poolFrames;
+				info->zramRejectedPages = zram.rejectedPages;
+				info->zramFaultIns = zram.faultIns;
+				info->zramFaultInCycles = zram.faultInCycles;
+				info->zramMaxFaultInCycles = zram.maxFaultInCycles;
+				swap_get_stats(&info->swapSlotsUsed, &info->swapSlotCount, &info->swapPagesOut, &info->swapPagesIn);
 
-		case SYSCALL_EXIT:
-			scheduler_remove_current_process(stk);
+				stk->eax = TRUE;
+			}
 
 			break;
 	}
@@ -0,0 +1,449 @@
+/*
+Lithium OS per-process virtual memory regions.
+
+A region is a range of a process's user address space that is valid, with its
+permissions and what backs it. Pages in demand-zero regions are committed on
+first touch by the page fault handler, so memory is only used for the pages a
+process actually uses.
+
+Each process keeps its regions in an AVL tree keyed by start address, so
+looking up the region for a fault and reserving a range take O(log n).
+Regions never overlap. Adjacent regions with the same attributes are merged.
+Regions are allocated from their own slab cache.
+*/
+
+#include <vmregion.h>
+#include <slab.h>
+
+static kmem_cache_t *regionCache = NULL;
+
+static int32_t vmregion_height(vm_region_t *node);
+static void vmregion_update_height(vm_region_t *node);
+static vm_region_t *vmregion_rotate_right(vm_region_t *node);
+static vm_region_t *vmregion_rotate_left(vm_region_t *node);
+static vm_region_t *vmregion_balance(vm_region_t *node);
+static vm_region_t *vmregion_insert(vm_region_t *node, vm_region_t *region);
+static vm_region_t *vmregion_remove(vm_region_t *node, virtual_addr start);
+static vm_region_t *vmregion_find_touching(vm_region_t *node, virtual_addr start, virtual_addr end,
+	vm_region_t *like, bool same);
+static bool vmregion_same(vm_region_t *a, vm_region_t *b);
+static vm_region_t *vmregion_find_next(vm_region_t *node, virtual_addr addr);
+static virtual_addr vmregion_next_gap(process_t *proc, virtual_addr addr, virtual_addr end, virtual_addr *gapEnd);
+static void vmregion_fill(vm_region_t *region, virtual_addr start, virtual_addr end, uint32_t permissions,
+	uint32_t type, uint32_t flags);
+static void vmregion_add(process_t *proc, vm_region_t *region);
+static vm_region_t *vmregion_copy_tree(vm_region_t *node, bool *ok);
+static void vmregion_free_tree(vm_region_t *node);
+
+/*
+Creates the cache regions are allocated from. Must be called after
+kmalloc_init().
+*/
+bool vmregion_init(void)
+{
+	regionCache = kmem_cache_create("vm_region", sizeof(vm_region_t));
+
+	return regionCache != NULL;
+}
+
+/*
+Reserves pageCount pages from the page aligned address start in proc's user
+address space. Any regions with the same attributes that the range overlaps or
+touches are merged into it. Returns FALSE if the range isn't in the user half,
+overlaps a region with different attributes or if out of memory.
+*/
+bool vmregion_reserve(process_t *proc, virtual_addr start, uint32_t pageCount, uint32_t permissions,
+	uint32_t type, uint32_t flags)
+{
+	if((start & (PAGE_SIZE - 1)) || (pageCount == 0) || (start >= KERNEL_VIRTUAL_BASE)
+		|| (pageCount > (KERNEL_VIRTUAL_BASE - start) / PAGE_SIZE))
+		return FALSE;
+
+	vm_region_t *region = (vm_region_t *)kmem_cache_alloc(regionCache);
+
+	if(region == NULL)
+		return FALSE;
+
+	vmregion_fill(region, start, start + pageCount * PAGE_SIZE, permissions, type, flags);
+
+	// Regions with other attributes may touch the range but not overlap it
+	if(vmregion_find_touching(proc->regions, start + 1, region->end - 1, region, FALSE) != NULL)
+	{
+		kmem_cache_free(regionCache, region);
+
+		return FALSE;
+	}
+
+	vmregion_add(proc, region);
+
+	return TRUE;
+}
+
+/*
+Like vmregion_reserve(), but parts of the range that are already in a region
+are left as they are, whatever their attributes. If out of memory nothing is
+reserved.
+*/
+bool vmregion_reserve_unused(process_t *proc, virtual_addr start, uint32_t pageCount, uint32_t permissions,
+	uint32_t type, uint32_t flags)
+{
+	if((start & (PAGE_SIZE - 1)) || (pageCount == 0) || (start >= KERNEL_VIRTUAL_BASE)
+		|| (pageCount > (KERNEL_VIRTUAL_BASE - start) / PAGE_SIZE))
+		return FALSE;
+
+	virtual_addr end = start + pageCount * PAGE_SIZE;
+	virtual_addr addr;
+	virtual_addr gapEnd;
+	vm_region_t *spare = NULL;
+
+	// Allocate a region for every gap before reserving any, so there's nothing
+	// to undo if the cache runs out. Spares are chained through left.
+	for(addr = vmregion_next_gap(proc, start, end, &gapEnd); addr < end; addr = vmregion_next_gap(proc, gapEnd, end, &gapEnd))
+	{
+		vm_region_t *region = (vm_region_t *)kmem_cache_alloc(regionCache);
+
+		if(region == NULL)
+		{
+			while(spare != NULL)
+			{
+				region = spare;
+				spare = spare->left;
+				kmem_cache_free(regionCache, region);
+			}
+
+			return FALSE;
+		}
+
+		region->left = spare;
+		spare = region;
+	}
+
+	// Merging doesn't move the gaps, so this finds the same ones
+	for(addr = vmregion_next_gap(proc, start, end, &gapEnd); addr < end; addr = vmregion_next_gap(proc, gapEnd, end, &gapEnd))
+	{
+		vm_region_t *region = spare;
+
+		spare = spare->left;
+		vmregion_fill(region, addr, gapEnd, permissions, type, flags);
+		vmregion_add(proc, region);
+	}
+
+	return TRUE;
+}
+
+/*
+Returns the region of proc containing addr, or NULL if it isn't reserved.
+*/
+vm_region_t *vmregion_find(process_t *proc, virtual_addr addr)
+{
+	vm_region_t *node = proc->regions;
+
+	while(node != NULL)
+	{
+		if(addr < node->start)
+			node = node->left;
+		else if(addr >= node->end)
+			node = node->right;
+		else
+			return node;
+	}
+
+	return NULL;
+}
+
+/*
+Gives dst (which has no regions) a copy of src's regions. Returns FALSE if out
+of memory, in which case dst is left with none.
+*/
+bool vmregion_clone(process_t *dst, process_t *src)
+{
+	bool ok = TRUE;
+
+	dst->regions = vmregion_copy_tree(src->regions, &ok);
+
+	if(!ok)
+	{
+		vmregion_free_tree(dst->regions);
+		dst->regions = NULL;
+	}
+
+	return ok;
+}
+
+/*
+Frees the regions of proc. Pages committed in them are released with the rest
+of the address space.
+*/
+void vmregion_destroy_all(process_t *proc)
+{
+	vmregion_free_tree(proc->regions);
+	proc->regions = NULL;
+}
+
+static int32_t vmregion_height(vm_region_t *node)
+{
+	return (node == NULL) ? 0 : node->height;
+}
+
+static void vmregion_update_height(vm_region_t *node)
+{
+	int32_t left = vmregion_height(node->left);
+	int32_t right = vmregion_height(node->right);
+
+	node->height = ((left > right) ? left : right) + 1;
+}
+
+static vm_region_t *vmregion_rotate_right(vm_region_t *node)
+{
+	vm_region_t *pivot = node->left;
+
+	node->left = pivot->right;
+	pivot->right = node;
+
+	vmregion_update_height(node);
+	vmregion_update_height(pivot);
+
+	return pivot;
+}
+
+static vm_region_t *vmregion_rotate_left(vm_region_t *node)
+{
+	vm_region_t *pivot = node->right;
+
+	node->right = pivot->left;
+	pivot->left = node;
+
+	vmregion_update_height(node);
+	vmregion_update_height(pivot);
+
+	return pivot;
+}
+
+/*
+Restores the AVL property at node after one of its subtrees changed height by
+one. Returns the new root of the subtree.
+*/
+static vm_region_t *vmregion_balance(vm_region_t *node)
+{
+	vmregion_update_height(node);
+
+	int32_t balance = vmregion_height(node->left) - vmregion_height(node->right);
+
+	if(balance > 1)
+	{
+		if(vmregion_height(node->left->left) < vmregion_height(node->left->right))
+			node->left = vmregion_rotate_left(node->left);
+
+		return vmregion_rotate_right(node);
+	}
+
+	if(balance < -1)
+	{
+		if(vmregion_height(node->right->right) < vmregion_height(node->right->left))
+			node->right = vmregion_rotate_right(node->right);
+
+		return vmregion_rotate_left(node);
+	}
+
+	return node;
+}
+
+static vm_region_t *vmregion_insert(vm_region_t *node, vm_region_t *region)
+{
+	if(node == NULL)
+		return region;
+
+	if(region->start < node->start)
+		node->left = vmregion_insert(node->left, region);
+	else
+		node->right = vmregion_insert(node->right, region);
+
+	return vmregion_balance(node);
+}
+
+/*
+Removes and frees the region starting at start from the subtree. Returns the
+new root of the subtree.
+*/
+static vm_region_t *vmregion_remove(vm_region_t *node, virtual_addr start)
+{
+	if(node == NULL)
+		return NULL;
+
+	if(start < node->start)
+		node->left = vmregion_remove(node->left, start);
+	else if(start > node->start)
+		node->right = vmregion_remove(node->right, start);
+	else
+	{
+		if((node->left == NULL) || (node->right == NULL))
+		{
+			vm_region_t *child = (node->left != NULL) ? node->left : node->right;
+
+			kmem_cache_free(regionCache, node);
+
+			return child;
+		}
+
+		// Take the place of the next region along, then remove that one
+		vm_region_t *next = node->right;
+
+		while(next->left != NULL)
+			next = next->left;
+
+		node->start = next->start;
+		node->end = next->end;
+		node->permissions = next->permissions;
+		node->type = next->type;
+		node->flags = next->flags;
+
+		node->right = vmregion_remove(node->right, next->start);
+	}
+
+	return vmregion_balance(node);
+}
+
+/*
+Returns a region in the subtree that touches [start, end] (an inclusive range,
+so adjacent regions count) and has the same attributes as like if same is
+TRUE, or different ones if it is FALSE. Returns NULL if there isn't one.
+*/
+static vm_region_t *vmregion_find_touching(vm_region_t *node, virtual_addr start, virtual_addr end,
+	vm_region_t *like, bool same)
+{
+	while(node != NULL)
+	{
+		if(end < node->start)
+			node = node->left;
+		else if(start > node->end)
+			node = node->right;
+		else
+		{
+			if(vmregion_same(node, like) == same)
+				return node;
+
+			// Both sides may still hold matches
+			vm_region_t *r = vmregion_find_touching(node->left, start, end, like, same);
+
+			if(r != NULL)
+				return r;
+
+			node = node->right;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+Returns the first region in the subtree starting above addr, or NULL.
+*/
+static vm_region_t *vmregion_find_next(vm_region_t *node, virtual_addr addr)
+{
+	vm_region_t *next = NULL;
+
+	while(node != NULL)
+	{
+		if(node->start > addr)
+		{
+			next = node;
+			node = node->left;
+		}
+		else
+			node = node->right;
+	}
+
+	return next;
+}
+
+/*
+Returns the start of the first unreserved page of proc from addr, or end if
+there isn't one before end. *gapEnd is set to where that gap stops: the next
+region or end.
+*/
+static virtual_addr vmregion_next_gap(process_t *proc, virtual_addr addr, virtual_addr end, virtual_addr *gapEnd)
+{
+	vm_region_t *r;
+
+	while((addr < end) && ((r = vmregion_find(proc, addr)) != NULL))
+		addr = r->end;
+
+	vm_region_t *next = vmregion_find_next(proc->regions, addr);
+
+	*gapEnd = ((next != NULL) && (next->start < end)) ? next->start : end;
+
+	return addr;
+}
+
+static void vmregion_fill(vm_region_t *region, virtual_addr start, virtual_addr end, uint32_t permissions,
+	uint32_t type, uint32_t flags)
+{
+	region->start = start;
+	region->end = end;
+	region->permissions = permissions;
+	region->type = type;
+	region->flags = flags;
+	region->height = 1;
+	region->left = NULL;
+	region->right = NULL;
+}
+
+/*
+Inserts region, which overlaps no region with different attributes, merging
+into it any with the same attributes that it overlaps or touches.
+*/
+static void vmregion_add(process_t *proc, vm_region_t *region)
+{
+	vm_region_t *r;
+
+	while((r = vmregion_find_touching(proc->regions, region->start, region->end, region, TRUE)) != NULL)
+	{
+		if(r->start < region->start)
+			region->start = r->start;
+
+		if(r->end > region->end)
+			region->end = r->end;
+
+		proc->regions = vmregion_remove(proc->regions, r->start);
+	}
+
+	proc->regions = vmregion_insert(proc->regions, region);
+}
+
+static bool vmregion_same(vm_region_t *a, vm_region_t *b)
+{
+	return (a->permissions == b->permissions) && (a->type == b->type) && (a->flags == b->flags);
+}
+
+static vm_region_t *vmregion_copy_tree(vm_region_t *node, bool *ok)
+{
+	if((node == NULL) || !*ok)
+		return NULL;
+
+	vm_region_t *copy = (vm_region_t *)kmem_cache_alloc(regionCache);
+
+	if(copy == NULL)
+	{
+		*ok = FALSE;
+
+		return NULL;
+	}
+
+	memcpy(copy, node, sizeof(vm_region_t));
+
+	copy->left = vmregion_copy_tree(node->left, ok);
+	copy->right = vmregion_copy_tree(node->right, ok);
+
+	return copy;
+}
+
+static void vmregion_free_tree(vm_region_t *node)
+{
+	if(node == NULL)
+		return;
+
+	vmregion_free_tree(node->left);
+	vmregion_free_tree(node->right);
+
+	kmem_cache_free(regionCache, node);
+}
@@ -49,6 +49,11 @@ inline void outportb(uint16_t port, uint8_t data)
 	__asm__ __volatile__ ("outb %1, %0" : : "Nd" (port), "a" (data));
 }
 
+inline void outportw(uint16_t port, uint16_t data)
+{
+	__asm__ __volatile__ ("outw %1, %0" : : "Nd" (port), "a" (data));
+}
+
 char *itoa(int value, char *str, int base)
 {
 	if(value == 0)
@@ -0,0 +1,139 @@
+/*
+Compressed swap test. Fills about one and a half times the free memory with
+pages that compress reasonably well, checks every page reads back correctly and
+reports how much more memory the compressed store made available.
+
+Build it, run "make inst" and build the kernel with "make DEFINES=-DZRAMTEST"
+to have the kernel start it instead of lishell.
+*/
+
+#include <stdio.h>
+#include <syscalls.h>
+
+#define PAGE_SIZE		4096
+#define WORDS_PER_PAGE	(PAGE_SIZE / sizeof(uint32_t))
+#define TEST_BASE		0x40000000
+#define CHUNK_PAGES		64
+
+static void fill_page(uint32_t *page, uint32_t number);
+static uint32_t check_page(const uint32_t *page, uint32_t number);
+static void print_ratio(const char *name, uint32_t tenths);
+
+int main(void)
+{
+	meminfo_t before, filled, after;
+
+	if(!sc_meminfo(&before))
+	{
+		printf("meminfo failed\n");
+
+		return 1;
+	}
+
+	uint32_t target = before.freeFrames + before.freeFrames / 2;
+	uint32_t pages = 0;
+
+	while(pages < target)
+	{
+		uint32_t count = target - pages < CHUNK_PAGES ? target - pages : CHUNK_PAGES;
+		uint32_t start = TEST_BASE + pages * PAGE_SIZE;
+
+		if(!sc_virtual_alloc(start, count, VIRTUAL_ALLOC_POPULATE))
+			break;
+
+		for(uint32_t i = 0; i < count; ++i)
+			fill_page((uint32_t *)(start + i * PAGE_SIZE), pages + i);
+
+		pages += count;
+	}
+
+	sc_meminfo(&filled);
+
+	uint32_t errors = 0;
+
+	for(uint32_t i = 0; i < pages; ++i)
+		errors += check_page((const uint32_t *)(TEST_BASE + i * PAGE_SIZE), i);
+
+	sc_meminfo(&after);
+
+	printf("\nFilled %d of %d pages (%d frames were free)\n", (int)pages, (int)target, (int)before.freeFrames);
+	printf("Compressed: %d pages in %d bytes, %d pool frames, %d rejected\n", (int)filled.zramPages,
+		(int)filled.zramCompressedBytes, (int)filled.zramPoolFrames, (int)filled.zramRejectedPages);
+	printf("On disk: %d pages\n", (int)filled.swapSlotsUsed);
+
+	if(filled.zramCompressedBytes >= 160)
+		print_ratio("Compression ratio", filled.zramPages * (PAGE_SIZE / 16) / (filled.zramCompressedBytes / 160));
+
+	// Pages in use against the frames actually holding them
+	uint32_t resident = pages - filled.zramPages - filled.swapSlotsUsed;
+
+	if(resident + filled.zramPoolFrames != 0)
+		print_ratio("Memory multiplier", (resident + filled.zramPages) * 10 / (resident + filled.zramPoolFrames));
+
+	uint32_t faultIns = after.zramFaultIns - filled.zramFaultIns;
+
+	if(faultIns != 0)
+	{
+		printf("Fault-ins while checking: %d, average %d cycles, max %d cycles\n", (int)faultIns,
+			(int)((after.zramFaultInCycles - filled.zramFaultInCycles) / faultIns), (int)after.zramMaxFaultInCycles);
+	}
+
+	printf("Pages read back wrong: %d\n", (int)errors);
+
+	return errors == 0 ? 0 : 1;
+}
+
+// Mostly a counting pattern with some random words mixed in
+static void fill_page(uint32_t *page, uint32_t number)
+{
+	uint32_t random = number * 2654435761u + 1;
+
+	for(uint32_t i = 0; i < WORDS_PER_PAGE; ++i)
+	{
+		if(i % 8 == 7)
+		{
+			random ^= random << 13;
+			random ^= random >> 17;
+			random ^= random << 5;
+			page[i] = random;
+		}
+		else
+		{
+			page[i] = number << 16 | i / 8;
+		}
+	}
+}
+
+static uint32_t check_page(const uint32_t *page, uint32_t number)
+{
+	uint32_t random = number * 2654435761u + 1;
+
+	for(uint32_t i = 0; i < WORDS_PER_PAGE; ++i)
+	{
+		uint32_t expected;
+
+		if(i % 8 == 7)
+		{
+			random ^= random << 13;
+			random ^= random >> 17;
+			random ^= random << 5;
+			expected = random;
+		}
+		else
+		{
+			expected = number << 16 | i / 8;
+		}
+
+		if(page[i] != expected)
+			return 1;
+	}
+
+	return 0;
+}
+
+// Prints a value given in tenths as "x.y"
+static void print_ratio(const char *name, uint32_t tenths)
+{
+	sc_print_string(name);
+	printf(": %d.%dx\n", (int)(tenths / 10), (int)(tenths % 10));
+}